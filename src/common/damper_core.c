@@ -15,9 +15,12 @@
  */
 
 #include "damper_core.h"
-#include <stdio.h>
-#include <stdarg.h>
+#include "damper_logic.h"
+#include "damper_probes.h"
+#include "damper_log.h"
+#include <stdlib.h>
 #include <math.h>
+#include <string.h>
 
 #define USEC_IN_MSEC 1000
 
@@ -26,23 +29,103 @@ int damper_button_freeze_delta_threshold = 0;
 double damper_threshold_scale_factor = 1.0;
 bool damper_verbose = false;
 
+/* Published copy of the globals above, as a seqlock: filters may run on
+ * several threads while they are updated. Nothing is published until the
+ * first update, states use the globals directly until then. */
+_Atomic uint64_t damper_params_seq = 0;
+static _Atomic int64_t published_wait_time;
+static _Atomic int published_threshold;
+static _Atomic uint64_t published_scale_bits;
+
+/* Takes a DamperLogMessage and up to DAMPER_LOG_VALUES values, which are
+ * only evaluated in verbose mode */
+#define log_message(...) log_padded (__VA_ARGS__, 0, 0, 0, 0, 0, 0)
+#define log_padded(message, a, b, c, d, e, ...) \
+    do { if (damper_verbose) damper_log_record (message, a, b, c, d, e); } while (0)
+
 static void
-log_message (const char *format, ...)
+publish_params (void)
 {
-    if (!damper_verbose)
-        return;
+    uint64_t seq = atomic_load_explicit (&damper_params_seq, memory_order_relaxed);
+    uint64_t scale_bits;
+
+    memcpy (&scale_bits, &damper_threshold_scale_factor, sizeof (scale_bits));
+
+    atomic_store_explicit (&damper_params_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence (memory_order_release);
+
+    atomic_store_explicit (&published_wait_time, damper_double_click_wait_time, memory_order_relaxed);
+    atomic_store_explicit (&published_threshold, damper_button_freeze_delta_threshold, memory_order_relaxed);
+    atomic_store_explicit (&published_scale_bits, scale_bits, memory_order_relaxed);
 
-    va_list args;
-    va_start (args, format);
-    vprintf (format, args);
-    printf ("\n");
-    va_end (args);
+    atomic_store_explicit (&damper_params_seq, seq + 2, memory_order_release);
 }
 
 void
 damper_set_threshold_scale (double scale)
 {
     damper_threshold_scale_factor = scale;
+    publish_params ();
+}
+
+void
+damper_update_params (int64_t double_click_time_usec, int threshold_px, double threshold_scale)
+{
+    damper_double_click_wait_time = double_click_time_usec;
+    damper_button_freeze_delta_threshold = threshold_px;
+    damper_threshold_scale_factor = threshold_scale;
+    publish_params ();
+}
+
+static int64_t
+threshold_sq (int threshold_px, double scale)
+{
+    double threshold = threshold_px * scale;
+
+    return (int64_t) floor (threshold * threshold);
+}
+
+void
+damper_state_load_params (DamperState *state)
+{
+    DamperParams *params = &state->params;
+    uint64_t seq, scale_bits;
+
+    do {
+        seq = atomic_load_explicit (&damper_params_seq, memory_order_acquire);
+        if (seq == 0) {
+            params->double_click_wait_time = damper_double_click_wait_time;
+            params->threshold_px = damper_button_freeze_delta_threshold;
+            params->threshold_scale = damper_threshold_scale_factor;
+            break;
+        }
+
+        params->double_click_wait_time = atomic_load_explicit (&published_wait_time, memory_order_relaxed);
+        params->threshold_px = atomic_load_explicit (&published_threshold, memory_order_relaxed);
+        scale_bits = atomic_load_explicit (&published_scale_bits, memory_order_relaxed);
+        atomic_thread_fence (memory_order_acquire);
+    } while ((seq & 1) || atomic_load_explicit (&damper_params_seq, memory_order_relaxed) != seq);
+
+    if (seq != 0)
+        memcpy (&params->threshold_scale, &scale_bits, sizeof (scale_bits));
+
+    params->breakout_threshold_sq = threshold_sq (params->threshold_px, params->threshold_scale);
+    state->params_seq = seq;
+}
+
+/* hypot (dx, dy) > threshold exactly when dx² + dy² > floor (threshold²),
+ * since the left side is an integer; this keeps the comparison integer-only
+ * for damper_logic.h */
+int64_t
+damper_breakout_threshold_sq (void)
+{
+    return threshold_sq (damper_button_freeze_delta_threshold, damper_threshold_scale_factor);
+}
+
+void
+damper_domain_init (DamperDomain *domain)
+{
+    atomic_init (&domain->freeze, 0);
 }
 
 void
@@ -54,6 +137,17 @@ damper_state_init (DamperState *state)
     state->motion_frozen = false;
     state->x_freeze_delta = 0;
     state->y_freeze_delta = 0;
+    state->domain = NULL;
+    state->domain_seen = 0;
+    memset (&state->counters, 0, sizeof (state->counters));
+    damper_state_load_params (state);
+}
+
+void
+damper_state_set_domain (DamperState *state, DamperDomain *domain)
+{
+    state->domain = domain;
+    state->domain_seen = domain ? atomic_load (&domain->freeze) : 0;
 }
 
 void
@@ -67,55 +161,200 @@ damper_state_reset (DamperState *state)
     state->y_freeze_delta = 0;
 }
 
+#define DOMAIN_FROZEN 1
+
+static const char *end_reason_names[DAMPER_END_COUNT] = {
+    [DAMPER_END_DOUBLE_CLICK] = "double-click",
+    [DAMPER_END_TIMEOUT] = "timeout",
+    [DAMPER_END_DISTANCE] = "distance",
+    [DAMPER_END_DOMAIN] = "domain",
+    [DAMPER_END_RESYNC] = "resync",
+};
+
+const char *
+damper_end_reason_name (DamperEndReason reason)
+{
+    return reason < DAMPER_END_COUNT ? end_reason_names[reason] : "unknown";
+}
+
+/* Before the state is reset; now_usec is 0 when the time isn't known */
+static void
+count_end (DamperState *state, DamperEndReason reason, int64_t now_usec)
+{
+    int64_t frozen_usec;
+
+    if (!state->motion_frozen)
+        return;
+
+    frozen_usec = now_usec > state->button_freeze_time ? now_usec - state->button_freeze_time : 0;
+    DAMPER_PROBE5 (freeze__end, state, reason, frozen_usec, state->x_freeze_delta, state->y_freeze_delta);
+
+    state->counters.ends[reason]++;
+    state->counters.frozen_usec += frozen_usec;
+}
+
+static void
+start_domain_freeze (DamperState *state)
+{
+    uint64_t word;
+
+    if (state->domain == NULL)
+        return;
+
+    /* A newer press anywhere in the domain simply replaces the freeze */
+    word = ((uint64_t) state->button_freeze_time << 1) | DOMAIN_FROZEN;
+    atomic_store (&state->domain->freeze, word);
+    state->domain_seen = word;
+}
+
+/* Resets after a breakout or release, ending the domain freeze too if it
+ * is still the one this state was following */
+static void
+reset_and_release (DamperState *state)
+{
+    damper_state_reset (state);
+
+    if (state->domain && (state->domain_seen & DOMAIN_FROZEN)) {
+        uint64_t expected = state->domain_seen;
+
+        atomic_compare_exchange_strong (&state->domain->freeze, &expected, expected & ~(uint64_t) DOMAIN_FROZEN);
+        state->domain_seen &= ~(uint64_t) DOMAIN_FROZEN;
+    }
+}
+
+/* Follows freezes started, or ended, by other members of the domain */
+static void
+sync_domain (DamperState *state, int64_t now_usec)
+{
+    uint64_t word;
+
+    if (state->domain == NULL)
+        return;
+
+    word = atomic_load (&state->domain->freeze);
+    if (word == state->domain_seen)
+        return;
+
+    state->domain_seen = word;
+
+    if (word & DOMAIN_FROZEN) {
+        log_message (DAMPER_LOG_DOMAIN_FREEZE_STARTED);
+        state->counters.freezes++;
+        state->motion_frozen = true;
+        state->button_freeze_time = (int64_t) (word >> 1);
+        state->x_freeze_delta = 0;
+        state->y_freeze_delta = 0;
+        DAMPER_PROBE3 (freeze__start, state, state->button_freeze_time, 1);
+    } else if (state->motion_frozen) {
+        log_message (DAMPER_LOG_DOMAIN_FREEZE_ENDED);
+        count_end (state, DAMPER_END_DOMAIN, now_usec);
+        damper_state_reset (state);
+    }
+}
+
+void
+damper_state_resync (DamperState *state, bool buttons_down)
+{
+    if (!buttons_down && (state->first_down || state->motion_frozen)) {
+        log_message (DAMPER_LOG_RELEASE_LOST);
+        count_end (state, DAMPER_END_RESYNC, 0);
+        reset_and_release (state);
+    } else if (buttons_down && !state->first_down) {
+        /* The press was lost; freezing this late would only eat motion */
+        log_message (DAMPER_LOG_PRESS_LOST);
+    }
+}
+
+void
+damper_state_restore (DamperState *state, const DamperState *saved)
+{
+    state->button_freeze_time = saved->button_freeze_time;
+    state->first_down = saved->first_down;
+    state->second_down = saved->second_down;
+    state->motion_frozen = saved->motion_frozen;
+    state->x_freeze_delta = saved->x_freeze_delta;
+    state->y_freeze_delta = saved->y_freeze_delta;
+    state->counters = saved->counters;
+
+    if (state->domain && (saved->domain_seen & DOMAIN_FROZEN)) {
+        uint64_t word = atomic_load (&state->domain->freeze);
+
+        /* Members come back one by one; the latest freeze wins, as it did
+         * before the handover */
+        if (saved->domain_seen > word)
+            atomic_store (&state->domain->freeze, saved->domain_seen);
+        state->domain_seen = saved->domain_seen;
+    }
+}
+
 static PlatformAction
 handle_button_event (DamperState *state, const PlatformEvent *event)
 {
     if (event->type == PLATFORM_EVENT_BUTTON_PRESS) {
-        log_message ("Button press");
+        log_message (DAMPER_LOG_BUTTON_PRESS);
         if (!state->first_down) {
-            log_message ("First down");
+            log_message (DAMPER_LOG_FIRST_DOWN);
+            state->counters.freezes++;
             state->motion_frozen = true;
             state->first_down = true;
             state->button_freeze_time = event->timestamp_usec;
+            start_domain_freeze (state);
+            DAMPER_PROBE3 (freeze__start, state, state->button_freeze_time, 0);
         } else {
-            log_message ("Second down");
+            log_message (DAMPER_LOG_SECOND_DOWN);
             state->second_down = true;
         }
     } else if (event->type == PLATFORM_EVENT_BUTTON_RELEASE) {
-        log_message ("Button release");
-        if ((event->timestamp_usec - state->button_freeze_time) > damper_double_click_wait_time ||
-            state->second_down) {
-            log_message ("Exceeded wait time or releasing second press, resetting.");
-            damper_state_reset (state);
+        log_message (DAMPER_LOG_BUTTON_RELEASE);
+        if (damper_logic_release_ends_freeze (event->timestamp_usec, state->button_freeze_time,
+                                              state->params.double_click_wait_time, state->second_down)) {
+            log_message (DAMPER_LOG_RELEASE_ENDS_FREEZE);
+            count_end (state, state->second_down ? DAMPER_END_DOUBLE_CLICK : DAMPER_END_TIMEOUT,
+                       event->timestamp_usec);
+            reset_and_release (state);
         }
     }
 
     return PLATFORM_ACTION_PASS;
 }
 
+static void
+log_thresholds (DamperLogMessage message, const DamperState *state, int64_t elapsed)
+{
+    const DamperParams *params = &state->params;
+
+    log_message (message,
+                 (int64_t) hypot (state->x_freeze_delta, state->y_freeze_delta),
+                 (int64_t) (params->threshold_px * params->threshold_scale),
+                 params->threshold_px,
+                 elapsed / USEC_IN_MSEC,
+                 params->double_click_wait_time / USEC_IN_MSEC);
+}
+
 static PlatformAction
 handle_motion_event (DamperState *state, const PlatformEvent *event)
 {
+    sync_domain (state, event->timestamp_usec);
+
     if (state->motion_frozen) {
         state->x_freeze_delta += event->data.motion.dx;
         state->y_freeze_delta += event->data.motion.dy;
 
-        log_message ("Deltas: %d, %d", state->x_freeze_delta, state->y_freeze_delta);
+        log_message (DAMPER_LOG_DELTAS, state->x_freeze_delta, state->y_freeze_delta);
 
         int64_t elapsed = event->timestamp_usec - state->button_freeze_time;
-        double real_move = hypot (state->x_freeze_delta, state->y_freeze_delta);
-        double scaled_threshold = damper_button_freeze_delta_threshold * damper_threshold_scale_factor;
-        bool within_time = elapsed < damper_double_click_wait_time;
-
-        if (real_move > scaled_threshold || !within_time) {
-            log_message ("Thresholds reached, resetting (%dpx > %dpx [scaled from %d], %ldms > %ldms)",
-                        (int)real_move, (int)scaled_threshold, damper_button_freeze_delta_threshold,
-                        (long)(elapsed / USEC_IN_MSEC), (long)(damper_double_click_wait_time / USEC_IN_MSEC));
-            damper_state_reset (state);
+        const DamperParams *params = &state->params;
+
+        if (damper_logic_breaks_out (state->x_freeze_delta, state->y_freeze_delta,
+                                     params->breakout_threshold_sq, elapsed, params->double_click_wait_time)) {
+            log_thresholds (DAMPER_LOG_BREAKOUT, state, elapsed);
+            count_end (state, elapsed < params->double_click_wait_time ? DAMPER_END_DISTANCE : DAMPER_END_TIMEOUT,
+                       event->timestamp_usec);
+            reset_and_release (state);
         } else {
-            log_message ("Skipping event, thresholds not reached (%dpx < %dpx [scaled from %d], %ldms < %ldms)",
-                        (int)real_move, (int)scaled_threshold, damper_button_freeze_delta_threshold,
-                        (long)(elapsed / USEC_IN_MSEC), (long)(damper_double_click_wait_time / USEC_IN_MSEC));
+            log_thresholds (DAMPER_LOG_SKIP, state, elapsed);
+            state->counters.dropped_events++;
+            state->counters.dropped_px += abs (event->data.motion.dx) + abs (event->data.motion.dy);
             return PLATFORM_ACTION_DROP;
         }
     }
@@ -126,11 +365,17 @@ handle_motion_event (DamperState *state, const PlatformEvent *event)
 PlatformAction
 damper_handle_event (DamperState *state, const PlatformEvent *event)
 {
+    PlatformAction action = PLATFORM_ACTION_PASS;
+
     if (event->type == PLATFORM_EVENT_BUTTON_PRESS || event->type == PLATFORM_EVENT_BUTTON_RELEASE) {
-        return handle_button_event (state, event);
+        action = handle_button_event (state, event);
     } else if (event->type == PLATFORM_EVENT_MOTION) {
-        return handle_motion_event (state, event);
+        action = handle_motion_event (state, event);
     }
 
-    return PLATFORM_ACTION_PASS;
+    DAMPER_PROBE7 (decision, state, (int) event->type, (int) action, (int) state->motion_frozen,
+                   state->x_freeze_delta, state->y_freeze_delta,
+                   state->motion_frozen ? event->timestamp_usec - state->button_freeze_time : 0);
+
+    return action;
 }
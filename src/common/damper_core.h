@@ -18,6 +18,52 @@
 #define DAMPER_CORE_H
 
 #include "platform.h"
+#include <stdatomic.h>
+#include <stddef.h>
+
+/* Devices sharing a domain freeze together: a first press on any member
+ * freezes motion from all of them, and a breakout on any member ends it.
+ * The freeze is one atomic word, (press time << 1) | frozen, so members
+ * can be driven from different threads without locking. */
+typedef struct {
+    _Atomic uint64_t freeze;
+} DamperDomain;
+
+/* The parameters a state filters with. Each state keeps its own copy and
+ * picks up changes only between frames, see damper_state_sync_params (). */
+typedef struct {
+    int64_t double_click_wait_time;
+    int threshold_px;
+    double threshold_scale;
+    int64_t breakout_threshold_sq;
+} DamperParams;
+
+/* Why a freeze ended */
+typedef enum {
+    /* Release of a second press */
+    DAMPER_END_DOUBLE_CLICK,
+    /* Release or motion after the double-click time */
+    DAMPER_END_TIMEOUT,
+    /* Motion past the threshold */
+    DAMPER_END_DISTANCE,
+    /* Ended by another device in the domain */
+    DAMPER_END_DOMAIN,
+    /* Release lost with dropped events */
+    DAMPER_END_RESYNC,
+    DAMPER_END_COUNT
+} DamperEndReason;
+
+/* Kept by the core as it filters, at a few increments per freeze and per
+ * dropped event; passed events cost nothing */
+typedef struct {
+    uint64_t freezes;
+    uint64_t ends[DAMPER_END_COUNT];
+    uint64_t dropped_events;
+    /* Sum of |dx| + |dy| over the dropped motion */
+    uint64_t dropped_px;
+    /* From each press to the end of its freeze, resyncs excepted */
+    uint64_t frozen_usec;
+} DamperCounters;
 
 typedef struct {
     int64_t button_freeze_time;
@@ -26,16 +72,58 @@ typedef struct {
     bool motion_frozen;
     int x_freeze_delta;
     int y_freeze_delta;
+    DamperDomain *domain;
+    /* Last domain word this state acted on */
+    uint64_t domain_seen;
+    DamperParams params;
+    uint64_t params_seq;
+    DamperCounters counters;
 } DamperState;
 
 extern int64_t damper_double_click_wait_time;
 extern int damper_button_freeze_delta_threshold;
 extern double damper_threshold_scale_factor;
 extern bool damper_verbose;
+/* Odd while damper_update_params () is publishing */
+extern _Atomic uint64_t damper_params_seq;
 
+void damper_domain_init(DamperDomain *domain);
 void damper_state_init(DamperState *state);
+void damper_state_set_domain(DamperState *state, DamperDomain *domain);
 void damper_state_reset(DamperState *state);
+/* Rebuilds the state after input was lost, from whether any button is
+ * still down according to the device */
+void damper_state_resync(DamperState *state, bool buttons_down);
+/* Carries the freeze and the counters of a state saved by a previous
+ * daemon image over, after the state has joined its domain */
+void damper_state_restore(DamperState *state, const DamperState *saved);
 void damper_set_threshold_scale(double scale);
+/* Changes the parameters while filters are running, from one thread at a
+ * time. States see either the old or the new set, never a mix. */
+void damper_update_params(int64_t double_click_time_usec, int threshold_px, double threshold_scale);
+void damper_state_load_params(DamperState *state);
+/* Squared breakout distance in pixels, after scaling */
+int64_t damper_breakout_threshold_sq(void);
 PlatformAction damper_handle_event(DamperState *state, const PlatformEvent *event);
+const char *damper_end_reason_name(DamperEndReason reason);
+
+/* Whether motion has to go through damper_handle_event (); when false it
+ * can neither be dropped nor change the state */
+static inline bool
+damper_state_filters_motion(DamperState *state)
+{
+    return state->motion_frozen ||
+           (state->domain != NULL &&
+            atomic_load_explicit (&state->domain->freeze, memory_order_acquire) != state->domain_seen);
+}
+
+
+/* To be called between frames: takes up parameters updated since */
+static inline void
+damper_state_sync_params(DamperState *state)
+{
+    if (atomic_load_explicit (&damper_params_seq, memory_order_acquire) != state->params_seq)
+        damper_state_load_params (state);
+}
 
 #endif
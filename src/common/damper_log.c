@@ -0,0 +1,155 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+#include "damper_log.h"
+#include <inttypes.h>
+
+/* Each slot's seq is its position in the ring when free, and one past
+ * it once filled; the producer claiming a position owns the slot until
+ * it publishes it that way. As in Vyukov's bounded queue. */
+typedef struct {
+    _Alignas (64) _Atomic size_t seq;
+    DamperLogMessage message;
+    int64_t values[DAMPER_LOG_VALUES];
+} LogSlot;
+
+/* Every value is passed as an int64_t */
+static const char *formats[DAMPER_LOG_MESSAGES] = {
+    [DAMPER_LOG_BUTTON_PRESS] = "Button press",
+    [DAMPER_LOG_FIRST_DOWN] = "First down",
+    [DAMPER_LOG_SECOND_DOWN] = "Second down",
+    [DAMPER_LOG_BUTTON_RELEASE] = "Button release",
+    [DAMPER_LOG_RELEASE_ENDS_FREEZE] = "Exceeded wait time or releasing second press, resetting.",
+    [DAMPER_LOG_DELTAS] = "Deltas: %" PRId64 ", %" PRId64,
+    [DAMPER_LOG_BREAKOUT] = "Thresholds reached, resetting (%" PRId64 "px > %" PRId64 "px [scaled from %" PRId64 "], "
+                            "%" PRId64 "ms > %" PRId64 "ms)",
+    [DAMPER_LOG_SKIP] = "Skipping event, thresholds not reached (%" PRId64 "px < %" PRId64 "px [scaled from %" PRId64 "], "
+                        "%" PRId64 "ms < %" PRId64 "ms)",
+    [DAMPER_LOG_DOMAIN_FREEZE_STARTED] = "Freeze started by another device in the domain",
+    [DAMPER_LOG_DOMAIN_FREEZE_ENDED] = "Freeze ended by another device in the domain",
+    [DAMPER_LOG_RELEASE_LOST] = "Release lost with dropped events, resetting",
+    [DAMPER_LOG_PRESS_LOST] = "Press lost with dropped events, not freezing",
+};
+
+static LogSlot slots[DAMPER_LOG_CAPACITY];
+static _Atomic size_t tail = 0;
+/* Only touched by the draining thread */
+static size_t head = 0;
+static uint64_t dropped_reported = 0;
+static _Atomic uint64_t dropped = 0;
+static atomic_bool async = false;
+
+static void
+print_record (FILE *out, DamperLogMessage message, const int64_t *values)
+{
+    fprintf (out, formats[message], values[0], values[1], values[2], values[3], values[4]);
+    fputc ('\n', out);
+}
+
+void
+damper_log_record (DamperLogMessage message, int64_t a, int64_t b, int64_t c, int64_t d, int64_t e)
+{
+    size_t pos = atomic_load_explicit (&tail, memory_order_relaxed);
+    LogSlot *slot;
+
+    if (!atomic_load_explicit (&async, memory_order_acquire)) {
+        print_record (stdout, message, (const int64_t[]) { a, b, c, d, e });
+        return;
+    }
+
+    for (;;) {
+        size_t seq;
+
+        slot = &slots[pos & (DAMPER_LOG_CAPACITY - 1)];
+        seq = atomic_load_explicit (&slot->seq, memory_order_acquire);
+
+        if (seq == pos) {
+            if (atomic_compare_exchange_weak_explicit (&tail, &pos, pos + 1,
+                                                       memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if ((intptr_t) (seq - pos) < 0) {
+            /* Not drained since the ring last went round */
+            atomic_fetch_add_explicit (&dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit (&tail, memory_order_relaxed);
+        }
+    }
+
+    slot->message = message;
+    slot->values[0] = a;
+    slot->values[1] = b;
+    slot->values[2] = c;
+    slot->values[3] = d;
+    slot->values[4] = e;
+    atomic_store_explicit (&slot->seq, pos + 1, memory_order_release);
+}
+
+void
+damper_log_start_async (void)
+{
+    if (atomic_load (&async))
+        return;
+
+    /* Also faults the ring in, away from the filtering threads */
+    for (size_t i = 0; i < DAMPER_LOG_CAPACITY; i++)
+        atomic_init (&slots[i].seq, i);
+
+    atomic_store_explicit (&tail, 0, memory_order_relaxed);
+    head = 0;
+    atomic_store_explicit (&async, true, memory_order_release);
+}
+
+void
+damper_log_stop_async (void)
+{
+    damper_log_drain (stdout);
+    atomic_store_explicit (&async, false, memory_order_release);
+}
+
+size_t
+damper_log_drain (FILE *out)
+{
+    uint64_t total_dropped;
+    size_t printed = 0;
+
+    for (;;) {
+        LogSlot *slot = &slots[head & (DAMPER_LOG_CAPACITY - 1)];
+
+        if (atomic_load_explicit (&slot->seq, memory_order_acquire) != head + 1)
+            break;
+
+        print_record (out, slot->message, slot->values);
+        atomic_store_explicit (&slot->seq, head + DAMPER_LOG_CAPACITY, memory_order_release);
+        head++;
+        printed++;
+    }
+
+    total_dropped = damper_log_dropped ();
+    if (total_dropped != dropped_reported) {
+        fprintf (out, "%" PRIu64 " verbose log records dropped\n", total_dropped - dropped_reported);
+        dropped_reported = total_dropped;
+        printed++;
+    }
+
+    return printed;
+}
+
+uint64_t
+damper_log_dropped (void)
+{
+    return atomic_load_explicit (&dropped, memory_order_relaxed);
+}
@@ -0,0 +1,61 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+#ifndef DAMPER_LOG_H
+#define DAMPER_LOG_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Verbose messages of the damper core. They are recorded as a message
+ * number and its values, and printed synchronously until a platform
+ * starts a thread draining them: from then on they go through a bounded
+ * lock-free ring, so the filtering threads neither format text nor block
+ * on stdout. A full ring drops records and counts them. */
+
+#define DAMPER_LOG_CAPACITY 4096
+#define DAMPER_LOG_VALUES 5
+
+typedef enum {
+    DAMPER_LOG_BUTTON_PRESS,
+    DAMPER_LOG_FIRST_DOWN,
+    DAMPER_LOG_SECOND_DOWN,
+    DAMPER_LOG_BUTTON_RELEASE,
+    DAMPER_LOG_RELEASE_ENDS_FREEZE,
+    DAMPER_LOG_DELTAS,
+    DAMPER_LOG_BREAKOUT,
+    DAMPER_LOG_SKIP,
+    DAMPER_LOG_DOMAIN_FREEZE_STARTED,
+    DAMPER_LOG_DOMAIN_FREEZE_ENDED,
+    DAMPER_LOG_RELEASE_LOST,
+    DAMPER_LOG_PRESS_LOST,
+    DAMPER_LOG_MESSAGES
+} DamperLogMessage;
+
+/* From any thread; never blocks once asynchronous */
+void damper_log_record(DamperLogMessage message, int64_t a, int64_t b, int64_t c, int64_t d, int64_t e);
+/* Records go to the ring from now on; someone has to drain it */
+void damper_log_start_async(void);
+/* Back to printing synchronously, once no thread is recording */
+void damper_log_stop_async(void);
+/* By a single thread: prints what was recorded, and how many records
+ * were dropped since the last call if any; returns the lines printed */
+size_t damper_log_drain(FILE *out);
+uint64_t damper_log_dropped(void);
+
+#endif
@@ -0,0 +1,43 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+#ifndef DAMPER_LOGIC_H
+#define DAMPER_LOGIC_H
+
+/* The integer decisions of the freeze logic, shared by damper_core.c and
+ * the in-kernel HID-BPF filter. No libc or floating point in here: BPF
+ * programs can use neither. */
+
+/* Whether a button release ends the freeze started by the press at
+ * freeze_time_usec */
+static inline int
+damper_logic_release_ends_freeze (long long now_usec, long long freeze_time_usec,
+                                  long long wait_usec, int second_down)
+{
+    return now_usec - freeze_time_usec > wait_usec || second_down;
+}
+
+/* Whether the motion accumulated during a freeze breaks out of it. The
+ * distance is compared squared, see damper_breakout_threshold_sq (). */
+static inline int
+damper_logic_breaks_out (long long x_delta, long long y_delta, long long threshold_sq,
+                         long long elapsed_usec, long long wait_usec)
+{
+    return x_delta * x_delta + y_delta * y_delta > threshold_sq || elapsed_usec >= wait_usec;
+}
+
+#endif
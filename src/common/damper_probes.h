@@ -0,0 +1,63 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+#ifndef DAMPER_PROBES_H
+#define DAMPER_PROBES_H
+
+/* USDT probes of the "mousedamper" provider, for bpftrace or perf to
+ * attach to a running daemon. Unattached, each is a nop instruction and
+ * its arguments, which are kept cheap to compute. Built in when
+ * <sys/sdt.h> is available (-Dusdt), otherwise the arguments are only
+ * evaluated. Probes and their arguments:
+ *
+ *   frame__read       devnode, frame time (usec), events forwarded, dropped
+ *   decision          state, PlatformEventType, PlatformAction, frozen,
+ *                     x delta, y delta, usec since the freeze started
+ *   freeze__start     state, freeze time (usec), started by another device
+ *   freeze__end       state, DamperEndReason, usec frozen (0 if unknown),
+ *                     x delta, y delta
+ *   frame__written    devnode, MouseDeviceFrameKind, latency (usec)
+ *
+ * A freeze ended by an event fires freeze__end before that event's
+ * decision. See data/platform/linux/bpftrace for examples. */
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define DAMPER_PROBE3(name, a, b, c) \
+    DTRACE_PROBE3 (mousedamper, name, a, b, c)
+#define DAMPER_PROBE4(name, a, b, c, d) \
+    DTRACE_PROBE4 (mousedamper, name, a, b, c, d)
+#define DAMPER_PROBE5(name, a, b, c, d, e) \
+    DTRACE_PROBE5 (mousedamper, name, a, b, c, d, e)
+#define DAMPER_PROBE7(name, a, b, c, d, e, f, g) \
+    DTRACE_PROBE7 (mousedamper, name, a, b, c, d, e, f, g)
+
+#else
+
+#define DAMPER_PROBE3(name, a, b, c) \
+    do { (void) (a); (void) (b); (void) (c); } while (0)
+#define DAMPER_PROBE4(name, a, b, c, d) \
+    do { (void) (a); (void) (b); (void) (c); (void) (d); } while (0)
+#define DAMPER_PROBE5(name, a, b, c, d, e) \
+    do { (void) (a); (void) (b); (void) (c); (void) (d); (void) (e); } while (0)
+#define DAMPER_PROBE7(name, a, b, c, d, e, f, g) \
+    do { (void) (a); (void) (b); (void) (c); (void) (d); (void) (e); (void) (f); (void) (g); } while (0)
+
+#endif
+
+#endif
@@ -52,6 +52,7 @@ typedef enum {
 } PlatformAction;
 
 typedef struct {
+    bool (*set_option)(const char *name, const char *value);
     bool (*init)(int64_t double_click_time_usec, int threshold_px, bool verbose);
     void (*run)(void);
     void (*cleanup)(void);
@@ -22,14 +22,43 @@
 
 #define USEC_IN_MSEC 1000
 
+static void
+print_usage (const char *prog)
+{
+    fprintf (stderr, "Usage: %s <verbose|quiet> <double-click-time-ms> <freeze-threshold-px> <threshold-scale> [--option[=value] ...]\n", prog);
+}
+
 int
 main (int argc, char *argv[])
 {
-    if (argc != 5) {
-        fprintf (stderr, "Usage: %s <verbose|quiet> <double-click-time-ms> <freeze-threshold-px> <threshold-scale>\n", argv[0]);
+    if (argc < 5) {
+        print_usage (argv[0]);
         return 1;
     }
 
+    const PlatformInterface *platform = platform_get_interface ();
+
+    /* Anything after the positional arguments is a platform option */
+    for (int i = 5; i < argc; i++) {
+        char *name = argv[i];
+        char *value;
+
+        if (strncmp (name, "--", 2) != 0) {
+            print_usage (argv[0]);
+            return 1;
+        }
+
+        name += 2;
+        value = strchr (name, '=');
+        if (value)
+            *value++ = '\0';
+
+        if (!platform->set_option (name, value)) {
+            fprintf (stderr, "Unknown or invalid option '--%s'\n", name);
+            return 1;
+        }
+    }
+
     bool verbose = strcmp (argv[1], "verbose") == 0;
     int64_t double_click_time_usec = strtoll (argv[2], NULL, 10) * USEC_IN_MSEC;
     int threshold = atoi (argv[3]);
@@ -40,16 +69,15 @@ main (int argc, char *argv[])
             threshold,
             threshold_scale);
 
-    const PlatformInterface *platform = platform_get_interface ();
+    /* Before init, which hands the parameters to every filter it creates,
+     * including those running in the kernel */
+    damper_threshold_scale_factor = threshold_scale;
 
     if (!platform->init (double_click_time_usec, threshold, verbose)) {
         fprintf (stderr, "Platform initialization failed\n");
         return 1;
     }
 
-    /* Set threshold scale factor */
-    damper_set_threshold_scale (threshold_scale);
-
     platform->run ();
 
     platform->cleanup ();
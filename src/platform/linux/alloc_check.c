@@ -0,0 +1,125 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+#include "alloc_check.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+bool alloc_check_enabled = false;
+bool alloc_check_armed = false;
+__thread int alloc_check_depth = 0;
+
+#ifdef HAVE_LIBC_MALLOC
+
+/* glibc's own entry points, so the wrappers below can stand in for the
+ * public names in the whole process */
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t n, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void *__libc_memalign (size_t alignment, size_t size);
+
+bool
+alloc_check_supported (void)
+{
+    return true;
+}
+
+/* Anything fancier than write () could allocate again */
+static void
+write_stderr (const char *text)
+{
+    ssize_t ignored = write (STDERR_FILENO, text, strlen (text));
+
+    (void) ignored;
+}
+
+static void
+check (const char *name)
+{
+    if (__builtin_expect (!alloc_check_armed || alloc_check_depth == 0, 1))
+        return;
+
+    write_stderr ("mousedamper: ");
+    write_stderr (name);
+    write_stderr (" called while handling events, aborting (--alloc-check)\n");
+    abort ();
+}
+
+void *
+malloc (size_t size)
+{
+    check ("malloc");
+    return __libc_malloc (size);
+}
+
+void *
+calloc (size_t n, size_t size)
+{
+    check ("calloc");
+    return __libc_calloc (n, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+    check ("realloc");
+    return __libc_realloc (ptr, size);
+}
+
+void *
+memalign (size_t alignment, size_t size)
+{
+    check ("memalign");
+    return __libc_memalign (alignment, size);
+}
+
+void *
+aligned_alloc (size_t alignment, size_t size)
+{
+    check ("aligned_alloc");
+    return __libc_memalign (alignment, size);
+}
+
+int
+posix_memalign (void **ptr, size_t alignment, size_t size)
+{
+    void *mem;
+
+    check ("posix_memalign");
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment % sizeof (void *) != 0)
+        return EINVAL;
+
+    mem = __libc_memalign (alignment, size);
+    if (mem == NULL)
+        return ENOMEM;
+
+    *ptr = mem;
+    return 0;
+}
+
+#else
+
+bool
+alloc_check_supported (void)
+{
+    return false;
+}
+
+#endif
@@ -0,0 +1,46 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+#ifndef ALLOC_CHECK_H
+#define ALLOC_CHECK_H
+
+#include <stdbool.h>
+
+/* Test mode (--alloc-check) for the allocation-free input path: once
+ * armed, any malloc family call made while a thread is handling events
+ * aborts the daemon. Event handling is bracketed with enter/leave, see
+ * mouse_device.c; setup, hotplug and shutdown are free to allocate. */
+extern bool alloc_check_enabled;
+extern bool alloc_check_armed;
+extern __thread int alloc_check_depth;
+
+/* Whether the malloc family could be wrapped in this build */
+bool alloc_check_supported (void);
+
+static inline void
+alloc_check_enter (void)
+{
+    alloc_check_depth++;
+}
+
+static inline void
+alloc_check_leave (void)
+{
+    alloc_check_depth--;
+}
+
+#endif
@@ -0,0 +1,101 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+#include "arena.h"
+#include "glib_compat.h"
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#define ARENA_ALIGN 64
+
+size_t arena_size_bytes = ARENA_DEFAULT_SIZE_BYTES;
+
+static char *arena = NULL;
+static size_t arena_used = 0;
+/* Devices are created concurrently at startup, see discover_mouse_devices () */
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool
+arena_init (void)
+{
+    /* Populated up front so the footprint is fixed from the start */
+    arena = mmap (NULL, arena_size_bytes, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (arena == MAP_FAILED) {
+        g_warning ("Failed to reserve %zu KiB for device state: %s", arena_size_bytes / 1024, strerror (errno));
+        arena = NULL;
+        return false;
+    }
+
+    arena_used = 0;
+    return true;
+}
+
+void
+arena_free (void)
+{
+    if (arena)
+        munmap (arena, arena_size_bytes);
+    arena = NULL;
+}
+
+void *
+arena_pool_alloc (ArenaPool *pool)
+{
+    size_t size = (pool->size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    void *object = NULL;
+
+    pthread_mutex_lock (&arena_lock);
+
+    if (pool->free_list) {
+        object = pool->free_list;
+        pool->free_list = *(void **) object;
+    } else if (arena && arena_size_bytes - arena_used >= size) {
+        object = arena + arena_used;
+        arena_used += size;
+    }
+
+    pthread_mutex_unlock (&arena_lock);
+
+    if (object == NULL) {
+        g_warning ("Out of device memory, raise --arena (currently %zu KiB)", arena_size_bytes / 1024);
+        return NULL;
+    }
+
+    memset (object, 0, pool->size);
+    return object;
+}
+
+void
+arena_pool_free (ArenaPool *pool, void *object)
+{
+    if (object == NULL)
+        return;
+
+    pthread_mutex_lock (&arena_lock);
+    *(void **) object = pool->free_list;
+    pool->free_list = object;
+    pthread_mutex_unlock (&arena_lock);
+}
+
+void
+arena_print_stats (void)
+{
+    g_print ("Device memory: %zu of %zu KiB used\n", (arena_used + 1023) / 1024, arena_size_bytes / 1024);
+}
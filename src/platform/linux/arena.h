@@ -0,0 +1,47 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Fixed-footprint memory for per-device state. One region of
+ * arena_size_bytes is mapped and faulted in at startup; objects are carved
+ * from it on first use and recycled through per-type free lists, so adding
+ * and removing devices never grows the process. */
+#define ARENA_DEFAULT_SIZE_BYTES (1024 * 1024)
+
+typedef struct {
+    size_t size;
+    void *free_list;
+} ArenaPool;
+
+#define ARENA_POOL_INIT(type) { sizeof (type), NULL }
+
+extern size_t arena_size_bytes;
+
+bool arena_init (void);
+void arena_free (void);
+/* Zeroed object of pool->size bytes, cache line aligned; NULL when the
+ * arena is used up. Safe to call from several threads. */
+void *arena_pool_alloc (ArenaPool *pool);
+void arena_pool_free (ArenaPool *pool, void *object);
+void arena_print_stats (void);
+
+#endif
@@ -0,0 +1,225 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+#define _GNU_SOURCE
+
+#include "control.h"
+#include "service.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+typedef struct {
+    gint fd;
+    gchar line[CONTROL_LINE_MAX];
+    gsize line_len;
+} ControlClient;
+
+gchar *control_socket_path = NULL;
+
+static EventLoop *control_loop = NULL;
+static ControlHandler control_handler = NULL;
+static gint listen_fd = -1;
+static GPtrArray *clients = NULL;
+
+/* Only ever removes a socket, never what a path was swapped for */
+static void
+unlink_socket (void)
+{
+    struct stat st;
+
+    if (lstat (control_socket_path, &st) == 0 && S_ISSOCK (st.st_mode))
+        unlink (control_socket_path);
+}
+
+static void
+client_free (ControlClient *client)
+{
+    event_loop_remove_watch (control_loop, client->fd);
+    close (client->fd);
+    g_free (client);
+}
+
+/* Splits in place; the array is freed with g_free () */
+static gchar **
+split_request (gchar *line)
+{
+    GPtrArray *args = g_ptr_array_new ();
+    gchar *saveptr = NULL;
+
+    for (gchar *arg = strtok_r (line, " \t\r", &saveptr); arg; arg = strtok_r (NULL, " \t\r", &saveptr))
+        g_ptr_array_add (args, arg);
+
+    g_ptr_array_add (args, NULL);
+    return (gchar **) g_ptr_array_free (args, FALSE);
+}
+
+static gboolean
+handle_request (ControlClient *client, gchar *line)
+{
+    gchar **args = split_request (line);
+    GString *reply = g_string_new (NULL);
+    const gchar *error;
+    gboolean sent;
+
+    if (args[0] == NULL)
+        error = "empty request";
+    else
+        error = control_handler (args, reply);
+
+    if (error)
+        g_string_append_printf (reply, "ERR %s\n", error);
+    else
+        g_string_append (reply, "OK\n");
+
+    /* Replies fit the socket buffer of any client reading them */
+    sent = send (client->fd, reply->str, reply->len, MSG_DONTWAIT | MSG_NOSIGNAL) == (gssize) reply->len;
+
+    g_string_free (reply, TRUE);
+    g_free (args);
+    return sent;
+}
+
+static void
+client_callback (void *data)
+{
+    ControlClient *client = data;
+    gssize len;
+
+    while ((len = recv (client->fd, client->line + client->line_len,
+                        sizeof (client->line) - 1 - client->line_len, MSG_DONTWAIT)) > 0) {
+        gchar *start = client->line;
+        gchar *newline;
+
+        client->line_len += len;
+        client->line[client->line_len] = '\0';
+
+        while ((newline = strchr (start, '\n')) != NULL) {
+            *newline = '\0';
+            if (!handle_request (client, start)) {
+                g_ptr_array_remove (clients, client);
+                return;
+            }
+            start = newline + 1;
+        }
+
+        client->line_len -= start - client->line;
+        memmove (client->line, start, client->line_len);
+
+        if (client->line_len == sizeof (client->line) - 1) {
+            g_ptr_array_remove (clients, client);
+            return;
+        }
+    }
+
+    if (len == 0 || (errno != EAGAIN && errno != EINTR))
+        g_ptr_array_remove (clients, client);
+}
+
+static void
+listen_callback (void *data)
+{
+    gint fd;
+
+    while ((fd = accept4 (listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        ControlClient *client;
+
+        if (clients->len == CONTROL_MAX_CLIENTS) {
+            close (fd);
+            continue;
+        }
+
+        client = g_new0 (ControlClient, 1);
+        client->fd = fd;
+
+        if (!event_loop_add_watch (control_loop, fd, client_callback, client)) {
+            close (fd);
+            g_free (client);
+            continue;
+        }
+
+        g_ptr_array_add (clients, client);
+    }
+}
+
+gboolean
+control_start (EventLoop *loop, ControlHandler handler)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    gid_t group = service_group_id ();
+    mode_t old_umask;
+    gint bound;
+
+    if (strlen (control_socket_path) >= sizeof (addr.sun_path)) {
+        g_warning ("Control socket path %s is too long", control_socket_path);
+        return FALSE;
+    }
+
+    g_strlcpy (addr.sun_path, control_socket_path, sizeof (addr.sun_path));
+
+    listen_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        g_warning ("Could not create the control socket: %s", strerror (errno));
+        return FALSE;
+    }
+
+    /* Left behind by a daemon that didn't exit cleanly, or by the image
+     * before a live upgrade */
+    unlink_socket ();
+
+    /* Connecting takes write access, which only root and SERVICE_GROUP
+     * get. The mode is set at creation, so nothing follows the path. */
+    old_umask = umask (group != (gid_t) -1 ? 0117 : 0177);
+    bound = bind (listen_fd, (struct sockaddr *) &addr, sizeof (addr));
+    umask (old_umask);
+
+    if (bound < 0 ||
+        (group != (gid_t) -1 && lchown (control_socket_path, -1, group) < 0) ||
+        listen (listen_fd, CONTROL_MAX_CLIENTS) < 0 ||
+        !event_loop_add_watch (loop, listen_fd, listen_callback, NULL)) {
+        g_warning ("Could not listen on %s: %s", control_socket_path, strerror (errno));
+        close (listen_fd);
+        listen_fd = -1;
+        return FALSE;
+    }
+
+    control_loop = loop;
+    control_handler = handler;
+    clients = g_ptr_array_new_with_free_func ((GDestroyNotify) client_free);
+
+    g_print ("Accepting control requests on %s\n", control_socket_path);
+    return TRUE;
+}
+
+void
+control_stop (void)
+{
+    if (listen_fd < 0)
+        return;
+
+    g_clear_pointer (&clients, g_ptr_array_unref);
+
+    event_loop_remove_watch (control_loop, listen_fd);
+    close (listen_fd);
+    listen_fd = -1;
+    unlink_socket ();
+
+    control_loop = NULL;
+    control_handler = NULL;
+}
@@ -0,0 +1,40 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include "event_loop.h"
+#include <glib.h>
+
+/* Control socket: a Unix stream socket taking one request per line, a
+ * command and its space-separated arguments. Each is answered with any
+ * number of data lines and then "OK" or "ERR <reason>". Clients are
+ * served from event loop watches between device dispatches, and never
+ * block the loop: one that doesn't take its replies is dropped. */
+
+#define CONTROL_LINE_MAX 256
+#define CONTROL_MAX_CLIENTS 16
+
+/* Appends data lines to reply; returns NULL on success or the reason */
+typedef const gchar *(*ControlHandler) (gchar **args, GString *reply);
+
+extern gchar *control_socket_path;
+
+gboolean control_start (EventLoop *loop, ControlHandler handler);
+void control_stop (void);
+
+#endif
@@ -0,0 +1,144 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+#include "event_loop.h"
+#include <string.h>
+
+#if !defined (HAVE_LIBURING) && !defined (MOUSEDAMPER_NO_GLIB)
+bool event_loop_uring_sqpoll = false;
+
+static EventLoop *
+uring_unavailable_new (bool handle_signals)
+{
+    g_warning ("mousedamper was built without io_uring support");
+    return NULL;
+}
+
+const EventLoopBackend event_loop_backend_uring = {
+    .name = "io_uring",
+    .new = uring_unavailable_new
+};
+#endif
+
+/* The GLib-free build only has the epoll loop */
+static const EventLoopBackend *backends[] = {
+    &event_loop_backend_epoll,
+#ifndef MOUSEDAMPER_NO_GLIB
+    &event_loop_backend_uring,
+    &event_loop_backend_glib,
+    &event_loop_backend_workers,
+    &event_loop_backend_pipeline,
+    &event_loop_backend_busy_poll,
+#endif
+};
+
+const EventLoopBackend *
+event_loop_backend_lookup (const char *name)
+{
+    if (name == NULL)
+        return NULL;
+
+    for (size_t i = 0; i < sizeof (backends) / sizeof (backends[0]); i++) {
+        if (strcmp (backends[i]->name, name) == 0)
+            return backends[i];
+    }
+
+    return NULL;
+}
+
+EventLoop *
+event_loop_new (const EventLoopBackend *backend, bool handle_signals)
+{
+    EventLoop *loop = backend->new (handle_signals);
+
+    if (loop) {
+        loop->backend = backend;
+        for (int i = 0; i < EVENT_LOOP_MAX_WATCHES; i++)
+            loop->watches[i].fd = -1;
+    }
+
+    return loop;
+}
+
+bool
+event_loop_add_device (EventLoop *loop, MouseDevice *device)
+{
+    return loop->backend->add_device (loop, device);
+}
+
+void
+event_loop_remove_device (EventLoop *loop, MouseDevice *device)
+{
+    loop->backend->remove_device (loop, device);
+}
+
+bool
+event_loop_add_watch (EventLoop *loop, int fd, EventLoopCallback callback, void *data)
+{
+    for (int i = 0; i < EVENT_LOOP_MAX_WATCHES; i++) {
+        EventLoopWatch *watch = &loop->watches[i];
+
+        if (watch->fd >= 0)
+            continue;
+
+        watch->fd = fd;
+        watch->callback = callback;
+        watch->data = data;
+
+        if (!loop->backend->add_watch (loop, watch)) {
+            watch->fd = -1;
+            return false;
+        }
+
+        return true;
+    }
+
+    g_warning ("Too many fds watched by the event loop");
+    return false;
+}
+
+void
+event_loop_remove_watch (EventLoop *loop, int fd)
+{
+    for (int i = 0; i < EVENT_LOOP_MAX_WATCHES; i++) {
+        EventLoopWatch *watch = &loop->watches[i];
+
+        if (watch->fd == fd) {
+            loop->backend->remove_watch (loop, watch);
+            watch->fd = -1;
+            return;
+        }
+    }
+}
+
+void
+event_loop_run (EventLoop *loop)
+{
+    loop->backend->run (loop);
+}
+
+void
+event_loop_quit (EventLoop *loop)
+{
+    loop->backend->quit (loop);
+}
+
+void
+event_loop_free (EventLoop *loop)
+{
+    loop->backend->free (loop);
+}
@@ -0,0 +1,100 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "mouse_device.h"
+#include <stdbool.h>
+
+/* Event loops drive mouse_device_dispatch () for every grabbed device.
+ * Each backend embeds EventLoop as the first member of its own struct. */
+typedef struct _EventLoop EventLoop;
+
+typedef void (*EventLoopCallback) (void *data);
+
+/* A non-device fd the loop polls too, such as the hotplug watch. The
+ * callback runs on the thread that called event_loop_run (), outside of
+ * any device dispatch, so it may add, remove and free devices. */
+typedef struct {
+    int fd;
+    EventLoopCallback callback;
+    void *data;
+} EventLoopWatch;
+
+#define EVENT_LOOP_MAX_WATCHES 8
+
+typedef struct {
+    const char *name;
+    /* handle_signals: quit on SIGINT/SIGTERM, for loops on the main thread */
+    EventLoop *(*new) (bool handle_signals);
+    /* Called before run () or from a watch callback. Once remove_device ()
+     * returns, no thread of the loop touches the device any more. */
+    bool (*add_device) (EventLoop *loop, MouseDevice *device);
+    void (*remove_device) (EventLoop *loop, MouseDevice *device);
+    bool (*add_watch) (EventLoop *loop, EventLoopWatch *watch);
+    void (*remove_watch) (EventLoop *loop, EventLoopWatch *watch);
+    /* Runs until event_loop_quit (), or a signal if handle_signals was set */
+    void (*run) (EventLoop *loop);
+    /* Must be safe to call from any thread */
+    void (*quit) (EventLoop *loop);
+    void (*free) (EventLoop *loop);
+} EventLoopBackend;
+
+struct _EventLoop {
+    const EventLoopBackend *backend;
+    EventLoopWatch watches[EVENT_LOOP_MAX_WATCHES];
+};
+
+/* Lets backends tell watch pointers apart from their device pointers */
+static inline bool
+event_loop_is_watch (EventLoop *loop, const void *ptr)
+{
+    return ptr >= (const void *) &loop->watches[0] &&
+           ptr < (const void *) &loop->watches[EVENT_LOOP_MAX_WATCHES];
+}
+
+extern const EventLoopBackend event_loop_backend_glib;
+extern const EventLoopBackend event_loop_backend_epoll;
+extern const EventLoopBackend event_loop_backend_uring;
+extern const EventLoopBackend event_loop_backend_workers;
+extern const EventLoopBackend event_loop_backend_pipeline;
+extern const EventLoopBackend event_loop_backend_busy_poll;
+
+extern bool event_loop_uring_sqpoll;
+extern int event_loop_workers;
+/* Seconds between per-worker load reports, 0 to only report on exit */
+extern int event_loop_worker_stats_interval;
+/* Capacity in events of each per-device pipeline ring, a power of two */
+extern int event_loop_pipeline_ring_size;
+/* Microseconds to keep spinning after the last event, -1 to never sleep */
+extern int event_loop_busy_poll_spin_usec;
+
+#define EVENT_LOOP_DEFAULT_BACKEND "epoll"
+
+const EventLoopBackend *event_loop_backend_lookup (const char *name);
+
+EventLoop *event_loop_new (const EventLoopBackend *backend, bool handle_signals);
+bool event_loop_add_device (EventLoop *loop, MouseDevice *device);
+void event_loop_remove_device (EventLoop *loop, MouseDevice *device);
+bool event_loop_add_watch (EventLoop *loop, int fd, EventLoopCallback callback, void *data);
+void event_loop_remove_watch (EventLoop *loop, int fd);
+void event_loop_run (EventLoop *loop);
+void event_loop_quit (EventLoop *loop);
+void event_loop_free (EventLoop *loop);
+
+#endif
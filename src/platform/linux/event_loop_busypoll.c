@@ -0,0 +1,372 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+/* Busy-poll backend: spins on non-blocking reads of every grabbed fd
+ * instead of sleeping in the kernel, trading a CPU core for the wakeup
+ * latency of each report. With a spin budget it falls back to blocking in
+ * epoll once the devices have been quiet for that long, and goes back to
+ * spinning on the next event. */
+
+#include "event_loop.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 32
+#define MAX_DEVICES 64
+#define READ_CHUNK 64
+/* Idle spins between checks for signals and hangups */
+#define CONTROL_CHECK_INTERVAL 4096
+
+int event_loop_busy_poll_spin_usec = -1;
+
+typedef struct {
+    EventLoop parent;
+    MouseDevice *devices[MAX_DEVICES];
+    atomic_bool removed[MAX_DEVICES];
+    atomic_int n_devices;
+    int epoll_fd;
+    int signal_fd;
+    int quit_fd;
+    atomic_bool running;
+    uint64_t spins;
+    uint64_t sleeps;
+} BusyPollEventLoop;
+
+static inline void
+cpu_relax (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause ();
+#elif defined(__aarch64__)
+    __asm__ __volatile__ ("yield");
+#endif
+}
+
+static int64_t
+now_usec (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+busy_poll_free (EventLoop *base)
+{
+    BusyPollEventLoop *loop = (BusyPollEventLoop *) base;
+
+    if (loop->signal_fd >= 0)
+        close (loop->signal_fd);
+    if (loop->quit_fd >= 0)
+        close (loop->quit_fd);
+    if (loop->epoll_fd >= 0)
+        close (loop->epoll_fd);
+
+    g_free (loop);
+}
+
+static bool
+watch_fd (BusyPollEventLoop *loop, int fd, void *ptr)
+{
+    struct epoll_event event = { 0 };
+
+    event.events = EPOLLIN;
+    event.data.ptr = ptr;
+
+    if (epoll_ctl (loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        g_warning ("Failed to add fd %d to epoll set: %s", fd, strerror (errno));
+        return false;
+    }
+
+    return true;
+}
+
+static EventLoop *
+busy_poll_new (bool handle_signals)
+{
+    BusyPollEventLoop *loop = g_new0 (BusyPollEventLoop, 1);
+    sigset_t mask;
+
+    loop->signal_fd = -1;
+    loop->quit_fd = -1;
+
+    /* Only used to sleep when the spin budget runs out and to notice
+     * signals, quit requests and hangups */
+    loop->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        g_warning ("Failed to create epoll instance: %s", strerror (errno));
+        busy_poll_free (&loop->parent);
+        return NULL;
+    }
+
+    loop->quit_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (loop->quit_fd < 0 || !watch_fd (loop, loop->quit_fd, &loop->quit_fd)) {
+        g_warning ("Failed to create quit eventfd: %s", strerror (errno));
+        busy_poll_free (&loop->parent);
+        return NULL;
+    }
+
+    if (!handle_signals)
+        return &loop->parent;
+
+    sigemptyset (&mask);
+    sigaddset (&mask, SIGINT);
+    sigaddset (&mask, SIGTERM);
+    sigprocmask (SIG_BLOCK, &mask, NULL);
+
+    loop->signal_fd = signalfd (-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (loop->signal_fd < 0 || !watch_fd (loop, loop->signal_fd, &loop->signal_fd)) {
+        g_warning ("Failed to create signalfd: %s", strerror (errno));
+        busy_poll_free (&loop->parent);
+        return NULL;
+    }
+
+    return &loop->parent;
+}
+
+static int
+find_device (BusyPollEventLoop *loop, MouseDevice *device)
+{
+    int n = atomic_load (&loop->n_devices);
+
+    for (int i = 0; i < n; i++) {
+        if (loop->devices[i] == device && !atomic_load (&loop->removed[i]))
+            return i;
+    }
+
+    return -1;
+}
+
+static bool
+busy_poll_add_device (EventLoop *base, MouseDevice *device)
+{
+    BusyPollEventLoop *loop = (BusyPollEventLoop *) base;
+    int n = atomic_load (&loop->n_devices);
+    int slot = n;
+
+    /* Devices are only added and removed on the loop's own thread, so a
+     * removed slot can be reused straight away */
+    for (int i = 0; i < n; i++) {
+        if (atomic_load (&loop->removed[i])) {
+            slot = i;
+            break;
+        }
+    }
+
+    if (slot == MAX_DEVICES) {
+        g_warning ("Busy-poll loop is full, not handling %s", libevdev_get_name (device->input_device));
+        return false;
+    }
+
+    if (!watch_fd (loop, device->fd, device))
+        return false;
+
+    loop->devices[slot] = device;
+    atomic_store (&loop->removed[slot], false);
+    if (slot == n)
+        atomic_store (&loop->n_devices, n + 1);
+
+    return true;
+}
+
+static void
+busy_poll_remove_device (EventLoop *base, MouseDevice *device)
+{
+    BusyPollEventLoop *loop = (BusyPollEventLoop *) base;
+    int i = find_device (loop, device);
+
+    if (i < 0)
+        return;
+
+    epoll_ctl (loop->epoll_fd, EPOLL_CTL_DEL, device->fd, NULL);
+    atomic_store (&loop->removed[i], true);
+}
+
+/* Returns true if any device had events */
+static bool
+poll_devices (BusyPollEventLoop *loop)
+{
+    int n_devices = atomic_load (&loop->n_devices);
+    bool worked = false;
+
+    mouse_device_begin_batch ();
+
+    for (int i = 0; i < n_devices; i++) {
+        MouseDevice *device = loop->devices[i];
+        struct input_event events[READ_CHUNK];
+        ssize_t len;
+
+        if (atomic_load (&loop->removed[i]))
+            continue;
+
+        len = read (device->fd, events, sizeof (events));
+        if (len <= 0) {
+            if (len < 0 && errno != EAGAIN && errno != EINTR) {
+                g_warning ("Device disconnected or error occurred: %s", strerror (errno));
+                busy_poll_remove_device (&loop->parent, device);
+            }
+            continue;
+        }
+
+        for (size_t j = 0; j < len / sizeof (struct input_event); j++) {
+            if (mouse_device_process_event (device, &events[j]))
+                mouse_device_write_frame (device);
+        }
+        worked = true;
+    }
+
+    mouse_device_end_batch ();
+
+    return worked;
+}
+
+static bool
+busy_poll_add_watch (EventLoop *base, EventLoopWatch *watch)
+{
+    return watch_fd ((BusyPollEventLoop *) base, watch->fd, watch);
+}
+
+static void
+busy_poll_remove_watch (EventLoop *base, EventLoopWatch *watch)
+{
+    BusyPollEventLoop *loop = (BusyPollEventLoop *) base;
+
+    epoll_ctl (loop->epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+}
+
+/* Handles control fds, watches and hangups, blocking for at most timeout
+ * ms. Device readiness is ignored here, the next spin picks it up. */
+static void
+wait_control (BusyPollEventLoop *loop, int timeout)
+{
+    struct epoll_event events[MAX_EVENTS];
+    EventLoopWatch *ready_watches[EVENT_LOOP_MAX_WATCHES];
+    int n_ready_watches = 0;
+    int n = epoll_wait (loop->epoll_fd, events, MAX_EVENTS, timeout);
+
+    if (n < 0) {
+        if (errno != EINTR) {
+            g_warning ("epoll_wait failed: %s", strerror (errno));
+            atomic_store (&loop->running, false);
+        }
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        void *ptr = events[i].data.ptr;
+
+        if (ptr == &loop->signal_fd) {
+            struct signalfd_siginfo info;
+
+            if (read (loop->signal_fd, &info, sizeof (info)) == sizeof (info)) {
+                g_print ("Received signal, shutting down...\n");
+                atomic_store (&loop->running, false);
+            }
+        } else if (ptr == &loop->quit_fd) {
+            uint64_t value;
+
+            if (read (loop->quit_fd, &value, sizeof (value)) == sizeof (value))
+                atomic_store (&loop->running, false);
+        } else if (event_loop_is_watch (&loop->parent, ptr)) {
+            ready_watches[n_ready_watches++] = ptr;
+        } else if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+            g_warning ("Device disconnected or error occurred");
+            busy_poll_remove_device (&loop->parent, ptr);
+        }
+    }
+
+    /* After the batch, since callbacks may free devices still in it */
+    for (int i = 0; i < n_ready_watches; i++) {
+        if (ready_watches[i]->fd >= 0)
+            ready_watches[i]->callback (ready_watches[i]->data);
+    }
+}
+
+static void
+busy_poll_run (EventLoop *base)
+{
+    BusyPollEventLoop *loop = (BusyPollEventLoop *) base;
+    int64_t spin_usec = event_loop_busy_poll_spin_usec;
+    int64_t last_event = now_usec ();
+    unsigned int idle = 0;
+
+    atomic_store (&loop->running, true);
+
+    while (atomic_load_explicit (&loop->running, memory_order_relaxed)) {
+        if (poll_devices (loop)) {
+            idle = 0;
+            if (spin_usec >= 0)
+                last_event = now_usec ();
+            continue;
+        }
+
+        loop->spins++;
+
+        if (spin_usec >= 0 && now_usec () - last_event >= spin_usec) {
+            loop->sleeps++;
+            wait_control (loop, -1);
+            last_event = now_usec ();
+            idle = 0;
+            continue;
+        }
+
+        if (++idle == CONTROL_CHECK_INTERVAL) {
+            wait_control (loop, 0);
+            idle = 0;
+        }
+
+        cpu_relax ();
+    }
+
+    if (spin_usec >= 0)
+        g_print ("Busy-poll: %lu idle spins, slept %lu times\n",
+                 (unsigned long) loop->spins, (unsigned long) loop->sleeps);
+}
+
+static void
+busy_poll_quit (EventLoop *base)
+{
+    BusyPollEventLoop *loop = (BusyPollEventLoop *) base;
+    uint64_t value = 1;
+
+    atomic_store (&loop->running, false);
+
+    if (write (loop->quit_fd, &value, sizeof (value)) < 0)
+        g_warning ("Failed to wake event loop: %s", strerror (errno));
+}
+
+const EventLoopBackend event_loop_backend_busy_poll = {
+    .name = "busy-poll",
+    .new = busy_poll_new,
+    .add_device = busy_poll_add_device,
+    .remove_device = busy_poll_remove_device,
+    .add_watch = busy_poll_add_watch,
+    .remove_watch = busy_poll_remove_watch,
+    .run = busy_poll_run,
+    .quit = busy_poll_quit,
+    .free = busy_poll_free
+};
@@ -0,0 +1,227 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+/* Native backend: a single epoll set, every ready device is handled from
+ * one epoll_wait () batch. Signals and quit requests arrive as fds too. */
+
+#include "event_loop.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 32
+
+typedef struct {
+    EventLoop parent;
+    int epoll_fd;
+    int signal_fd;
+    int quit_fd;
+    bool running;
+} EpollEventLoop;
+
+static void
+epoll_loop_free (EventLoop *base)
+{
+    EpollEventLoop *loop = (EpollEventLoop *) base;
+
+    if (loop->signal_fd >= 0)
+        close (loop->signal_fd);
+    if (loop->quit_fd >= 0)
+        close (loop->quit_fd);
+    if (loop->epoll_fd >= 0)
+        close (loop->epoll_fd);
+
+    g_free (loop);
+}
+
+static bool
+watch_fd (EpollEventLoop *loop, int fd, void *ptr)
+{
+    struct epoll_event event = { 0 };
+
+    event.events = EPOLLIN;
+    event.data.ptr = ptr;
+
+    if (epoll_ctl (loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        g_warning ("Failed to add fd %d to epoll set: %s", fd, strerror (errno));
+        return false;
+    }
+
+    return true;
+}
+
+static EventLoop *
+epoll_loop_new (bool handle_signals)
+{
+    EpollEventLoop *loop = g_new0 (EpollEventLoop, 1);
+    sigset_t mask;
+
+    loop->signal_fd = -1;
+    loop->quit_fd = -1;
+
+    loop->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        g_warning ("Failed to create epoll instance: %s", strerror (errno));
+        epoll_loop_free (&loop->parent);
+        return NULL;
+    }
+
+    loop->quit_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (loop->quit_fd < 0 || !watch_fd (loop, loop->quit_fd, &loop->quit_fd)) {
+        g_warning ("Failed to create quit eventfd: %s", strerror (errno));
+        epoll_loop_free (&loop->parent);
+        return NULL;
+    }
+
+    if (!handle_signals)
+        return &loop->parent;
+
+    /* signalfd only sees signals that are blocked for normal delivery */
+    sigemptyset (&mask);
+    sigaddset (&mask, SIGINT);
+    sigaddset (&mask, SIGTERM);
+    sigprocmask (SIG_BLOCK, &mask, NULL);
+
+    loop->signal_fd = signalfd (-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (loop->signal_fd < 0 || !watch_fd (loop, loop->signal_fd, &loop->signal_fd)) {
+        g_warning ("Failed to create signalfd: %s", strerror (errno));
+        epoll_loop_free (&loop->parent);
+        return NULL;
+    }
+
+    return &loop->parent;
+}
+
+static bool
+epoll_loop_add_device (EventLoop *base, MouseDevice *device)
+{
+    return watch_fd ((EpollEventLoop *) base, device->fd, device);
+}
+
+static void
+epoll_loop_remove_device (EventLoop *base, MouseDevice *device)
+{
+    EpollEventLoop *loop = (EpollEventLoop *) base;
+
+    epoll_ctl (loop->epoll_fd, EPOLL_CTL_DEL, device->fd, NULL);
+}
+
+static bool
+epoll_loop_add_watch (EventLoop *base, EventLoopWatch *watch)
+{
+    return watch_fd ((EpollEventLoop *) base, watch->fd, watch);
+}
+
+static void
+epoll_loop_remove_watch (EventLoop *base, EventLoopWatch *watch)
+{
+    EpollEventLoop *loop = (EpollEventLoop *) base;
+
+    epoll_ctl (loop->epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+}
+
+static void
+epoll_loop_run (EventLoop *base)
+{
+    EpollEventLoop *loop = (EpollEventLoop *) base;
+    struct epoll_event events[MAX_EVENTS];
+
+    loop->running = true;
+
+    while (loop->running) {
+        EventLoopWatch *ready_watches[EVENT_LOOP_MAX_WATCHES];
+        int n_ready_watches = 0;
+        int n = epoll_wait (loop->epoll_fd, events, MAX_EVENTS, -1);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            g_warning ("epoll_wait failed: %s", strerror (errno));
+            break;
+        }
+
+        /* Frames bound for the aggregated output go out in timestamp
+         * order once every ready device has been read */
+        mouse_device_begin_batch ();
+
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+
+            if (ptr == &loop->signal_fd) {
+                struct signalfd_siginfo info;
+
+                if (read (loop->signal_fd, &info, sizeof (info)) == sizeof (info)) {
+                    g_print ("Received signal, shutting down...\n");
+                    loop->running = false;
+                }
+            } else if (ptr == &loop->quit_fd) {
+                uint64_t value;
+
+                if (read (loop->quit_fd, &value, sizeof (value)) == sizeof (value))
+                    loop->running = false;
+            } else if (event_loop_is_watch (base, ptr)) {
+                /* Run after the batch, they may free devices still in it */
+                ready_watches[n_ready_watches++] = ptr;
+            } else {
+                MouseDevice *device = ptr;
+
+                if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                    g_warning ("Device disconnected or error occurred");
+                    epoll_loop_remove_device (base, device);
+                    continue;
+                }
+
+                mouse_device_dispatch (device);
+            }
+        }
+
+        mouse_device_end_batch ();
+
+        for (int i = 0; i < n_ready_watches; i++) {
+            if (ready_watches[i]->fd >= 0)
+                ready_watches[i]->callback (ready_watches[i]->data);
+        }
+    }
+}
+
+static void
+epoll_loop_quit (EventLoop *base)
+{
+    EpollEventLoop *loop = (EpollEventLoop *) base;
+    uint64_t value = 1;
+
+    if (write (loop->quit_fd, &value, sizeof (value)) < 0)
+        g_warning ("Failed to wake event loop: %s", strerror (errno));
+}
+
+const EventLoopBackend event_loop_backend_epoll = {
+    .name = "epoll",
+    .new = epoll_loop_new,
+    .add_device = epoll_loop_add_device,
+    .remove_device = epoll_loop_remove_device,
+    .add_watch = epoll_loop_add_watch,
+    .remove_watch = epoll_loop_remove_watch,
+    .run = epoll_loop_run,
+    .quit = epoll_loop_quit,
+    .free = epoll_loop_free
+};
@@ -0,0 +1,223 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+/* Compatibility backend: one fd source per device on a GMainLoop.
+ * The loop owns its own GMainContext so it can run on the input thread
+ * while the default context keeps serving the main thread. */
+
+#include "event_loop.h"
+#include "arena.h"
+#include <glib-unix.h>
+
+typedef struct {
+    MouseDevice *device;
+    GSource *source;
+} GlibWatch;
+
+static ArenaPool watch_pool = ARENA_POOL_INIT (GlibWatch);
+
+typedef struct {
+    EventLoop parent;
+    GMainContext *context;
+    GMainLoop *main_loop;
+    GPtrArray *watches;
+    GSource *signal_sources[2];
+    GSource *watch_sources[EVENT_LOOP_MAX_WATCHES];
+} GlibEventLoop;
+
+static void
+glib_watch_free (GlibWatch *watch)
+{
+    g_source_destroy (watch->source);
+    g_source_unref (watch->source);
+    arena_pool_free (&watch_pool, watch);
+}
+
+static gboolean
+watch_device_equal (gconstpointer a, gconstpointer b)
+{
+    const GlibWatch *watch = a;
+    return watch->device == b;
+}
+
+static gboolean
+device_event_callback (gint fd, GIOCondition condition, gpointer user_data)
+{
+    GlibWatch *watch = user_data;
+
+    if (condition & (G_IO_HUP | G_IO_ERR)) {
+        g_warning ("Device disconnected or error occurred");
+        return G_SOURCE_REMOVE;
+    }
+
+    mouse_device_dispatch (watch->device);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+signal_handler (gpointer user_data)
+{
+    GlibEventLoop *loop = user_data;
+
+    g_print ("Received signal, shutting down...\n");
+    g_main_loop_quit (loop->main_loop);
+    return G_SOURCE_CONTINUE;
+}
+
+static GSource *
+add_signal_source (GlibEventLoop *loop, gint signum)
+{
+    GSource *source = g_unix_signal_source_new (signum);
+
+    g_source_set_callback (source, signal_handler, loop, NULL);
+    g_source_attach (source, loop->context);
+
+    return source;
+}
+
+static EventLoop *
+glib_loop_new (bool handle_signals)
+{
+    GlibEventLoop *loop = g_new0 (GlibEventLoop, 1);
+
+    loop->context = g_main_context_new ();
+    loop->main_loop = g_main_loop_new (loop->context, FALSE);
+    loop->watches = g_ptr_array_new_with_free_func ((GDestroyNotify) glib_watch_free);
+
+    if (handle_signals) {
+        loop->signal_sources[0] = add_signal_source (loop, SIGINT);
+        loop->signal_sources[1] = add_signal_source (loop, SIGTERM);
+    }
+
+    return &loop->parent;
+}
+
+static bool
+glib_loop_add_device (EventLoop *base, MouseDevice *device)
+{
+    GlibEventLoop *loop = (GlibEventLoop *) base;
+    GlibWatch *watch = arena_pool_alloc (&watch_pool);
+
+    if (watch == NULL)
+        return false;
+
+    watch->device = device;
+    watch->source = g_unix_fd_source_new (device->fd, G_IO_IN | G_IO_HUP | G_IO_ERR);
+    g_source_set_callback (watch->source, (GSourceFunc) device_event_callback, watch, NULL);
+    g_source_attach (watch->source, loop->context);
+
+    g_ptr_array_add (loop->watches, watch);
+
+    return true;
+}
+
+static void
+glib_loop_remove_device (EventLoop *base, MouseDevice *device)
+{
+    GlibEventLoop *loop = (GlibEventLoop *) base;
+    guint idx;
+
+    if (g_ptr_array_find_with_equal_func (loop->watches, device, watch_device_equal, &idx))
+        g_ptr_array_remove_index (loop->watches, idx);
+}
+
+static gboolean
+watch_callback (gint fd, GIOCondition condition, gpointer user_data)
+{
+    EventLoopWatch *watch = user_data;
+
+    watch->callback (watch->data);
+    return G_SOURCE_CONTINUE;
+}
+
+static bool
+glib_loop_add_watch (EventLoop *base, EventLoopWatch *watch)
+{
+    GlibEventLoop *loop = (GlibEventLoop *) base;
+    GSource *source = g_unix_fd_source_new (watch->fd, G_IO_IN);
+
+    g_source_set_callback (source, (GSourceFunc) watch_callback, watch, NULL);
+    g_source_attach (source, loop->context);
+    loop->watch_sources[watch - base->watches] = source;
+
+    return true;
+}
+
+static void
+glib_loop_remove_watch (EventLoop *base, EventLoopWatch *watch)
+{
+    GlibEventLoop *loop = (GlibEventLoop *) base;
+    GSource **source = &loop->watch_sources[watch - base->watches];
+
+    if (*source) {
+        g_source_destroy (*source);
+        g_source_unref (*source);
+        *source = NULL;
+    }
+}
+
+static void
+glib_loop_run (EventLoop *base)
+{
+    GlibEventLoop *loop = (GlibEventLoop *) base;
+
+    g_main_context_push_thread_default (loop->context);
+    g_main_loop_run (loop->main_loop);
+    g_main_context_pop_thread_default (loop->context);
+}
+
+static void
+glib_loop_quit (EventLoop *base)
+{
+    GlibEventLoop *loop = (GlibEventLoop *) base;
+
+    g_main_loop_quit (loop->main_loop);
+}
+
+static void
+glib_loop_free (EventLoop *base)
+{
+    GlibEventLoop *loop = (GlibEventLoop *) base;
+
+    for (guint i = 0; i < G_N_ELEMENTS (loop->signal_sources); i++) {
+        if (loop->signal_sources[i]) {
+            g_source_destroy (loop->signal_sources[i]);
+            g_source_unref (loop->signal_sources[i]);
+        }
+    }
+
+    for (int i = 0; i < EVENT_LOOP_MAX_WATCHES; i++)
+        glib_loop_remove_watch (base, &base->watches[i]);
+
+    g_ptr_array_unref (loop->watches);
+    g_main_loop_unref (loop->main_loop);
+    g_main_context_unref (loop->context);
+    g_free (loop);
+}
+
+const EventLoopBackend event_loop_backend_glib = {
+    .name = "glib",
+    .new = glib_loop_new,
+    .add_device = glib_loop_add_device,
+    .remove_device = glib_loop_remove_device,
+    .add_watch = glib_loop_add_watch,
+    .remove_watch = glib_loop_remove_watch,
+    .run = glib_loop_run,
+    .quit = glib_loop_quit,
+    .free = glib_loop_free
+};
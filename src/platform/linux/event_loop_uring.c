@@ -0,0 +1,790 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+/* io_uring backend: a multishot read per grabbed evdev fd feeds events
+ * from a shared provided-buffer ring, and forwarded frames are coalesced
+ * per device into linked writes to its uinput fd, submitted once per
+ * completion batch. Device fds and the write buffers are registered with
+ * the ring where the kernel allows it, and SQPOLL can be requested with
+ * --io-uring-sqpoll so that steady-state submission needs no syscall. */
+
+#include "event_loop.h"
+#include "arena.h"
+#include <liburing.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#define RING_ENTRIES 256
+#define SQPOLL_IDLE_MSEC 2000
+#define READ_BUFFER_GROUP 0
+#define READ_BUFFERS 64
+#define READ_BUFFER_EVENTS 64
+#define WRITE_SLOTS 32
+#define WRITE_SLOT_EVENTS (MOUSE_DEVICE_FRAME_MAX * 2)
+#define MAX_FIXED_FILES 128
+
+bool event_loop_uring_sqpoll = false;
+
+typedef enum {
+    URING_OP_READ,
+    URING_OP_WRITE,
+    URING_OP_SIGNAL,
+    URING_OP_QUIT,
+    URING_OP_WATCH
+} UringOp;
+
+/* Every user_data pointer handed to the ring starts with its op */
+typedef struct {
+    UringOp op;
+} UringTag;
+
+typedef struct _UringDevice UringDevice;
+typedef struct _WriteSlot WriteSlot;
+
+struct _WriteSlot {
+    UringTag tag;
+    UringDevice *owner;
+    WriteSlot *next;
+    guint len;
+    guint n_frames;
+    struct timeval frame_times[WRITE_SLOT_EVENTS];
+    guint8 frame_kinds[WRITE_SLOT_EVENTS];
+    struct input_event events[WRITE_SLOT_EVENTS];
+};
+
+struct _UringDevice {
+    UringTag tag;
+    MouseDevice *device;
+    int input_fd;
+    int output_fd;
+    int file_index;
+    guint pending_writes;
+    bool reading;
+    bool removed;
+    /* Slots filled during the current completion batch, in order */
+    WriteSlot *batch_head;
+    WriteSlot *batch_tail;
+    UringDevice *batch_next;
+};
+
+static ArenaPool device_pool = ARENA_POOL_INIT (UringDevice);
+
+/* Multishot poll on a watched fd; freed once its last completion is in */
+typedef struct {
+    UringTag tag;
+    EventLoopWatch *watch;
+    bool armed;
+    bool pending;
+    bool removed;
+} UringWatch;
+
+typedef struct {
+    EventLoop parent;
+    struct io_uring ring;
+    bool ring_ready;
+    bool fixed_files;
+    bool fixed_buffers;
+    struct io_uring_buf_ring *buf_ring;
+    struct input_event *read_buffers;
+    WriteSlot *write_slots;
+    WriteSlot *free_slots;
+    bool file_used[MAX_FIXED_FILES / 2];
+    GPtrArray *devices;
+    GPtrArray *watches;
+    UringDevice *batch_devices;
+    int signal_fd;
+    int quit_fd;
+    UringTag signal_tag;
+    UringTag quit_tag;
+    struct signalfd_siginfo siginfo;
+    uint64_t quit_value;
+    bool running;
+} UringEventLoop;
+
+static struct io_uring_sqe *
+get_sqe (UringEventLoop *loop)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe (&loop->ring);
+
+    /* SQ full: push what we have to the kernel and try again */
+    if (sqe == NULL) {
+        io_uring_submit (&loop->ring);
+        sqe = io_uring_get_sqe (&loop->ring);
+    }
+
+    return sqe;
+}
+
+static void
+set_fixed_file (UringEventLoop *loop, struct io_uring_sqe *sqe)
+{
+    if (loop->fixed_files)
+        sqe->flags |= IOSQE_FIXED_FILE;
+}
+
+static bool
+arm_fd_read (UringEventLoop *loop, int fd, void *buf, unsigned len, UringTag *tag)
+{
+    struct io_uring_sqe *sqe = get_sqe (loop);
+
+    if (sqe == NULL)
+        return false;
+
+    io_uring_prep_read (sqe, fd, buf, len, 0);
+    io_uring_sqe_set_data (sqe, tag);
+    return true;
+}
+
+static bool
+arm_device_read (UringEventLoop *loop, UringDevice *udev)
+{
+    struct io_uring_sqe *sqe = get_sqe (loop);
+
+    if (sqe == NULL)
+        return false;
+
+    io_uring_prep_read_multishot (sqe, udev->input_fd, 0, 0, READ_BUFFER_GROUP);
+    set_fixed_file (loop, sqe);
+    io_uring_sqe_set_data (sqe, udev);
+    udev->reading = true;
+    return true;
+}
+
+static void
+recycle_read_buffer (UringEventLoop *loop, unsigned short bid)
+{
+    io_uring_buf_ring_add (loop->buf_ring,
+                           loop->read_buffers + (gsize) bid * READ_BUFFER_EVENTS,
+                           READ_BUFFER_EVENTS * sizeof (struct input_event),
+                           bid,
+                           io_uring_buf_ring_mask (READ_BUFFERS),
+                           0);
+    io_uring_buf_ring_advance (loop->buf_ring, 1);
+}
+
+static void
+release_slot (UringEventLoop *loop, WriteSlot *slot)
+{
+    slot->owner = NULL;
+    slot->next = loop->free_slots;
+    loop->free_slots = slot;
+}
+
+static void
+write_slot_sync (UringEventLoop *loop, WriteSlot *slot)
+{
+    MouseDevice *device = slot->owner->device;
+    gsize size = slot->len * sizeof (struct input_event);
+
+    if (write (device->output_fd, slot->events, size) != (gssize) size) {
+        g_warning ("Failed to write to %s: %s", device->output_devnode, strerror (errno));
+    } else {
+        for (guint i = 0; i < slot->n_frames; i++)
+            mouse_device_record_latency (device, &slot->frame_times[i], slot->frame_kinds[i]);
+    }
+}
+
+/* Writes out a device's unsubmitted frames immediately, keeping order */
+static void
+flush_device_batch_sync (UringEventLoop *loop, UringDevice *udev)
+{
+    WriteSlot *slot = udev->batch_head;
+
+    while (slot) {
+        WriteSlot *next = slot->next;
+
+        write_slot_sync (loop, slot);
+        release_slot (loop, slot);
+        slot = next;
+    }
+
+    udev->batch_head = udev->batch_tail = NULL;
+}
+
+static void
+queue_frame (UringEventLoop *loop, UringDevice *udev)
+{
+    MouseDevice *device = udev->device;
+    WriteSlot *slot = udev->batch_tail;
+
+    if (slot == NULL || slot->len + device->frame_len > WRITE_SLOT_EVENTS) {
+        slot = loop->free_slots;
+
+        if (slot == NULL) {
+            /* Every slot is in flight; stay ordered and go synchronous */
+            flush_device_batch_sync (loop, udev);
+            mouse_device_write_frame (device);
+            return;
+        }
+
+        loop->free_slots = slot->next;
+        slot->owner = udev;
+        slot->next = NULL;
+        slot->len = 0;
+        slot->n_frames = 0;
+
+        if (udev->batch_tail == NULL) {
+            udev->batch_head = slot;
+            udev->batch_next = loop->batch_devices;
+            loop->batch_devices = udev;
+        } else {
+            udev->batch_tail->next = slot;
+        }
+        udev->batch_tail = slot;
+    }
+
+    memcpy (&slot->events[slot->len], device->frame, device->frame_len * sizeof (struct input_event));
+    slot->len += device->frame_len;
+    slot->frame_times[slot->n_frames] = device->frame[device->frame_len - 1].time;
+    slot->frame_kinds[slot->n_frames++] = device->frame_kind;
+    device->frame_len = 0;
+}
+
+/* Turns each device's batch into a chain of linked writes, so frames
+ * reach uinput in order even if one of them has to be retried. */
+static void
+submit_batches (UringEventLoop *loop)
+{
+    UringDevice *udev = loop->batch_devices;
+
+    while (udev) {
+        UringDevice *next_dev = udev->batch_next;
+        WriteSlot *slot = udev->batch_head;
+
+        while (slot) {
+            WriteSlot *next = slot->next;
+            struct io_uring_sqe *sqe = get_sqe (loop);
+
+            if (sqe == NULL) {
+                write_slot_sync (loop, slot);
+                release_slot (loop, slot);
+                slot = next;
+                continue;
+            }
+
+            if (loop->fixed_buffers)
+                io_uring_prep_write_fixed (sqe, udev->output_fd, slot->events,
+                                           slot->len * sizeof (struct input_event), 0, 0);
+            else
+                io_uring_prep_write (sqe, udev->output_fd, slot->events,
+                                     slot->len * sizeof (struct input_event), 0);
+            set_fixed_file (loop, sqe);
+            if (next)
+                sqe->flags |= IOSQE_IO_LINK;
+            io_uring_sqe_set_data (sqe, slot);
+
+            udev->pending_writes++;
+            slot = next;
+        }
+
+        udev->batch_head = udev->batch_tail = NULL;
+        udev->batch_next = NULL;
+        udev = next_dev;
+    }
+
+    loop->batch_devices = NULL;
+}
+
+static void
+release_device_files (UringEventLoop *loop, UringDevice *udev)
+{
+    if (loop->fixed_files && udev->file_index >= 0) {
+        int fds[2] = { -1, -1 };
+
+        io_uring_register_files_update (&loop->ring, udev->file_index * 2, fds, 2);
+        loop->file_used[udev->file_index] = false;
+        udev->file_index = -1;
+    }
+}
+
+static void
+maybe_free_device (UringEventLoop *loop, UringDevice *udev)
+{
+    if (!udev->removed || udev->reading || udev->pending_writes > 0)
+        return;
+
+    release_device_files (loop, udev);
+    g_ptr_array_remove (loop->devices, udev);
+}
+
+static void
+handle_read (UringEventLoop *loop, UringDevice *udev, struct io_uring_cqe *cqe)
+{
+    if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        const struct input_event *events = loop->read_buffers + (gsize) bid * READ_BUFFER_EVENTS;
+        gsize n = cqe->res / sizeof (struct input_event);
+
+        for (gsize i = 0; i < n && !udev->removed; i++) {
+            if (events[i].type == EV_SYN && events[i].code == SYN_DROPPED)
+                flush_device_batch_sync (loop, udev);
+
+            if (mouse_device_process_event (udev->device, &events[i]))
+                queue_frame (loop, udev);
+        }
+
+        recycle_read_buffer (loop, bid);
+    }
+
+    if (cqe->flags & IORING_CQE_F_MORE)
+        return;
+
+    udev->reading = false;
+
+    if (udev->removed) {
+        maybe_free_device (loop, udev);
+    } else if (cqe->res >= 0 || cqe->res == -ENOBUFS) {
+        /* Multishot stops when buffers run out or the kernel decides to */
+        arm_device_read (loop, udev);
+    } else {
+        g_warning ("Device disconnected or error occurred: %s", strerror (-cqe->res));
+    }
+}
+
+static void
+handle_write (UringEventLoop *loop, WriteSlot *slot, struct io_uring_cqe *cqe)
+{
+    UringDevice *udev = slot->owner;
+
+    udev->pending_writes--;
+
+    if (!udev->removed) {
+        if (cqe->res < 0) {
+            g_warning ("Failed to write to %s: %s", udev->device->output_devnode, strerror (-cqe->res));
+        } else {
+            for (guint i = 0; i < slot->n_frames; i++)
+                mouse_device_record_latency (udev->device, &slot->frame_times[i], slot->frame_kinds[i]);
+        }
+    }
+
+    release_slot (loop, slot);
+    maybe_free_device (loop, udev);
+}
+
+static bool
+arm_watch (UringEventLoop *loop, UringWatch *uwatch)
+{
+    struct io_uring_sqe *sqe = get_sqe (loop);
+
+    if (sqe == NULL)
+        return false;
+
+    io_uring_prep_poll_multishot (sqe, uwatch->watch->fd, POLLIN);
+    io_uring_sqe_set_data (sqe, uwatch);
+    uwatch->armed = true;
+    return true;
+}
+
+static void
+handle_watch (UringEventLoop *loop, UringWatch *uwatch, struct io_uring_cqe *cqe)
+{
+    if (!uwatch->removed && cqe->res > 0)
+        uwatch->pending = true;
+
+    if (cqe->flags & IORING_CQE_F_MORE)
+        return;
+
+    uwatch->armed = false;
+
+    if (uwatch->removed)
+        g_ptr_array_remove (loop->watches, uwatch);
+    else if (cqe->res >= 0 || cqe->res == -ECANCELED)
+        arm_watch (loop, uwatch);
+    else
+        g_warning ("Failed to poll fd %d: %s", uwatch->watch->fd, strerror (-cqe->res));
+}
+
+/* Called once a completion batch is done, since callbacks may free devices */
+static void
+run_watches (UringEventLoop *loop)
+{
+    for (guint i = 0; i < loop->watches->len; i++) {
+        UringWatch *uwatch = g_ptr_array_index (loop->watches, i);
+
+        if (uwatch->pending && !uwatch->removed) {
+            uwatch->pending = false;
+            uwatch->watch->callback (uwatch->watch->data);
+        }
+    }
+}
+
+static void
+handle_completion (UringEventLoop *loop, struct io_uring_cqe *cqe)
+{
+    UringTag *tag = io_uring_cqe_get_data (cqe);
+
+    if (tag == NULL)
+        return;
+
+    switch (tag->op) {
+        case URING_OP_READ:
+            handle_read (loop, (UringDevice *) tag, cqe);
+            break;
+        case URING_OP_WRITE:
+            handle_write (loop, (WriteSlot *) tag, cqe);
+            break;
+        case URING_OP_SIGNAL:
+            if (cqe->res == sizeof (loop->siginfo)) {
+                g_print ("Received signal, shutting down...\n");
+                loop->running = false;
+            } else {
+                arm_fd_read (loop, loop->signal_fd, &loop->siginfo, sizeof (loop->siginfo), &loop->signal_tag);
+            }
+            break;
+        case URING_OP_QUIT:
+            loop->running = false;
+            break;
+        case URING_OP_WATCH:
+            handle_watch (loop, (UringWatch *) tag, cqe);
+            break;
+    }
+}
+
+static void
+uring_loop_free (EventLoop *base)
+{
+    UringEventLoop *loop = (UringEventLoop *) base;
+
+    if (loop->devices)
+        g_ptr_array_unref (loop->devices);
+    if (loop->watches)
+        g_ptr_array_unref (loop->watches);
+
+    if (loop->ring_ready) {
+        if (loop->buf_ring)
+            io_uring_free_buf_ring (&loop->ring, loop->buf_ring, READ_BUFFERS, READ_BUFFER_GROUP);
+        io_uring_queue_exit (&loop->ring);
+    }
+
+    if (loop->signal_fd >= 0)
+        close (loop->signal_fd);
+    if (loop->quit_fd >= 0)
+        close (loop->quit_fd);
+
+    g_free (loop->read_buffers);
+    g_free (loop->write_slots);
+    g_free (loop);
+}
+
+static void
+uring_device_free (UringDevice *udev)
+{
+    arena_pool_free (&device_pool, udev);
+}
+
+static bool
+setup_ring (UringEventLoop *loop)
+{
+    struct io_uring_params params;
+    struct io_uring_probe *probe;
+    int rc;
+
+    memset (&params, 0, sizeof (params));
+    if (event_loop_uring_sqpoll) {
+        params.flags = IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = SQPOLL_IDLE_MSEC;
+    } else {
+        /* Not SINGLE_ISSUER: the ring is set up here but may be driven
+         * from the input thread */
+        params.flags = IORING_SETUP_COOP_TASKRUN;
+    }
+
+    rc = io_uring_queue_init_params (RING_ENTRIES, &loop->ring, &params);
+    if (rc < 0 && params.flags != 0) {
+        if (event_loop_uring_sqpoll)
+            g_warning ("io_uring SQPOLL unavailable (%s), continuing without it", strerror (-rc));
+        memset (&params, 0, sizeof (params));
+        rc = io_uring_queue_init_params (RING_ENTRIES, &loop->ring, &params);
+    }
+
+    if (rc < 0) {
+        g_warning ("io_uring unavailable: %s", strerror (-rc));
+        return false;
+    }
+
+    loop->ring_ready = true;
+
+    probe = io_uring_get_probe_ring (&loop->ring);
+    if (probe == NULL || !io_uring_opcode_supported (probe, IORING_OP_READ_MULTISHOT)) {
+        g_warning ("io_uring multishot reads are not supported by this kernel");
+        if (probe)
+            io_uring_free_probe (probe);
+        return false;
+    }
+    io_uring_free_probe (probe);
+
+    return true;
+}
+
+static bool
+setup_buffers (UringEventLoop *loop)
+{
+    struct iovec iov;
+    int rc;
+
+    loop->read_buffers = g_new0 (struct input_event, READ_BUFFERS * READ_BUFFER_EVENTS);
+    loop->buf_ring = io_uring_setup_buf_ring (&loop->ring, READ_BUFFERS, READ_BUFFER_GROUP, 0, &rc);
+    if (loop->buf_ring == NULL) {
+        g_warning ("Failed to set up io_uring buffer ring: %s", strerror (-rc));
+        return false;
+    }
+
+    for (int i = 0; i < READ_BUFFERS; i++) {
+        io_uring_buf_ring_add (loop->buf_ring,
+                               loop->read_buffers + (gsize) i * READ_BUFFER_EVENTS,
+                               READ_BUFFER_EVENTS * sizeof (struct input_event),
+                               i,
+                               io_uring_buf_ring_mask (READ_BUFFERS),
+                               i);
+    }
+    io_uring_buf_ring_advance (loop->buf_ring, READ_BUFFERS);
+
+    loop->write_slots = g_new0 (WriteSlot, WRITE_SLOTS);
+    for (int i = 0; i < WRITE_SLOTS; i++) {
+        loop->write_slots[i].tag.op = URING_OP_WRITE;
+        release_slot (loop, &loop->write_slots[i]);
+    }
+
+    /* The whole slot pool is one registered buffer; optional */
+    iov.iov_base = loop->write_slots;
+    iov.iov_len = WRITE_SLOTS * sizeof (WriteSlot);
+    loop->fixed_buffers = io_uring_register_buffers (&loop->ring, &iov, 1) == 0;
+
+    /* Input and output fd of device n live at 2n and 2n + 1; optional */
+    loop->fixed_files = io_uring_register_files_sparse (&loop->ring, MAX_FIXED_FILES) == 0;
+
+    return true;
+}
+
+static EventLoop *
+uring_loop_new (bool handle_signals)
+{
+    UringEventLoop *loop = g_new0 (UringEventLoop, 1);
+    sigset_t mask;
+
+    loop->signal_fd = -1;
+    loop->quit_fd = -1;
+    loop->signal_tag.op = URING_OP_SIGNAL;
+    loop->quit_tag.op = URING_OP_QUIT;
+    loop->devices = g_ptr_array_new_with_free_func ((GDestroyNotify) uring_device_free);
+    loop->watches = g_ptr_array_new_with_free_func (g_free);
+
+    if (!setup_ring (loop) || !setup_buffers (loop)) {
+        uring_loop_free (&loop->parent);
+        return NULL;
+    }
+
+    loop->quit_fd = eventfd (0, EFD_CLOEXEC);
+    if (loop->quit_fd < 0) {
+        g_warning ("Failed to create quit eventfd: %s", strerror (errno));
+        uring_loop_free (&loop->parent);
+        return NULL;
+    }
+
+    arm_fd_read (loop, loop->quit_fd, &loop->quit_value, sizeof (loop->quit_value), &loop->quit_tag);
+
+    if (!handle_signals)
+        return &loop->parent;
+
+    sigemptyset (&mask);
+    sigaddset (&mask, SIGINT);
+    sigaddset (&mask, SIGTERM);
+    sigprocmask (SIG_BLOCK, &mask, NULL);
+
+    loop->signal_fd = signalfd (-1, &mask, SFD_CLOEXEC);
+    if (loop->signal_fd < 0) {
+        g_warning ("Failed to create signalfd: %s", strerror (errno));
+        uring_loop_free (&loop->parent);
+        return NULL;
+    }
+
+    arm_fd_read (loop, loop->signal_fd, &loop->siginfo, sizeof (loop->siginfo), &loop->signal_tag);
+
+    return &loop->parent;
+}
+
+static bool
+uring_loop_add_device (EventLoop *base, MouseDevice *device)
+{
+    UringEventLoop *loop = (UringEventLoop *) base;
+    UringDevice *udev = arena_pool_alloc (&device_pool);
+
+    if (udev == NULL)
+        return false;
+
+    udev->tag.op = URING_OP_READ;
+    udev->device = device;
+    udev->input_fd = device->fd;
+    udev->output_fd = device->output_fd;
+    udev->file_index = -1;
+
+    if (loop->fixed_files) {
+        for (int i = 0; i < MAX_FIXED_FILES / 2; i++) {
+            if (!loop->file_used[i]) {
+                int fds[2] = { udev->input_fd, udev->output_fd };
+
+                if (io_uring_register_files_update (&loop->ring, i * 2, fds, 2) == 2) {
+                    loop->file_used[i] = true;
+                    udev->file_index = i;
+                    udev->input_fd = i * 2;
+                    udev->output_fd = i * 2 + 1;
+                }
+                break;
+            }
+        }
+
+        if (udev->file_index < 0) {
+            g_warning ("No registered file slot for %s", libevdev_get_name (device->input_device));
+            uring_device_free (udev);
+            return false;
+        }
+    }
+
+    /* The fd stays non-blocking, as the rest of the daemon expects: the
+     * ring still arms a poll for multishot reads when one hits EAGAIN */
+    g_ptr_array_add (loop->devices, udev);
+
+    return arm_device_read (loop, udev);
+}
+
+static void
+uring_loop_remove_device (EventLoop *base, MouseDevice *device)
+{
+    UringEventLoop *loop = (UringEventLoop *) base;
+
+    for (guint i = 0; i < loop->devices->len; i++) {
+        UringDevice *udev = g_ptr_array_index (loop->devices, i);
+
+        if (udev->device != device || udev->removed)
+            continue;
+
+        flush_device_batch_sync (loop, udev);
+        udev->removed = true;
+
+        if (udev->reading) {
+            struct io_uring_sqe *sqe = get_sqe (loop);
+
+            if (sqe) {
+                io_uring_prep_cancel (sqe, udev, 0);
+                io_uring_sqe_set_data (sqe, NULL);
+                io_uring_submit (&loop->ring);
+            }
+        }
+
+        maybe_free_device (loop, udev);
+        return;
+    }
+}
+
+static bool
+uring_loop_add_watch (EventLoop *base, EventLoopWatch *watch)
+{
+    UringEventLoop *loop = (UringEventLoop *) base;
+    UringWatch *uwatch = g_new0 (UringWatch, 1);
+
+    uwatch->tag.op = URING_OP_WATCH;
+    uwatch->watch = watch;
+    g_ptr_array_add (loop->watches, uwatch);
+
+    return arm_watch (loop, uwatch);
+}
+
+static void
+uring_loop_remove_watch (EventLoop *base, EventLoopWatch *watch)
+{
+    UringEventLoop *loop = (UringEventLoop *) base;
+
+    for (guint i = 0; i < loop->watches->len; i++) {
+        UringWatch *uwatch = g_ptr_array_index (loop->watches, i);
+
+        if (uwatch->watch != watch || uwatch->removed)
+            continue;
+
+        uwatch->removed = true;
+
+        if (uwatch->armed) {
+            struct io_uring_sqe *sqe = get_sqe (loop);
+
+            if (sqe) {
+                io_uring_prep_cancel (sqe, uwatch, 0);
+                io_uring_sqe_set_data (sqe, NULL);
+                io_uring_submit (&loop->ring);
+            }
+        } else {
+            g_ptr_array_remove_index (loop->watches, i);
+        }
+        return;
+    }
+}
+
+static void
+uring_loop_run (EventLoop *base)
+{
+    UringEventLoop *loop = (UringEventLoop *) base;
+
+    loop->running = true;
+
+    while (loop->running) {
+        struct io_uring_cqe *cqe;
+        unsigned head, count = 0;
+        int rc;
+
+        rc = io_uring_submit_and_wait (&loop->ring, 1);
+        if (rc < 0 && rc != -EINTR && rc != -EBUSY) {
+            g_warning ("io_uring_submit_and_wait failed: %s", strerror (-rc));
+            break;
+        }
+
+        io_uring_for_each_cqe (&loop->ring, head, cqe) {
+            handle_completion (loop, cqe);
+            count++;
+        }
+        io_uring_cq_advance (&loop->ring, count);
+
+        run_watches (loop);
+        submit_batches (loop);
+    }
+}
+
+static void
+uring_loop_quit (EventLoop *base)
+{
+    UringEventLoop *loop = (UringEventLoop *) base;
+    uint64_t value = 1;
+
+    if (write (loop->quit_fd, &value, sizeof (value)) < 0)
+        g_warning ("Failed to wake event loop: %s", strerror (errno));
+}
+
+const EventLoopBackend event_loop_backend_uring = {
+    .name = "io_uring",
+    .new = uring_loop_new,
+    .add_device = uring_loop_add_device,
+    .remove_device = uring_loop_remove_device,
+    .add_watch = uring_loop_add_watch,
+    .remove_watch = uring_loop_remove_watch,
+    .run = uring_loop_run,
+    .quit = uring_loop_quit,
+    .free = uring_loop_free
+};
@@ -0,0 +1,100 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+#ifndef GLIB_COMPAT_H
+#define GLIB_COMPAT_H
+
+/* The device and epoll code is shared with the GLib-free daemon build
+ * (-Dminimal_daemon=true), which gets libc stand-ins for the little of
+ * GLib that code uses. Everything else includes <glib.h> directly. */
+
+#ifndef MOUSEDAMPER_NO_GLIB
+
+#include <glib.h>
+
+#else
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+typedef int gboolean;
+typedef char gchar;
+typedef int gint;
+typedef unsigned int guint;
+typedef int64_t gint64;
+typedef uint64_t guint64;
+typedef size_t gsize;
+typedef ssize_t gssize;
+typedef void *gpointer;
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+#define G_N_ELEMENTS(arr) (sizeof (arr) / sizeof ((arr)[0]))
+#define G_MAXUINT UINT_MAX
+#define G_GUINT64_FORMAT PRIu64
+
+#define g_print(...) printf (__VA_ARGS__)
+#define g_printerr(...) fprintf (stderr, __VA_ARGS__)
+#define g_warning(...) \
+    do { \
+        fputs ("** WARNING **: ", stderr); \
+        fprintf (stderr, __VA_ARGS__); \
+        fputc ('\n', stderr); \
+    } while (0)
+
+#define g_new0(type, n) ((type *) g_malloc0 (sizeof (type) * (n)))
+#define g_free(mem) free (mem)
+
+/* Like GLib, treat running out of memory as fatal */
+static inline gpointer
+g_malloc0 (gsize size)
+{
+    gpointer mem = calloc (1, size ? size : 1);
+
+    if (mem == NULL)
+        abort ();
+
+    return mem;
+}
+
+static inline gsize
+g_strlcpy (gchar *dest, const gchar *src, gsize dest_size)
+{
+    gsize len = strlen (src);
+
+    if (dest_size > 0) {
+        gsize copied = len < dest_size - 1 ? len : dest_size - 1;
+
+        memcpy (dest, src, copied);
+        dest[copied] = '\0';
+    }
+
+    return len;
+}
+
+#endif
+
+#endif
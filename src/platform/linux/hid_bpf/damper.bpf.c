@@ -0,0 +1,192 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+/* In-kernel press-freeze filter. Attached to one HID mouse, it zeroes the
+ * X/Y fields of its input reports while a freeze holds, before hid-input
+ * turns them into evdev events. The loader fills in the config map and
+ * reads the stats map; everything else stays in here. */
+
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+#include "damper_bpf.h"
+#include "../../../common/damper_logic.h"
+
+extern __u8 *hid_bpf_get_data (struct hid_bpf_ctx *ctx, unsigned int offset, const size_t rdwr_buf_size) __ksym;
+
+struct {
+    __uint (type, BPF_MAP_TYPE_ARRAY);
+    __uint (max_entries, 1);
+    __type (key, __u32);
+    __type (value, DamperBpfConfig);
+} config SEC (".maps");
+
+struct {
+    __uint (type, BPF_MAP_TYPE_ARRAY);
+    __uint (max_entries, 1);
+    __type (key, __u32);
+    __type (value, DamperBpfStats);
+} stats SEC (".maps");
+
+/* Mirrors DamperState; reports from one device are handled one at a time */
+static struct {
+    __s64 button_freeze_time;
+    __s64 x_freeze_delta;
+    __s64 y_freeze_delta;
+    __u8 buttons;
+    bool first_down;
+    bool second_down;
+    bool motion_frozen;
+} state;
+
+static __always_inline void
+reset_state (void)
+{
+    state.button_freeze_time = 0;
+    state.x_freeze_delta = 0;
+    state.y_freeze_delta = 0;
+    state.first_down = false;
+    state.second_down = false;
+    state.motion_frozen = false;
+}
+
+static __always_inline __u32
+read_bit (const __u8 *data, __u32 bit)
+{
+    return (data[(bit >> 3) & (DAMPER_BPF_REPORT_MAX - 1)] >> (bit & 7)) & 1;
+}
+
+/* Relative axes are signed, of any width up to 32 bits */
+static __always_inline __s32
+read_field (const __u8 *data, __u32 bit, __u32 size)
+{
+    __u32 value = 0;
+
+    for (__u32 i = 0; i < 32 && i < size; i++)
+        value |= read_bit (data, bit + i) << i;
+
+    if (size > 0 && size < 32 && (value & (1u << (size - 1))))
+        value |= ~0u << size;
+
+    return (__s32) value;
+}
+
+static __always_inline void
+clear_field (__u8 *data, __u32 bit, __u32 size)
+{
+    for (__u32 i = 0; i < 32 && i < size; i++) {
+        __u32 pos = bit + i;
+
+        data[(pos >> 3) & (DAMPER_BPF_REPORT_MAX - 1)] &= ~(1 << (pos & 7));
+    }
+}
+
+static __always_inline void
+handle_buttons (const DamperBpfConfig *cfg, DamperBpfStats *st, __u8 buttons, __s64 now)
+{
+    __u8 pressed = buttons & ~state.buttons;
+    __u8 released = state.buttons & ~buttons;
+
+    state.buttons = buttons;
+
+    for (int i = 0; i < DAMPER_BPF_MAX_BUTTONS; i++) {
+        if (pressed & (1 << i)) {
+            if (!state.first_down) {
+                state.motion_frozen = true;
+                state.first_down = true;
+                state.button_freeze_time = now;
+                __sync_fetch_and_add (&st->freezes, 1);
+            } else {
+                state.second_down = true;
+            }
+        }
+
+        if ((released & (1 << i)) &&
+            damper_logic_release_ends_freeze (now, state.button_freeze_time,
+                                              cfg->double_click_wait_usec, state.second_down))
+            reset_state ();
+    }
+}
+
+SEC ("struct_ops/hid_device_event")
+int BPF_PROG (damper_device_event, struct hid_bpf_ctx *hctx, enum hid_report_type type, __u64 source)
+{
+    const DamperBpfLayout *layout;
+    DamperBpfConfig *cfg;
+    DamperBpfStats *st;
+    __u32 key = 0;
+    __u8 buttons = 0;
+    __u8 *data;
+    __s32 dx, dy;
+    __s64 now;
+
+    cfg = bpf_map_lookup_elem (&config, &key);
+    st = bpf_map_lookup_elem (&stats, &key);
+    if (cfg == NULL || st == NULL || type != HID_INPUT_REPORT)
+        return 0;
+
+    layout = &cfg->layout;
+    if (hctx->size < layout->min_size)
+        return 0;
+
+    data = hid_bpf_get_data (hctx, 0, DAMPER_BPF_REPORT_MAX);
+    if (data == NULL)
+        return 0;
+
+    if (layout->report_id && data[0] != layout->report_id)
+        return 0;
+
+    now = bpf_ktime_get_ns () / 1000;
+    __sync_fetch_and_add (&st->reports, 1);
+
+    /* Buttons first, in the order hid-input reports a mouse's fields */
+    for (int i = 0; i < DAMPER_BPF_MAX_BUTTONS; i++) {
+        if (i < layout->n_buttons && read_bit (data, layout->button_bits[i]))
+            buttons |= 1 << i;
+    }
+    handle_buttons (cfg, st, buttons, now);
+
+    if (!state.motion_frozen)
+        return 0;
+
+    dx = read_field (data, layout->x_bit, layout->x_size);
+    dy = read_field (data, layout->y_bit, layout->y_size);
+    if (dx == 0 && dy == 0)
+        return 0;
+
+    state.x_freeze_delta += dx;
+    state.y_freeze_delta += dy;
+
+    if (damper_logic_breaks_out (state.x_freeze_delta, state.y_freeze_delta, cfg->threshold_sq,
+                                 now - state.button_freeze_time, cfg->double_click_wait_usec)) {
+        reset_state ();
+        return 0;
+    }
+
+    clear_field (data, layout->x_bit, layout->x_size);
+    clear_field (data, layout->y_bit, layout->y_size);
+    __sync_fetch_and_add (&st->zeroed_reports, 1);
+
+    return 0;
+}
+
+SEC (".struct_ops.link")
+struct hid_bpf_ops damper = {
+    .hid_device_event = (void *) damper_device_event,
+};
+
+char _license[] SEC ("license") = "GPL";
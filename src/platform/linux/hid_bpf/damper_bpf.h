@@ -0,0 +1,54 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+#ifndef DAMPER_BPF_H
+#define DAMPER_BPF_H
+
+/* Shared by the HID-BPF program and hid_filter.c, its loader. Both sides
+ * provide the __u8.. types, from vmlinux.h and linux/types.h. */
+
+/* Bytes of each report the program maps; every field must lie within */
+#define DAMPER_BPF_REPORT_MAX 64
+#define DAMPER_BPF_MAX_BUTTONS 3
+
+/* Where the fields the filter needs sit in the device's input report,
+ * as bit offsets from the start of the report including its ID byte */
+typedef struct {
+    __u8 report_id;
+    __u8 n_buttons;
+    __u8 x_size;
+    __u8 y_size;
+    __u16 button_bits[DAMPER_BPF_MAX_BUTTONS];
+    __u16 x_bit;
+    __u16 y_bit;
+    /* Shorter reports are passed through untouched */
+    __u16 min_size;
+} DamperBpfLayout;
+
+typedef struct {
+    DamperBpfLayout layout;
+    __s64 double_click_wait_usec;
+    __s64 threshold_sq;
+} DamperBpfConfig;
+
+typedef struct {
+    __u64 reports;
+    __u64 zeroed_reports;
+    __u64 freezes;
+} DamperBpfStats;
+
+#endif
@@ -0,0 +1,488 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+#include "hid_filter.h"
+#include "../../common/damper_core.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_HID_BPF
+#include <linux/types.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+#include "hid_bpf/damper_bpf.h"
+#include "damper.skel.h"
+#endif
+
+struct _HidFilter {
+    gchar *devnode;
+    gchar *name;
+    gint hid_id;
+#ifdef HAVE_HID_BPF
+    DamperBpfLayout layout;
+    struct damper_bpf *skel;
+    struct bpf_link *link;
+#endif
+};
+
+gboolean hid_filter_enabled = FALSE;
+
+gint
+hid_filter_get_hid_id (HidFilter *filter)
+{
+    return filter->hid_id;
+}
+
+const gchar *
+hid_filter_get_devnode (HidFilter *filter)
+{
+    return filter->devnode;
+}
+
+#ifdef HAVE_HID_BPF
+
+#define HID_MAX_REPORT_IDS 256
+#define HID_MAX_USAGES 64
+#define HID_MAX_PUSH 4
+
+#define HID_ITEM_MAIN 0
+#define HID_ITEM_GLOBAL 1
+#define HID_ITEM_LOCAL 2
+#define HID_ITEM_LONG 0xfe
+
+#define HID_MAIN_INPUT 0x8
+#define HID_GLOBAL_USAGE_PAGE 0x0
+#define HID_GLOBAL_REPORT_SIZE 0x7
+#define HID_GLOBAL_REPORT_ID 0x8
+#define HID_GLOBAL_REPORT_COUNT 0x9
+#define HID_GLOBAL_PUSH 0xa
+#define HID_GLOBAL_POP 0xb
+#define HID_LOCAL_USAGE 0x0
+#define HID_LOCAL_USAGE_MIN 0x1
+#define HID_LOCAL_USAGE_MAX 0x2
+
+#define HID_INPUT_CONSTANT (1 << 0)
+#define HID_INPUT_VARIABLE (1 << 1)
+#define HID_INPUT_RELATIVE (1 << 2)
+
+#define HID_USAGE_X 0x00010030
+#define HID_USAGE_Y 0x00010031
+#define HID_USAGE_PAGE_BUTTON 0x0009
+
+typedef struct {
+    guint32 usage_page;
+    guint32 report_size;
+    guint32 report_count;
+    guint32 report_id;
+} HidGlobals;
+
+typedef struct {
+    DamperBpfLayout layout;
+    gboolean has_x;
+    gboolean has_y;
+    guint buttons;
+    guint end_bit;
+} HidReport;
+
+/* Just enough of a report descriptor parser to find the buttons and
+ * relative X/Y of a mouse */
+typedef struct {
+    HidGlobals globals;
+    HidGlobals stack[HID_MAX_PUSH];
+    guint n_stack;
+    guint32 usages[HID_MAX_USAGES];
+    guint n_usages;
+    guint32 usage_min;
+    guint32 usage_max;
+    gboolean has_range;
+    /* Next input bit of each report, counting its ID byte */
+    guint offsets[HID_MAX_REPORT_IDS];
+    HidReport reports[HID_MAX_REPORT_IDS];
+} HidParser;
+
+static void
+add_field (HidReport *report, guint32 usage, guint bit, guint size, gboolean relative)
+{
+    DamperBpfLayout *layout = &report->layout;
+    guint button = (usage & 0xffff) - 1;
+
+    if (size == 0 || size > 32 || bit + size > DAMPER_BPF_REPORT_MAX * 8)
+        return;
+
+    if (usage == HID_USAGE_X && relative && !report->has_x) {
+        layout->x_bit = bit;
+        layout->x_size = size;
+        report->has_x = TRUE;
+    } else if (usage == HID_USAGE_Y && relative && !report->has_y) {
+        layout->y_bit = bit;
+        layout->y_size = size;
+        report->has_y = TRUE;
+    } else if ((usage >> 16) == HID_USAGE_PAGE_BUTTON && button < DAMPER_BPF_MAX_BUTTONS && size == 1) {
+        layout->button_bits[button] = bit;
+        report->buttons |= 1 << button;
+    } else {
+        return;
+    }
+
+    report->end_bit = MAX (report->end_bit, bit + size);
+}
+
+static void
+parse_input_item (HidParser *parser, guint32 flags)
+{
+    const HidGlobals *globals = &parser->globals;
+    guint id = globals->report_id;
+
+    if (id != 0 && parser->offsets[id] == 0)
+        parser->offsets[id] = 8;
+
+    /* Padding and array fields can't hold what we are after */
+    if (!(flags & HID_INPUT_CONSTANT) && (flags & HID_INPUT_VARIABLE)) {
+        for (guint i = 0; i < globals->report_count; i++) {
+            guint32 usage;
+
+            if (parser->has_range && parser->usage_min + i <= parser->usage_max)
+                usage = parser->usage_min + i;
+            else if (!parser->has_range && parser->n_usages > 0)
+                usage = parser->usages[MIN (i, parser->n_usages - 1)];
+            else
+                break;
+
+            add_field (&parser->reports[id], usage, parser->offsets[id] + i * globals->report_size,
+                       globals->report_size, flags & HID_INPUT_RELATIVE);
+        }
+    }
+
+    parser->offsets[id] += globals->report_size * globals->report_count;
+}
+
+static void
+parse_item (HidParser *parser, guint type, guint tag, guint32 value, gsize size)
+{
+    HidGlobals *globals = &parser->globals;
+
+    switch (type) {
+        case HID_ITEM_MAIN:
+            if (tag == HID_MAIN_INPUT)
+                parse_input_item (parser, value);
+            parser->n_usages = 0;
+            parser->has_range = FALSE;
+            break;
+        case HID_ITEM_GLOBAL:
+            if (tag == HID_GLOBAL_USAGE_PAGE)
+                globals->usage_page = value;
+            else if (tag == HID_GLOBAL_REPORT_SIZE)
+                globals->report_size = value;
+            else if (tag == HID_GLOBAL_REPORT_ID)
+                globals->report_id = value % HID_MAX_REPORT_IDS;
+            else if (tag == HID_GLOBAL_REPORT_COUNT)
+                globals->report_count = value;
+            else if (tag == HID_GLOBAL_PUSH && parser->n_stack < HID_MAX_PUSH)
+                parser->stack[parser->n_stack++] = *globals;
+            else if (tag == HID_GLOBAL_POP && parser->n_stack > 0)
+                *globals = parser->stack[--parser->n_stack];
+            break;
+        case HID_ITEM_LOCAL:
+            /* Four-byte usages carry their own page */
+            if (size < 4)
+                value |= globals->usage_page << 16;
+
+            if (tag == HID_LOCAL_USAGE && parser->n_usages < HID_MAX_USAGES) {
+                parser->usages[parser->n_usages++] = value;
+            } else if (tag == HID_LOCAL_USAGE_MIN) {
+                parser->usage_min = value;
+                parser->has_range = TRUE;
+            } else if (tag == HID_LOCAL_USAGE_MAX) {
+                parser->usage_max = value;
+            }
+            break;
+    }
+}
+
+/* Picks the first report with relative X/Y and at least the left button */
+static gboolean
+parse_report_descriptor (const guint8 *desc, gsize len, DamperBpfLayout *layout)
+{
+    HidParser *parser = g_new0 (HidParser, 1);
+    gboolean found = FALSE;
+    gsize pos = 0;
+
+    while (pos < len) {
+        guint8 prefix = desc[pos++];
+        gsize size = (prefix & 3) ? 1 << ((prefix & 3) - 1) : 0;
+        guint32 value = 0;
+
+        if (prefix == HID_ITEM_LONG) {
+            if (pos >= len)
+                break;
+            pos += 2 + desc[pos];
+            continue;
+        }
+
+        if (pos + size > len)
+            break;
+
+        for (gsize i = 0; i < size; i++)
+            value |= (guint32) desc[pos + i] << (8 * i);
+        pos += size;
+
+        parse_item (parser, (prefix >> 2) & 3, prefix >> 4, value, size);
+    }
+
+    for (guint id = 0; id < HID_MAX_REPORT_IDS && !found; id++) {
+        HidReport *report = &parser->reports[id];
+
+        if (!report->has_x || !report->has_y || !(report->buttons & 1))
+            continue;
+
+        *layout = report->layout;
+        layout->report_id = id;
+        layout->n_buttons = 0;
+        while (layout->n_buttons < DAMPER_BPF_MAX_BUTTONS && (report->buttons & (1 << layout->n_buttons)))
+            layout->n_buttons++;
+        layout->min_size = (report->end_bit + 7) / 8;
+        found = TRUE;
+    }
+
+    g_free (parser);
+
+    return found;
+}
+
+/* sysfs directory of the HID device behind an evdev node, if there is one */
+static gchar *
+hid_device_dir (const gchar *devnode)
+{
+    gchar *name = g_path_get_basename (devnode);
+    gchar *link = g_build_filename ("/sys/class/input", name, "device", "device", NULL);
+    gchar *subsystem_link = NULL;
+    gchar *subsystem = NULL;
+    gchar *dir = NULL;
+    char *resolved;
+
+    resolved = realpath (link, NULL);
+    if (resolved) {
+        subsystem_link = g_build_filename (resolved, "subsystem", NULL);
+        subsystem = g_file_read_link (subsystem_link, NULL);
+
+        if (subsystem && g_str_has_suffix (subsystem, "/hid"))
+            dir = g_strdup (resolved);
+
+        free (resolved);
+    }
+
+    g_free (subsystem);
+    g_free (subsystem_link);
+    g_free (link);
+    g_free (name);
+
+    return dir;
+}
+
+gint
+hid_filter_hid_id (const gchar *devnode)
+{
+    gchar *dir = hid_device_dir (devnode);
+    gchar *base, *dot;
+    gint hid_id = -1;
+
+    if (dir == NULL)
+        return -1;
+
+    /* Named BUS:VENDOR:PRODUCT.ID, the ID in hex */
+    base = g_path_get_basename (dir);
+    dot = strrchr (base, '.');
+    if (dot && dot[1] != '\0')
+        hid_id = (gint) g_ascii_strtoull (dot + 1, NULL, 16);
+
+    g_free (base);
+    g_free (dir);
+
+    return hid_id;
+}
+
+static gchar *
+read_device_name (const gchar *devnode)
+{
+    gchar *name = g_path_get_basename (devnode);
+    gchar *path = g_build_filename ("/sys/class/input", name, "device", "name", NULL);
+    gchar *contents = NULL;
+
+    if (!g_file_get_contents (path, &contents, NULL, NULL))
+        contents = g_strdup (devnode);
+
+    g_free (path);
+    g_free (name);
+
+    return g_strstrip (contents);
+}
+
+static gboolean
+read_layout (const gchar *devnode, DamperBpfLayout *layout)
+{
+    gchar *dir = hid_device_dir (devnode);
+    gchar *path;
+    gchar *desc = NULL;
+    gsize len = 0;
+    gboolean found = FALSE;
+
+    if (dir == NULL)
+        return FALSE;
+
+    path = g_build_filename (dir, "report_descriptor", NULL);
+    if (g_file_get_contents (path, &desc, &len, NULL))
+        found = parse_report_descriptor ((const guint8 *) desc, len, layout);
+
+    g_free (desc);
+    g_free (path);
+    g_free (dir);
+
+    return found;
+}
+
+HidFilter *
+hid_filter_new (const gchar *devnode, gint hid_id)
+{
+    HidFilter *filter;
+    int rc;
+
+    filter = g_new0 (HidFilter, 1);
+    filter->devnode = g_strdup (devnode);
+    filter->name = read_device_name (devnode);
+    filter->hid_id = hid_id;
+
+    if (!read_layout (devnode, &filter->layout)) {
+        g_print ("No report layout the kernel filter can handle for %s, filtering it in userspace\n",
+                 filter->name);
+        hid_filter_free (filter);
+        return NULL;
+    }
+
+    filter->skel = damper_bpf__open ();
+    if (filter->skel == NULL) {
+        g_warning ("Failed to open the HID-BPF filter: %s", strerror (errno));
+        hid_filter_free (filter);
+        return NULL;
+    }
+
+    filter->skel->struct_ops.damper->hid_id = hid_id;
+
+    rc = damper_bpf__load (filter->skel);
+    if (rc < 0) {
+        g_warning ("Failed to load the HID-BPF filter for %s: %s", filter->name, strerror (-rc));
+        hid_filter_free (filter);
+        return NULL;
+    }
+
+    hid_filter_update_config (filter);
+
+    filter->link = bpf_map__attach_struct_ops (filter->skel->maps.damper);
+    if (filter->link == NULL) {
+        g_warning ("Failed to attach the HID-BPF filter to %s: %s", filter->name, strerror (errno));
+        hid_filter_free (filter);
+        return NULL;
+    }
+
+    g_print ("Device init for %s: filtered in the kernel at %s (HID device %04X)\n",
+             filter->name, devnode, hid_id);
+
+    return filter;
+}
+
+void
+hid_filter_update_config (HidFilter *filter)
+{
+    DamperBpfConfig config = { 0 };
+    guint32 key = 0;
+
+    config.layout = filter->layout;
+    config.double_click_wait_usec = damper_double_click_wait_time;
+    config.threshold_sq = damper_breakout_threshold_sq ();
+
+    if (bpf_map__update_elem (filter->skel->maps.config, &key, sizeof (key), &config, sizeof (config), BPF_ANY) < 0)
+        g_warning ("Failed to configure the HID-BPF filter for %s: %s", filter->name, strerror (errno));
+}
+
+void
+hid_filter_print_stats (HidFilter *filter)
+{
+    DamperBpfStats stats = { 0 };
+    guint32 key = 0;
+
+    if (bpf_map__lookup_elem (filter->skel->maps.stats, &key, sizeof (key), &stats, sizeof (stats), 0) < 0)
+        return;
+
+    g_print ("Kernel filter for %s: %" G_GUINT64_FORMAT " reports, %" G_GUINT64_FORMAT " freezes, "
+             "%" G_GUINT64_FORMAT " reports with motion held back\n",
+             filter->name,
+             (guint64) stats.reports,
+             (guint64) stats.freezes,
+             (guint64) stats.zeroed_reports);
+}
+
+void
+hid_filter_free (HidFilter *filter)
+{
+    /* Detaches the program; the device goes back to unfiltered */
+    bpf_link__destroy (filter->link);
+    damper_bpf__destroy (filter->skel);
+
+    g_free (filter->name);
+    g_free (filter->devnode);
+    g_free (filter);
+}
+
+#else
+
+gint
+hid_filter_hid_id (const gchar *devnode)
+{
+    static gboolean warned = FALSE;
+
+    if (!warned)
+        g_warning ("mousedamper was built without HID-BPF support, filtering in userspace");
+    warned = TRUE;
+
+    return -1;
+}
+
+HidFilter *
+hid_filter_new (const gchar *devnode, gint hid_id)
+{
+    return NULL;
+}
+
+void
+hid_filter_update_config (HidFilter *filter)
+{
+}
+
+void
+hid_filter_print_stats (HidFilter *filter)
+{
+}
+
+void
+hid_filter_free (HidFilter *filter)
+{
+    g_free (filter->name);
+    g_free (filter->devnode);
+    g_free (filter);
+}
+
+#endif
@@ -0,0 +1,42 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+#ifndef HID_FILTER_H
+#define HID_FILTER_H
+
+#include <glib.h>
+
+/* In-kernel filtering: a HID-BPF program (hid_bpf/damper.bpf.c) attached
+ * to a HID mouse zeroes frozen motion before evdev sees it, so the device
+ * is neither grabbed nor cloned. Needs a kernel with HID-BPF struct_ops
+ * (6.11+) and a build with -Dhid_bpf=enabled. */
+typedef struct _HidFilter HidFilter;
+
+extern gboolean hid_filter_enabled;
+
+/* The HID device behind an evdev node, or -1 if it isn't one */
+gint hid_filter_hid_id (const gchar *devnode);
+/* NULL if the program can't handle this device; filter it in userspace */
+HidFilter *hid_filter_new (const gchar *devnode, gint hid_id);
+gint hid_filter_get_hid_id (HidFilter *filter);
+const gchar *hid_filter_get_devnode (HidFilter *filter);
+/* Pushes the current damper settings to the program */
+void hid_filter_update_config (HidFilter *filter);
+void hid_filter_print_stats (HidFilter *filter);
+void hid_filter_free (HidFilter *filter);
+
+#endif
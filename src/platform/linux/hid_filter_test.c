@@ -0,0 +1,293 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+/* Checks the HID-BPF filter on a uhid mouse: motion after a press is
+ * zeroed in the kernel while the freeze lasts and comes through once it
+ * has timed out. Needs root and a kernel with HID-BPF struct_ops; skipped
+ * without either.
+ *
+ * Usage: mousedamper-hid-filter-test
+ */
+
+#include "hid_filter.h"
+#include "../../common/damper_core.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/input.h>
+#include <linux/uhid.h>
+#include <sys/utsname.h>
+
+#define TEST_MOUSE_NAME "Mousedamper HID-BPF test mouse"
+#define EXIT_SKIP 77
+#define NODE_TIMEOUT_USEC (5 * G_USEC_PER_SEC)
+#define WAIT_TIME_USEC (200 * 1000)
+#define THRESHOLD_PX 100
+
+/* Three buttons, padding, 8-bit relative X and Y; no report ID */
+static const guint8 mouse_descriptor[] = {
+    0x05, 0x01, 0x09, 0x02, 0xa1, 0x01, 0x09, 0x01, 0xa1, 0x00,
+    0x05, 0x09, 0x19, 0x01, 0x29, 0x03, 0x15, 0x00, 0x25, 0x01,
+    0x95, 0x03, 0x75, 0x01, 0x81, 0x02,
+    0x95, 0x01, 0x75, 0x05, 0x81, 0x03,
+    0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x15, 0x81, 0x25, 0x7f,
+    0x75, 0x08, 0x95, 0x02, 0x81, 0x06,
+    0xc0, 0xc0,
+};
+
+typedef struct {
+    gint x;
+    gint y;
+    gint left;
+} Received;
+
+static gboolean
+uhid_write (gint fd, const struct uhid_event *ev)
+{
+    if (write (fd, ev, sizeof (*ev)) != sizeof (*ev)) {
+        g_printerr ("Could not write to /dev/uhid: %s\n", strerror (errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+create_mouse (gint fd)
+{
+    struct uhid_event ev;
+
+    memset (&ev, 0, sizeof (ev));
+    ev.type = UHID_CREATE2;
+    g_strlcpy ((gchar *) ev.u.create2.name, TEST_MOUSE_NAME, sizeof (ev.u.create2.name));
+    memcpy (ev.u.create2.rd_data, mouse_descriptor, sizeof (mouse_descriptor));
+    ev.u.create2.rd_size = sizeof (mouse_descriptor);
+    ev.u.create2.bus = BUS_USB;
+    ev.u.create2.vendor = 0x1d6b;
+    ev.u.create2.product = 0x4d44;
+
+    return uhid_write (fd, &ev);
+}
+
+static gboolean
+send_report (gint fd, guint8 buttons, gint8 x, gint8 y)
+{
+    struct uhid_event ev;
+
+    memset (&ev, 0, sizeof (ev));
+    ev.type = UHID_INPUT2;
+    ev.u.input2.size = 3;
+    ev.u.input2.data[0] = buttons;
+    ev.u.input2.data[1] = (guint8) x;
+    ev.u.input2.data[2] = (guint8) y;
+
+    return uhid_write (fd, &ev);
+}
+
+/* The evdev node hid-input made for the uhid mouse, or NULL */
+static gchar *
+find_event_node (void)
+{
+    gint64 start = g_get_monotonic_time ();
+
+    do {
+        GDir *dir = g_dir_open ("/sys/class/input", 0, NULL);
+        const gchar *entry;
+        gchar *devnode = NULL;
+
+        while (dir && devnode == NULL && (entry = g_dir_read_name (dir))) {
+            gchar *path, *name = NULL;
+
+            if (!g_str_has_prefix (entry, "event"))
+                continue;
+
+            path = g_build_filename ("/sys/class/input", entry, "device", "name", NULL);
+            if (g_file_get_contents (path, &name, NULL, NULL) &&
+                g_strcmp0 (g_strstrip (name), TEST_MOUSE_NAME) == 0)
+                devnode = g_build_filename ("/dev/input", entry, NULL);
+
+            g_free (name);
+            g_free (path);
+        }
+
+        if (dir)
+            g_dir_close (dir);
+
+        /* udev may still be setting up the node */
+        if (devnode && access (devnode, R_OK) == 0)
+            return devnode;
+
+        g_free (devnode);
+        g_usleep (G_USEC_PER_SEC / 20);
+    } while (g_get_monotonic_time () - start < NODE_TIMEOUT_USEC);
+
+    return NULL;
+}
+
+/* uhid hands reports to hid-input before the write returns, so whatever
+ * they produced is already queued on the evdev node */
+static void
+drain (gint evdev_fd, Received *received)
+{
+    struct input_event ev;
+
+    memset (received, 0, sizeof (*received));
+    received->left = -1;
+
+    while (read (evdev_fd, &ev, sizeof (ev)) == sizeof (ev)) {
+        if (ev.type == EV_REL && ev.code == REL_X)
+            received->x += ev.value;
+        else if (ev.type == EV_REL && ev.code == REL_Y)
+            received->y += ev.value;
+        else if (ev.type == EV_KEY && ev.code == BTN_LEFT)
+            received->left = ev.value;
+    }
+}
+
+static gboolean
+expect (const gchar *what, const Received *received, gint x, gint y, gint left)
+{
+    if (received->x == x && received->y == y && received->left == left) {
+        g_print ("ok: %s\n", what);
+        return TRUE;
+    }
+
+    g_printerr ("FAIL: %s: got x %d, y %d, left %d; expected x %d, y %d, left %d\n",
+                what, received->x, received->y, received->left, x, y, left);
+    return FALSE;
+}
+
+/* HID-BPF struct_ops arrived in 6.11 */
+static gboolean
+kernel_has_struct_ops (void)
+{
+    struct utsname uts;
+    guint major = 0, minor = 0;
+
+    if (uname (&uts) < 0 || sscanf (uts.release, "%u.%u", &major, &minor) != 2)
+        return FALSE;
+
+    return major > 6 || (major == 6 && minor >= 11);
+}
+
+static gboolean
+run_checks (gint uhid_fd, gint evdev_fd)
+{
+    Received received;
+    gboolean ok = TRUE;
+
+    drain (evdev_fd, &received);
+
+    send_report (uhid_fd, 0, 7, -4);
+    drain (evdev_fd, &received);
+    ok &= expect ("motion passes through before a press", &received, 7, -4, -1);
+
+    send_report (uhid_fd, 1, 0, 0);
+    drain (evdev_fd, &received);
+    ok &= expect ("press is reported", &received, 0, 0, 1);
+
+    send_report (uhid_fd, 1, 5, 3);
+    drain (evdev_fd, &received);
+    ok &= expect ("motion is zeroed during the freeze", &received, 0, 0, -1);
+
+    send_report (uhid_fd, 0, 0, 0);
+    drain (evdev_fd, &received);
+    ok &= expect ("release is reported", &received, 0, 0, 0);
+
+    send_report (uhid_fd, 0, -6, 2);
+    drain (evdev_fd, &received);
+    ok &= expect ("motion after a quick release is still zeroed", &received, 0, 0, -1);
+
+    g_usleep (WAIT_TIME_USEC + WAIT_TIME_USEC / 2);
+
+    send_report (uhid_fd, 0, 5, 3);
+    drain (evdev_fd, &received);
+    ok &= expect ("motion passes through once the freeze times out", &received, 5, 3, -1);
+
+    send_report (uhid_fd, 0, -9, 11);
+    drain (evdev_fd, &received);
+    ok &= expect ("later motion passes through", &received, -9, 11, -1);
+
+    return ok;
+}
+
+int
+main (int argc, char **argv)
+{
+    struct uhid_event destroy = { .type = UHID_DESTROY };
+    HidFilter *filter;
+    gchar *devnode;
+    gint uhid_fd, evdev_fd;
+    gint status;
+
+    if (geteuid () != 0) {
+        g_print ("Skipping: root is needed to create HID devices and load BPF programs\n");
+        return EXIT_SKIP;
+    }
+
+    if (!kernel_has_struct_ops ()) {
+        g_print ("Skipping: the kernel has no HID-BPF struct_ops (6.11+)\n");
+        return EXIT_SKIP;
+    }
+
+    uhid_fd = open ("/dev/uhid", O_RDWR | O_CLOEXEC);
+    if (uhid_fd < 0) {
+        g_print ("Skipping: could not open /dev/uhid: %s\n", strerror (errno));
+        return EXIT_SKIP;
+    }
+
+    if (!create_mouse (uhid_fd)) {
+        close (uhid_fd);
+        return EXIT_FAILURE;
+    }
+
+    devnode = find_event_node ();
+    if (devnode == NULL) {
+        g_printerr ("No input node appeared for the uhid mouse\n");
+        uhid_write (uhid_fd, &destroy);
+        close (uhid_fd);
+        return EXIT_FAILURE;
+    }
+
+    damper_double_click_wait_time = WAIT_TIME_USEC;
+    damper_button_freeze_delta_threshold = THRESHOLD_PX;
+    damper_threshold_scale_factor = 1.0;
+
+    status = EXIT_FAILURE;
+    evdev_fd = open (devnode, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    filter = hid_filter_new (devnode, hid_filter_hid_id (devnode));
+
+    if (evdev_fd < 0)
+        g_printerr ("Could not open %s: %s\n", devnode, strerror (errno));
+    else if (filter == NULL)
+        g_printerr ("Could not attach the HID-BPF filter to %s\n", devnode);
+    else if (run_checks (uhid_fd, evdev_fd))
+        status = EXIT_SUCCESS;
+
+    if (filter)
+        hid_filter_free (filter);
+    if (evdev_fd >= 0)
+        close (evdev_fd);
+    uhid_write (uhid_fd, &destroy);
+    close (uhid_fd);
+    g_free (devnode);
+
+    return status;
+}
@@ -0,0 +1,249 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+/* Optional dedicated input thread. Everything on the input path runs here,
+ * optionally real-time, pinned and with memory locked; the main thread
+ * keeps signals and everything else that may block. */
+
+#define _GNU_SOURCE
+
+#include "input_thread.h"
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define PREFAULT_STACK_SIZE (64 * 1024)
+#define NSEC_IN_USEC 1000
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+
+/* Not exposed by every libc */
+struct deadline_sched_attr {
+    uint32_t size;
+    uint32_t sched_policy;
+    uint64_t sched_flags;
+    int32_t sched_nice;
+    uint32_t sched_priority;
+    uint64_t sched_runtime;
+    uint64_t sched_deadline;
+    uint64_t sched_period;
+};
+
+InputThreadConfig input_thread_config = {
+    .enabled = false,
+    .policy = INPUT_THREAD_SCHED_OTHER,
+    .priority = 50,
+    .runtime_usec = 200,
+    .period_usec = 1000,
+    .cpu = -1,
+    .lock_memory = false,
+    .dma_latency_usec = -1
+};
+
+static pthread_t input_thread;
+static bool input_thread_running = false;
+static EventLoop *input_loop = NULL;
+static void (*input_stopped) (void) = NULL;
+static int dma_latency_fd = -1;
+
+static void
+warn_privileges (const char *what, int err)
+{
+    g_warning ("Could not %s: %s", what, strerror (err));
+
+    if (err == EPERM || err == EACCES)
+        g_warning ("The input thread needs CAP_SYS_NICE/CAP_IPC_LOCK (or a matching "
+                   "RLIMIT_RTPRIO/RLIMIT_MEMLOCK) for this; it will run without it");
+}
+
+static void
+prefault_stack (void)
+{
+    volatile unsigned char buffer[PREFAULT_STACK_SIZE];
+
+    memset ((unsigned char *) buffer, 0, sizeof (buffer));
+}
+
+static void
+apply_affinity (int index)
+{
+    cpu_set_t set;
+    int cpu, rc;
+
+    if (input_thread_config.cpu < 0)
+        return;
+
+    cpu = input_thread_config.cpu + index;
+
+    CPU_ZERO (&set);
+    CPU_SET (cpu, &set);
+
+    rc = pthread_setaffinity_np (pthread_self (), sizeof (set), &set);
+    if (rc != 0)
+        g_warning ("Could not pin input thread %d to CPU %d: %s", index, cpu, strerror (rc));
+}
+
+static void
+apply_policy (void)
+{
+    if (input_thread_config.policy == INPUT_THREAD_SCHED_FIFO) {
+        struct sched_param param = { .sched_priority = input_thread_config.priority };
+        int rc = pthread_setschedparam (pthread_self (), SCHED_FIFO, &param);
+
+        if (rc != 0)
+            warn_privileges ("switch the input thread to SCHED_FIFO", rc);
+    } else if (input_thread_config.policy == INPUT_THREAD_SCHED_DEADLINE) {
+        struct deadline_sched_attr attr;
+
+        memset (&attr, 0, sizeof (attr));
+        attr.size = sizeof (attr);
+        attr.sched_policy = SCHED_DEADLINE;
+        attr.sched_runtime = (uint64_t) input_thread_config.runtime_usec * NSEC_IN_USEC;
+        attr.sched_deadline = (uint64_t) input_thread_config.period_usec * NSEC_IN_USEC;
+        attr.sched_period = (uint64_t) input_thread_config.period_usec * NSEC_IN_USEC;
+
+        if (syscall (SYS_sched_setattr, 0, &attr, 0) < 0)
+            warn_privileges ("switch the input thread to SCHED_DEADLINE", errno);
+    }
+}
+
+void
+input_thread_setup_current (int index)
+{
+    sigset_t mask;
+
+    /* Signals are the main thread's business */
+    sigfillset (&mask);
+    pthread_sigmask (SIG_BLOCK, &mask, NULL);
+
+    apply_affinity (index);
+    apply_policy ();
+    prefault_stack ();
+}
+
+static void *
+input_thread_func (void *data)
+{
+    input_thread_setup_current (0);
+
+    event_loop_run (input_loop);
+
+    if (input_stopped)
+        input_stopped ();
+
+    return NULL;
+}
+
+static void
+hold_dma_latency (void)
+{
+    int32_t value = input_thread_config.dma_latency_usec;
+
+    if (value < 0)
+        return;
+
+    /* The request holds for as long as the fd stays open */
+    dma_latency_fd = open ("/dev/cpu_dma_latency", O_WRONLY | O_CLOEXEC);
+    if (dma_latency_fd < 0) {
+        warn_privileges ("open /dev/cpu_dma_latency", errno);
+        return;
+    }
+
+    if (write (dma_latency_fd, &value, sizeof (value)) != sizeof (value)) {
+        warn_privileges ("set a CPU DMA latency request", errno);
+        close (dma_latency_fd);
+        dma_latency_fd = -1;
+        return;
+    }
+
+    g_print ("Holding a CPU DMA latency request of %dus\n", value);
+}
+
+void
+input_thread_acquire_resources (void)
+{
+    if (input_thread_config.policy == INPUT_THREAD_SCHED_DEADLINE && input_thread_config.cpu >= 0)
+        g_warning ("SCHED_DEADLINE tasks usually cannot be pinned to a single CPU; expect one of them to fail");
+
+    /* A real-time thread stalling on a page fault defeats the point */
+    if ((input_thread_config.lock_memory || input_thread_config.policy != INPUT_THREAD_SCHED_OTHER) &&
+        mlockall (MCL_CURRENT | MCL_FUTURE) < 0)
+        warn_privileges ("lock the daemon's memory", errno);
+
+    hold_dma_latency ();
+}
+
+void
+input_thread_release_resources (void)
+{
+    if (dma_latency_fd >= 0) {
+        close (dma_latency_fd);
+        dma_latency_fd = -1;
+    }
+}
+
+bool
+input_thread_start (EventLoop *loop, void (*stopped) (void))
+{
+    pthread_attr_t attr;
+    int rc;
+
+    input_thread_acquire_resources ();
+
+    input_loop = loop;
+    input_stopped = stopped;
+
+    g_print ("Starting input thread (%s, CPU %d)\n",
+             input_thread_config.policy == INPUT_THREAD_SCHED_FIFO ? "SCHED_FIFO" :
+             input_thread_config.policy == INPUT_THREAD_SCHED_DEADLINE ? "SCHED_DEADLINE" : "SCHED_OTHER",
+             input_thread_config.cpu);
+
+    pthread_attr_init (&attr);
+    pthread_attr_setstacksize (&attr, INPUT_THREAD_STACK_SIZE_BYTES);
+    rc = pthread_create (&input_thread, &attr, input_thread_func, NULL);
+    pthread_attr_destroy (&attr);
+
+    if (rc != 0) {
+        g_warning ("Failed to start the input thread: %s", strerror (rc));
+        return false;
+    }
+
+    input_thread_running = true;
+    return true;
+}
+
+void
+input_thread_stop (void)
+{
+    if (input_thread_running) {
+        event_loop_quit (input_loop);
+        pthread_join (input_thread, NULL);
+        input_thread_running = false;
+    }
+
+    input_thread_release_resources ();
+}
@@ -0,0 +1,61 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+#ifndef INPUT_THREAD_H
+#define INPUT_THREAD_H
+
+#include "event_loop.h"
+#include <stdbool.h>
+
+#define INPUT_THREAD_MAX_CPU 1023
+#define INPUT_THREAD_STACK_SIZE_BYTES (256 * 1024)
+
+typedef enum {
+    INPUT_THREAD_SCHED_OTHER,
+    INPUT_THREAD_SCHED_FIFO,
+    INPUT_THREAD_SCHED_DEADLINE
+} InputThreadPolicy;
+
+typedef struct {
+    bool enabled;
+    InputThreadPolicy policy;
+    int priority;
+    /* SCHED_DEADLINE budget per period */
+    int runtime_usec;
+    int period_usec;
+    /* CPU to pin to, or -1 */
+    int cpu;
+    bool lock_memory;
+    /* Value held in /dev/cpu_dma_latency, or -1 */
+    int dma_latency_usec;
+} InputThreadConfig;
+
+extern InputThreadConfig input_thread_config;
+
+/* Runs event_loop_run (loop) on a dedicated thread; stopped () is called
+ * from that thread if the loop ends on its own. */
+bool input_thread_start (EventLoop *loop, void (*stopped) (void));
+void input_thread_stop (void);
+
+/* Building blocks for other input-path threads (see worker_pool.c):
+ * process-wide memory locking and PM QoS, and the per-thread signal mask,
+ * scheduling policy and CPU pinning (offset by index) */
+void input_thread_acquire_resources (void);
+void input_thread_release_resources (void);
+void input_thread_setup_current (int index);
+
+#endif
@@ -0,0 +1,174 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+#include "latency_stats.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Written ahead of saved results; bump it when LatencyStats changes */
+#define LATENCY_STATS_MAGIC 0x4d444c32
+
+/* Values below 2 * LATENCY_SUB_BUCKETS get a bucket each; above, the top
+ * LATENCY_SUB_BUCKET_BITS + 1 bits pick one within the power of two */
+static int
+bucket_index (uint64_t usec)
+{
+    int shift;
+
+    if (usec < 2 * LATENCY_SUB_BUCKETS)
+        return (int) usec;
+
+    shift = 63 - __builtin_clzll (usec) - LATENCY_SUB_BUCKET_BITS;
+    if (shift > LATENCY_MAX_SHIFT)
+        return LATENCY_BUCKETS - 1;
+
+    return shift * LATENCY_SUB_BUCKETS + (int) (usec >> shift);
+}
+
+/* The highest value recorded in a bucket */
+static int64_t
+bucket_upper (int index)
+{
+    int shift;
+
+    if (index < 2 * LATENCY_SUB_BUCKETS)
+        return index;
+
+    shift = index / LATENCY_SUB_BUCKETS - 1;
+    return ((int64_t) (index - shift * LATENCY_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+void
+latency_stats_record (LatencyStats *stats, int64_t usec)
+{
+    if (usec < 0)
+        usec = 0;
+
+    stats->buckets[bucket_index (usec)]++;
+    stats->count++;
+    stats->total_usec += usec;
+    if (usec > stats->max_usec)
+        stats->max_usec = usec;
+}
+
+int64_t
+latency_stats_percentile (const LatencyStats *stats, double percentile)
+{
+    uint64_t target, seen = 0;
+
+    if (stats->count == 0)
+        return 0;
+
+    target = (uint64_t)(stats->count * percentile / 100.0);
+    if (target >= stats->count)
+        target = stats->count - 1;
+
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += stats->buckets[i];
+        if (seen > target)
+            return bucket_upper (i) < stats->max_usec ? bucket_upper (i) : stats->max_usec;
+    }
+
+    return stats->max_usec;
+}
+
+void
+latency_stats_print (const LatencyStats *stats, const char *label)
+{
+    if (stats->count == 0) {
+        printf ("Latency for %s: no frames forwarded\n", label);
+        return;
+    }
+
+    printf ("Latency for %s: %lu frames, mean %luus, p50 %ldus, p99 %ldus, max %ldus\n",
+            label,
+            (unsigned long) stats->count,
+            (unsigned long) (stats->total_usec / stats->count),
+            (long) latency_stats_percentile (stats, 50.0),
+            (long) latency_stats_percentile (stats, 99.0),
+            (long) stats->max_usec);
+}
+
+void
+latency_stats_merge (LatencyStats *into, const LatencyStats *stats)
+{
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+        into->buckets[i] += stats->buckets[i];
+
+    into->count += stats->count;
+    into->total_usec += stats->total_usec;
+    if (stats->max_usec > into->max_usec)
+        into->max_usec = stats->max_usec;
+}
+
+bool
+latency_stats_save (const LatencyStats *stats, const char *path)
+{
+    FILE *file = fopen (path, "wb");
+    uint32_t magic = LATENCY_STATS_MAGIC;
+    bool ok;
+
+    if (file == NULL)
+        return false;
+
+    ok = fwrite (&magic, sizeof (magic), 1, file) == 1 &&
+         fwrite (stats, sizeof (LatencyStats), 1, file) == 1;
+    return fclose (file) == 0 && ok;
+}
+
+bool
+latency_stats_load (LatencyStats *stats, const char *path)
+{
+    FILE *file = fopen (path, "rb");
+    uint32_t magic = 0;
+    bool ok;
+
+    if (file == NULL)
+        return false;
+
+    /* Results saved with other buckets can't be compared with */
+    ok = fread (&magic, sizeof (magic), 1, file) == 1 && magic == LATENCY_STATS_MAGIC &&
+         fread (stats, sizeof (LatencyStats), 1, file) == 1;
+    fclose (file);
+
+    if (!ok)
+        memset (stats, 0, sizeof (LatencyStats));
+
+    return ok;
+}
+
+static void
+print_delta (const char *name, int64_t value, int64_t baseline)
+{
+    printf ("  %s %ldus vs %ldus (%+ldus", name, (long) value, (long) baseline, (long) (value - baseline));
+    if (baseline > 0)
+        printf (", %+.0f%%", 100.0 * (value - baseline) / baseline);
+    printf (")\n");
+}
+
+void
+latency_stats_print_comparison (const LatencyStats *stats, const char *label,
+                                const LatencyStats *baseline, const char *baseline_label)
+{
+    if (stats->count == 0 || baseline->count == 0)
+        return;
+
+    printf ("Latency of %s compared to %s (%lu vs %lu frames):\n",
+            label, baseline_label, (unsigned long) stats->count, (unsigned long) baseline->count);
+    print_delta ("p50", latency_stats_percentile (stats, 50.0), latency_stats_percentile (baseline, 50.0));
+    print_delta ("p99", latency_stats_percentile (stats, 99.0), latency_stats_percentile (baseline, 99.0));
+}
@@ -0,0 +1,51 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+#ifndef LATENCY_STATS_H
+#define LATENCY_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Fixed-size latency histogram with log-linear buckets, as HdrHistogram
+ * lays them out: exact below 64us, then 32 buckets per power of two, so
+ * any value is off by at most 1/32. Up to about 67s; anything slower
+ * lands in the last bucket but still counts toward max. */
+#define LATENCY_SUB_BUCKET_BITS 5
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_MAX_SHIFT 20
+#define LATENCY_BUCKETS ((LATENCY_MAX_SHIFT + 2) * LATENCY_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t count;
+    uint64_t total_usec;
+    int64_t max_usec;
+    uint32_t buckets[LATENCY_BUCKETS];
+} LatencyStats;
+
+void latency_stats_record (LatencyStats *stats, int64_t usec);
+int64_t latency_stats_percentile (const LatencyStats *stats, double percentile);
+void latency_stats_print (const LatencyStats *stats, const char *label);
+void latency_stats_merge (LatencyStats *into, const LatencyStats *stats);
+
+/* Raw dumps so runs with different event loops can be compared */
+bool latency_stats_save (const LatencyStats *stats, const char *path);
+bool latency_stats_load (LatencyStats *stats, const char *path);
+void latency_stats_print_comparison (const LatencyStats *stats, const char *label,
+                                     const LatencyStats *baseline, const char *baseline_label);
+
+#endif
@@ -0,0 +1,100 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+#define _GNU_SOURCE
+
+#include "log_thread.h"
+#include "../../common/damper_core.h"
+#include "../../common/damper_log.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+static GThread *thread = NULL;
+static gint stop_fd = -1;
+
+static gpointer
+log_thread (gpointer data)
+{
+    struct sched_param param = { 0 };
+    struct pollfd pfd = { stop_fd, POLLIN, 0 };
+    sigset_t mask;
+
+    sigfillset (&mask);
+    pthread_sigmask (SIG_BLOCK, &mask, NULL);
+
+    /* Only takes CPU time nothing else wants */
+    pthread_setschedparam (pthread_self (), SCHED_IDLE, &param);
+
+    while (poll (&pfd, 1, damper_verbose ? LOG_THREAD_INTERVAL_MSEC : LOG_THREAD_IDLE_INTERVAL_MSEC) == 0 ||
+           (pfd.revents & POLLIN) == 0) {
+        if (damper_log_drain (stdout) > 0)
+            fflush (stdout);
+    }
+
+    return NULL;
+}
+
+gboolean
+log_thread_start (void)
+{
+    if (thread)
+        return TRUE;
+
+    stop_fd = eventfd (0, EFD_CLOEXEC);
+    if (stop_fd < 0) {
+        g_warning ("Could not start the log thread: %s", strerror (errno));
+        return FALSE;
+    }
+
+    damper_log_start_async ();
+
+    thread = g_thread_try_new ("mousedamper-log", log_thread, NULL, NULL);
+    if (thread == NULL) {
+        g_warning ("Could not start the log thread, logging synchronously");
+        damper_log_stop_async ();
+        close (stop_fd);
+        stop_fd = -1;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+void
+log_thread_stop (void)
+{
+    guint64 value = 1;
+
+    if (thread == NULL)
+        return;
+
+    if (write (stop_fd, &value, sizeof (value)) < 0)
+        g_warning ("Could not stop the log thread: %s", strerror (errno));
+
+    g_thread_join (thread);
+    thread = NULL;
+    close (stop_fd);
+    stop_fd = -1;
+
+    damper_log_stop_async ();
+    fflush (stdout);
+}
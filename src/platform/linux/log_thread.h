@@ -0,0 +1,36 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+#ifndef LOG_THREAD_H
+#define LOG_THREAD_H
+
+#include <glib.h>
+
+/* Prints the damper core's verbose messages, see damper_log.h, from a
+ * SCHED_IDLE thread polling the ring: recording them then costs the
+ * filtering threads a few stores, and a slow stdout only drops records. */
+
+/* How often the ring is drained in verbose mode; it holds about a second
+ * of events at 1kHz. Outside it, where the control socket may still turn
+ * verbose mode on, the thread sleeps longer. */
+#define LOG_THREAD_INTERVAL_MSEC 20
+#define LOG_THREAD_IDLE_INTERVAL_MSEC 500
+
+gboolean log_thread_start (void);
+/* Prints what is left, and the records dropped on the way */
+void log_thread_stop (void);
+
+#endif
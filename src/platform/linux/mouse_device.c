@@ -0,0 +1,875 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+#include "mouse_device.h"
+#include "arena.h"
+#include "alloc_check.h"
+#include "../../common/damper_probes.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+
+#define USEC_IN_SEC 1000000
+#define NSEC_IN_USEC 1000
+
+gboolean mouse_device_measure_latency = FALSE;
+
+static ArenaPool device_pool = ARENA_POOL_INIT (MouseDevice);
+
+static PlatformButton
+translate_button_code (guint code)
+{
+    switch (code) {
+        case BTN_LEFT:
+            return PLATFORM_BUTTON_LEFT;
+        case BTN_RIGHT:
+            return PLATFORM_BUTTON_RIGHT;
+        case BTN_MIDDLE:
+            return PLATFORM_BUTTON_MIDDLE;
+        default:
+            return PLATFORM_BUTTON_LEFT;
+    }
+}
+
+void
+mouse_device_record_latency (MouseDevice *device, const struct timeval *time, MouseDeviceFrameKind kind)
+{
+    struct timespec now;
+    gint64 now_usec, event_usec;
+
+    /* Input timestamps are CLOCK_MONOTONIC, see mouse_device_new () */
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    now_usec = ((gint64)now.tv_sec * USEC_IN_SEC) + (now.tv_nsec / NSEC_IN_USEC);
+    event_usec = ((gint64)time->tv_sec * USEC_IN_SEC) + time->tv_usec;
+
+    DAMPER_PROBE3 (frame__written, device->input_devnode, (int) kind, now_usec - event_usec);
+    latency_stats_record (&device->latency[kind], now_usec - event_usec);
+}
+
+const gchar *
+mouse_device_frame_kind_name (MouseDeviceFrameKind kind)
+{
+    return kind == MOUSE_DEVICE_FRAME_POST_FREEZE ? "post-freeze" : "pass-through";
+}
+
+void
+mouse_device_print_latency (MouseDevice *device)
+{
+    for (int kind = 0; kind < MOUSE_DEVICE_FRAME_KINDS; kind++) {
+        gchar label[MOUSE_DEVICE_DEVNODE_MAX + 32];
+
+        snprintf (label, sizeof (label), "%s (%s)", device->input_devnode, mouse_device_frame_kind_name (kind));
+        latency_stats_print (&device->latency[kind], label);
+    }
+}
+
+static gboolean
+append_event (MouseDevice *device, guint type, guint code, gint value, const struct timeval *time)
+{
+    struct input_event *out = &device->frame[device->frame_len++];
+
+    out->time = *time;
+    out->type = type;
+    out->code = code;
+    out->value = value;
+
+    return device->frame_len == MOUSE_DEVICE_FRAME_MAX;
+}
+
+static gboolean
+append_forwarded_event (MouseDevice *device, const struct input_event *ev)
+{
+    gboolean full = append_event (device, ev->type, ev->code, ev->value, &ev->time);
+
+    return full || ev->type == EV_SYN;
+}
+
+/* Frames from shared-output devices held until the end of a batch */
+#define BATCH_MAX_EVENTS 256
+#define BATCH_MAX_FRAMES 32
+
+typedef struct {
+    MouseDevice *device;
+    struct timeval time;
+    MouseDeviceFrameKind kind;
+    guint start;
+    guint len;
+} BatchFrame;
+
+typedef struct {
+    gboolean active;
+    gint output_fd;
+    const gchar *output_devnode;
+    struct input_event events[BATCH_MAX_EVENTS];
+    guint n_events;
+    BatchFrame frames[BATCH_MAX_FRAMES];
+    guint n_frames;
+} Batch;
+
+static __thread Batch batch;
+
+static gboolean
+timeval_before (const struct timeval *a, const struct timeval *b)
+{
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_usec < b->tv_usec);
+}
+
+static void
+flush_batch (void)
+{
+    struct input_event ordered[BATCH_MAX_EVENTS];
+    gsize n = 0;
+
+    if (batch.n_frames == 0)
+        return;
+
+    for (guint i = 0; i < batch.n_frames; i++) {
+        memcpy (&ordered[n], &batch.events[batch.frames[i].start], batch.frames[i].len * sizeof (struct input_event));
+        n += batch.frames[i].len;
+    }
+
+    if (write (batch.output_fd, ordered, n * sizeof (struct input_event)) !=
+        (gssize) (n * sizeof (struct input_event))) {
+        g_warning ("Failed to write to %s: %s", batch.output_devnode, strerror (errno));
+    } else {
+        for (guint i = 0; i < batch.n_frames; i++)
+            mouse_device_record_latency (batch.frames[i].device, &batch.frames[i].time, batch.frames[i].kind);
+    }
+
+    batch.n_events = 0;
+    batch.n_frames = 0;
+}
+
+void
+mouse_device_begin_batch (void)
+{
+    batch.active = TRUE;
+}
+
+void
+mouse_device_end_batch (void)
+{
+    alloc_check_enter ();
+    flush_batch ();
+    batch.active = FALSE;
+    alloc_check_leave ();
+}
+
+/* Frames arrive nearly in order, so insert from the back */
+static void
+batch_frame (MouseDevice *device)
+{
+    const struct timeval *time = &device->frame[device->frame_len - 1].time;
+    guint i;
+
+    if (batch.n_frames == BATCH_MAX_FRAMES ||
+        batch.n_events + device->frame_len > BATCH_MAX_EVENTS ||
+        (batch.n_frames > 0 && batch.output_fd != device->output_fd))
+        flush_batch ();
+
+    batch.output_fd = device->output_fd;
+    batch.output_devnode = device->output_devnode;
+    memcpy (&batch.events[batch.n_events], device->frame, device->frame_len * sizeof (struct input_event));
+
+    for (i = batch.n_frames; i > 0 && timeval_before (time, &batch.frames[i - 1].time); i--)
+        batch.frames[i] = batch.frames[i - 1];
+
+    batch.frames[i].device = device;
+    batch.frames[i].time = *time;
+    batch.frames[i].kind = device->frame_kind;
+    batch.frames[i].start = batch.n_events;
+    batch.frames[i].len = device->frame_len;
+
+    batch.n_events += device->frame_len;
+    batch.n_frames++;
+    device->frame_len = 0;
+}
+
+static void
+write_frame (MouseDevice *device)
+{
+    gsize size = device->frame_len * sizeof (struct input_event);
+
+    if (device->frame_len == 0)
+        return;
+
+    if (batch.active && !device->owns_output) {
+        batch_frame (device);
+        return;
+    }
+
+    if (write (device->output_fd, device->frame, size) != (gssize) size)
+        g_warning ("Failed to write to %s: %s", device->output_devnode, strerror (errno));
+    else
+        mouse_device_record_latency (device, &device->frame[device->frame_len - 1].time, device->frame_kind);
+
+    device->frame_len = 0;
+}
+
+static gboolean
+buttons_down (MouseDevice *device)
+{
+    return libevdev_get_event_value (device->input_device, EV_KEY, BTN_LEFT) ||
+           libevdev_get_event_value (device->input_device, EV_KEY, BTN_RIGHT) ||
+           libevdev_get_event_value (device->input_device, EV_KEY, BTN_MIDDLE);
+}
+
+void
+mouse_device_write_frame (MouseDevice *device)
+{
+    alloc_check_enter ();
+    write_frame (device);
+    alloc_check_leave ();
+}
+
+void
+mouse_device_resync (MouseDevice *device)
+{
+    struct input_event ev;
+    struct timeval time = { 0, 0 };
+    gboolean changed = FALSE;
+
+    device->drops++;
+
+    device->frame_len = 0;
+    device->frame_kind = MOUSE_DEVICE_FRAME_PASS;
+    device->frame_filtered = FALSE;
+    device->frame_forwarded = 0;
+    device->frame_dropped = 0;
+
+    /* Forward the state changes libevdev worked out as a single frame */
+    while (libevdev_next_event (device->input_device, LIBEVDEV_READ_FLAG_SYNC, &ev) == LIBEVDEV_READ_STATUS_SYNC) {
+        time = ev.time;
+        if (ev.type == EV_SYN)
+            continue;
+
+        changed = TRUE;
+        append_event (device, ev.type, ev.code, ev.value, &ev.time);
+
+        /* Leave room for the closing SYN_REPORT */
+        if (device->frame_len == MOUSE_DEVICE_FRAME_MAX - 1)
+            mouse_device_write_frame (device);
+    }
+
+    if (changed) {
+        append_event (device, EV_SYN, SYN_REPORT, 0, &time);
+        mouse_device_write_frame (device);
+    }
+
+    /* The core may still be waiting on a release that was dropped */
+    damper_state_resync (&device->state, buttons_down (device));
+}
+
+/* Once outside every alloc-check bracket */
+static void
+report_drops (MouseDevice *device)
+{
+    if (alloc_check_depth > 0 || device->reported_drops == device->drops)
+        return;
+
+    device->reported_drops = device->drops;
+    g_warning ("Events dropped by %s, resyncing", libevdev_get_name (device->input_device));
+}
+
+#define BITS_PER_LONG (sizeof (unsigned long) * 8)
+#define KEY_BIT(keys, code) (((keys)[(code) / BITS_PER_LONG] >> ((code) % BITS_PER_LONG)) & 1)
+
+/* From the kernel rather than libevdev, which raw readers don't update */
+static gboolean
+kernel_buttons_down (MouseDevice *device)
+{
+    unsigned long keys[KEY_CNT / BITS_PER_LONG + 1] = { 0 };
+
+    if (ioctl (device->fd, EVIOCGKEY (sizeof (keys)), keys) < 0)
+        return FALSE;
+
+    return KEY_BIT (keys, BTN_LEFT) || KEY_BIT (keys, BTN_RIGHT) || KEY_BIT (keys, BTN_MIDDLE);
+}
+
+/* Forwards the buttons' state as the kernel has it in one frame. The
+ * output ignores events that don't change a button, so only the presses
+ * and releases it missed take effect. Returns FALSE if the state can't be
+ * read; down tells whether a button the core watches is held. */
+static gboolean
+forward_kernel_buttons (MouseDevice *device, const struct timeval *time,
+                        gboolean presses, gboolean *down)
+{
+    unsigned long keys[KEY_CNT / BITS_PER_LONG + 1] = { 0 };
+
+    *down = FALSE;
+
+    if (ioctl (device->fd, EVIOCGKEY (sizeof (keys)), keys) < 0)
+        return FALSE;
+
+    /* Room for every button and the SYN_REPORT */
+    if (device->frame_len + (BTN_TASK - BTN_MOUSE + 2) > MOUSE_DEVICE_FRAME_MAX)
+        write_frame (device);
+
+    for (guint code = BTN_MOUSE; code <= BTN_TASK; code++) {
+        gboolean pressed = KEY_BIT (keys, code);
+
+        if (pressed && (code == BTN_LEFT || code == BTN_RIGHT || code == BTN_MIDDLE))
+            *down = TRUE;
+
+        if (!libevdev_has_event_code (device->input_device, EV_KEY, code) || (pressed && !presses))
+            continue;
+
+        append_event (device, EV_KEY, code, pressed, time);
+    }
+
+    append_event (device, EV_SYN, SYN_REPORT, 0, time);
+    write_frame (device);
+
+    device->frame_filtered = FALSE;
+    device->frame_forwarded = 0;
+    device->frame_dropped = 0;
+
+    return TRUE;
+}
+
+/* Buttons released while the watchdog had the grab away may still be
+ * down on the output. Presses went to the input node itself then. */
+static void
+end_fail_open (MouseDevice *device, const struct timeval *time)
+{
+    gboolean down;
+
+    if (forward_kernel_buttons (device, time, FALSE, &down))
+        damper_state_resync (&device->state, down);
+}
+
+/* mouse_device_resync for backends reading the fd themselves: libevdev
+ * never saw what they read, so its state is stale, and reading through it
+ * would swallow events still queued on the fd */
+static void
+resync_from_kernel (MouseDevice *device, const struct timeval *time)
+{
+    gboolean down = FALSE;
+
+    device->drops++;
+    device->frame_kind = MOUSE_DEVICE_FRAME_PASS;
+
+    /* Releases and presses lost in the overflow are replayed */
+    forward_kernel_buttons (device, time, TRUE, &down);
+    damper_state_resync (&device->state, down);
+}
+
+static gboolean
+seen_while_open (MouseDevice *device, const struct input_event *ev)
+{
+    int_fast64_t start = atomic_load_explicit (&device->fail_open_start, memory_order_acquire);
+    int_fast64_t end = atomic_load_explicit (&device->fail_open_end, memory_order_acquire);
+    int_fast64_t time = ((gint64)ev->time.tv_sec * USEC_IN_SEC) + ev->time.tv_usec;
+
+    if (start == 0 || time < start)
+        return FALSE;
+
+    if (end == 0 || time < end)
+        return TRUE;
+
+    /* Unless the watchdog has already opened a new one */
+    if (atomic_compare_exchange_strong (&device->fail_open_start, &start, 0))
+        end_fail_open (device, &ev->time);
+
+    return FALSE;
+}
+
+static void
+publish_latency (TelemetryLatency *published, const LatencyStats *stats)
+{
+    published->frames = stats->count;
+    published->p50_usec = latency_stats_percentile (stats, 50.0);
+    published->p99_usec = latency_stats_percentile (stats, 99.0);
+    published->max_usec = stats->max_usec;
+}
+
+static void
+publish_telemetry (MouseDevice *device, gint64 time_usec)
+{
+    TelemetryDevice *slot = device->telemetry;
+    const DamperState *state = &device->state;
+
+    telemetry_begin_write (slot);
+    slot->updated_usec = time_usec;
+    slot->enabled = !device->bypassing;
+    slot->frozen = state->motion_frozen;
+    slot->x_freeze_delta = state->x_freeze_delta;
+    slot->y_freeze_delta = state->y_freeze_delta;
+    slot->events = atomic_load_explicit (&device->events_read, memory_order_relaxed);
+    slot->bypassed_frames = device->bypassed_frames;
+    slot->suppressed_frames = device->suppressed_frames;
+    slot->drops = device->drops;
+    slot->counters = state->counters;
+    for (int kind = 0; kind < MOUSE_DEVICE_FRAME_KINDS; kind++)
+        publish_latency (&slot->latency[kind], &device->latency[kind]);
+    telemetry_end_write (slot);
+
+    device->telemetry_next_usec = time_usec + TELEMETRY_INTERVAL_USEC;
+    device->telemetry_frozen = state->motion_frozen;
+}
+
+static gboolean
+process_event (MouseDevice *device, const struct input_event *ev)
+{
+    PlatformEvent platform_ev;
+    PlatformAction action = PLATFORM_ACTION_PASS;
+
+    /* Written only by whichever thread dispatches the device */
+    atomic_store_explicit (&device->events_read,
+                           atomic_load_explicit (&device->events_read, memory_order_relaxed) + 1,
+                           memory_order_relaxed);
+
+    if (atomic_load_explicit (&device->fail_open_start, memory_order_relaxed) != 0 &&
+        seen_while_open (device, ev))
+        return FALSE;
+
+    /* Only backends reading the fd directly see SYN_DROPPED; the kernel
+     * discards up to the next SYN_REPORT, then we rebuild from EVIOCGKEY. */
+    if (ev->type == EV_SYN && ev->code == SYN_DROPPED) {
+        device->frame_len = 0;
+        device->frame_forwarded = 0;
+        device->frame_dropped = 0;
+        device->discarding = TRUE;
+        return FALSE;
+    }
+
+    if (device->discarding) {
+        if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+            device->discarding = FALSE;
+            resync_from_kernel (device, &ev->time);
+        }
+        return FALSE;
+    }
+
+    if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+        gboolean empty = device->frame_dropped > 0 && device->frame_forwarded == 0;
+
+        DAMPER_PROBE4 (frame__read, device->input_devnode,
+                       ((gint64)ev->time.tv_sec * USEC_IN_SEC) + ev->time.tv_usec,
+                       device->frame_forwarded, device->frame_dropped);
+
+        if (!device->frame_filtered)
+            device->bypassed_frames++;
+
+        device->frame_kind = device->frame_filtered ? MOUSE_DEVICE_FRAME_POST_FREEZE : MOUSE_DEVICE_FRAME_PASS;
+
+        device->frame_filtered = FALSE;
+        device->frame_forwarded = 0;
+        device->frame_dropped = 0;
+        damper_state_sync_params (&device->state);
+
+        /* So does enabling or disabling the device */
+        if (atomic_load_explicit (&device->disabled, memory_order_relaxed) != device->bypassing) {
+            device->bypassing = !device->bypassing;
+            damper_state_resync (&device->state, !device->bypassing && kernel_buttons_down (device));
+        }
+
+        if (device->telemetry) {
+            gint64 time_usec = ((gint64)ev->time.tv_sec * USEC_IN_SEC) + ev->time.tv_usec;
+
+            if (time_usec >= device->telemetry_next_usec ||
+                device->state.motion_frozen != device->telemetry_frozen)
+                publish_telemetry (device, time_usec);
+        }
+
+        /* Everything in it was frozen, don't send the compositor an empty frame */
+        if (empty) {
+            device->suppressed_frames++;
+            return FALSE;
+        }
+
+        return append_forwarded_event (device, ev);
+    }
+
+    if (device->bypassing) {
+        device->frame_forwarded++;
+        return append_forwarded_event (device, ev);
+    }
+
+    if (ev->type == EV_KEY &&
+        (ev->code == BTN_LEFT || ev->code == BTN_RIGHT || ev->code == BTN_MIDDLE)) {
+        platform_ev.type = (ev->value == 1) ? PLATFORM_EVENT_BUTTON_PRESS : PLATFORM_EVENT_BUTTON_RELEASE;
+        platform_ev.timestamp_usec = ((gint64)ev->time.tv_sec * USEC_IN_SEC) + ev->time.tv_usec;
+        platform_ev.data.button.button = translate_button_code (ev->code);
+
+        action = damper_handle_event (&device->state, &platform_ev);
+        device->frame_filtered = TRUE;
+    } else if (ev->type == EV_REL && (ev->code == REL_X || ev->code == REL_Y) &&
+               damper_state_filters_motion (&device->state)) {
+        /* Unfrozen motion can't change the core's state or be dropped, so
+         * only a button edge or a freeze elsewhere in the device's domain
+         * brings it back into the core */
+        platform_ev.type = PLATFORM_EVENT_MOTION;
+        platform_ev.timestamp_usec = ((gint64)ev->time.tv_sec * USEC_IN_SEC) + ev->time.tv_usec;
+        platform_ev.data.motion.dx = (ev->code == REL_X) ? ev->value : 0;
+        platform_ev.data.motion.dy = (ev->code == REL_Y) ? ev->value : 0;
+
+        action = damper_handle_event (&device->state, &platform_ev);
+        device->frame_filtered = TRUE;
+    }
+
+    if (action == PLATFORM_ACTION_DROP) {
+        device->frame_dropped++;
+        return FALSE;
+    }
+
+    device->frame_forwarded++;
+    return append_forwarded_event (device, ev);
+}
+
+gboolean
+mouse_device_process_event (MouseDevice *device, const struct input_event *ev)
+{
+    gboolean complete;
+
+    alloc_check_enter ();
+    complete = process_event (device, ev);
+    alloc_check_leave ();
+    report_drops (device);
+
+    return complete;
+}
+
+void
+mouse_device_set_enabled (MouseDevice *device, gboolean enabled)
+{
+    atomic_store_explicit (&device->disabled, !enabled, memory_order_relaxed);
+}
+
+gboolean
+mouse_device_get_enabled (MouseDevice *device)
+{
+    return !atomic_load_explicit (&device->disabled, memory_order_relaxed);
+}
+
+void
+mouse_device_print_counters (MouseDevice *device)
+{
+    const DamperCounters *counters = &device->state.counters;
+
+    g_print ("Freezes for %s: %" G_GUINT64_FORMAT " (%" G_GUINT64_FORMAT "ms frozen), ended by",
+             libevdev_get_name (device->input_device),
+             counters->freezes,
+             counters->frozen_usec / 1000);
+
+    for (int reason = 0; reason < DAMPER_END_COUNT; reason++)
+        g_print (" %s %" G_GUINT64_FORMAT, damper_end_reason_name (reason), counters->ends[reason]);
+
+    g_print ("; %" G_GUINT64_FORMAT " motion events (%" G_GUINT64_FORMAT "px) dropped\n",
+             counters->dropped_events,
+             counters->dropped_px);
+}
+
+void
+mouse_device_print_stats (MouseDevice *device)
+{
+    g_print ("Filter for %s: %" G_GUINT64_FORMAT " frames bypassed, %" G_GUINT64_FORMAT " empty frames suppressed, "
+             "%" G_GUINT64_FORMAT " event drops\n",
+             libevdev_get_name (device->input_device),
+             device->bypassed_frames,
+             device->suppressed_frames,
+             device->drops);
+
+    mouse_device_print_counters (device);
+}
+
+static gboolean
+dispatch_budget (MouseDevice *device, guint budget)
+{
+    struct input_event ev;
+    int rc;
+
+    do {
+        if (budget-- == 0)
+            return TRUE;
+
+        rc = libevdev_next_event (device->input_device, LIBEVDEV_READ_FLAG_NORMAL, &ev);
+        if (rc == LIBEVDEV_READ_STATUS_SUCCESS) {
+            if (process_event (device, &ev))
+                write_frame (device);
+        } else if (rc == LIBEVDEV_READ_STATUS_SYNC) {
+            mouse_device_resync (device);
+            rc = LIBEVDEV_READ_STATUS_SUCCESS;
+        }
+    } while (rc == LIBEVDEV_READ_STATUS_SUCCESS);
+
+    return FALSE;
+}
+
+gboolean
+mouse_device_dispatch_budget (MouseDevice *device, guint budget)
+{
+    gboolean more;
+
+    alloc_check_enter ();
+    more = dispatch_budget (device, budget);
+    alloc_check_leave ();
+    report_drops (device);
+
+    return more;
+}
+
+void
+mouse_device_dispatch (MouseDevice *device)
+{
+    mouse_device_dispatch_budget (device, G_MAXUINT);
+}
+
+void
+mouse_device_free (MouseDevice *device)
+{
+    /* Frames held for the aggregated output may point at this device */
+    if (batch.n_frames > 0)
+        flush_batch ();
+
+    if (device->output_device && device->owns_output) {
+        libevdev_uinput_destroy (device->output_device);
+    } else if (device->owns_output && device->output_fd >= 0) {
+        ioctl (device->output_fd, UI_DEV_DESTROY, NULL);
+        close (device->output_fd);
+    }
+
+    if (device->input_device)
+        libevdev_free (device->input_device);
+
+    if (device->fd >= 0)
+        close (device->fd);
+
+    arena_pool_free (&device_pool, device);
+}
+
+void
+mouse_device_disown_output (MouseDevice *device)
+{
+    if (!device->owns_output)
+        return;
+
+    /* libevdev can only free its handle by destroying the device, so
+     * that small allocation is left behind; this runs on the way out */
+    if (device->output_fd >= 0)
+        close (device->output_fd);
+
+    device->output_device = NULL;
+    device->output_fd = -1;
+    device->owns_output = FALSE;
+}
+
+gboolean
+mouse_device_can_share_output (const struct libevdev *dev)
+{
+    /* Absolute devices (touchpads, tablets) need their own axis ranges */
+    return !libevdev_has_event_type (dev, EV_ABS);
+}
+
+static const guint shared_types[] = { EV_KEY, EV_REL, EV_MSC };
+
+/* Starts from what a typical mouse has, so that most pointers plugged in
+ * later fit the output created for the ones present at startup */
+struct libevdev *
+mouse_device_new_shared_capabilities (void)
+{
+    static const guint rel_codes[] = {
+        REL_X, REL_Y, REL_WHEEL, REL_HWHEEL, REL_WHEEL_HI_RES, REL_HWHEEL_HI_RES
+    };
+    struct libevdev *capabilities = libevdev_new ();
+
+    libevdev_set_name (capabilities, "Mousedamper virtual pointer");
+    libevdev_set_id_bustype (capabilities, BUS_VIRTUAL);
+
+    for (guint code = BTN_LEFT; code <= BTN_TASK; code++)
+        libevdev_enable_event_code (capabilities, EV_KEY, code, NULL);
+
+    for (guint i = 0; i < G_N_ELEMENTS (rel_codes); i++)
+        libevdev_enable_event_code (capabilities, EV_REL, rel_codes[i], NULL);
+
+    libevdev_enable_event_code (capabilities, EV_MSC, MSC_SCAN, NULL);
+    libevdev_enable_property (capabilities, INPUT_PROP_POINTER);
+
+    return capabilities;
+}
+
+void
+mouse_device_merge_capabilities (struct libevdev *into, const struct libevdev *dev)
+{
+    for (guint i = 0; i < G_N_ELEMENTS (shared_types); i++) {
+        gint max = libevdev_event_type_get_max (shared_types[i]);
+
+        if (!libevdev_has_event_type (dev, shared_types[i]))
+            continue;
+
+        for (gint code = 0; code <= max; code++) {
+            if (libevdev_has_event_code (dev, shared_types[i], code))
+                libevdev_enable_event_code (into, shared_types[i], code, NULL);
+        }
+    }
+
+    for (guint prop = 0; prop <= INPUT_PROP_MAX; prop++) {
+        if (libevdev_has_property (dev, prop))
+            libevdev_enable_property (into, prop);
+    }
+}
+
+gboolean
+mouse_device_capabilities_cover (const struct libevdev *capabilities, const struct libevdev *dev)
+{
+    for (guint i = 0; i < G_N_ELEMENTS (shared_types); i++) {
+        gint max = libevdev_event_type_get_max (shared_types[i]);
+
+        if (!libevdev_has_event_type (dev, shared_types[i]))
+            continue;
+
+        for (gint code = 0; code <= max; code++) {
+            if (libevdev_has_event_code (dev, shared_types[i], code) &&
+                !libevdev_has_event_code (capabilities, shared_types[i], code))
+                return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+struct libevdev_uinput *
+mouse_device_create_shared_output (const struct libevdev *capabilities)
+{
+    struct libevdev_uinput *output = NULL;
+    int rc;
+
+    rc = libevdev_uinput_create_from_device (capabilities, LIBEVDEV_UINPUT_OPEN_MANAGED, &output);
+    if (rc < 0) {
+        g_warning ("Failed to create aggregated uinput device: %s", strerror (-rc));
+        return NULL;
+    }
+
+    g_print ("Aggregated output device at %s\n", libevdev_uinput_get_devnode (output));
+
+    return output;
+}
+
+MouseDevice *
+mouse_device_new (const gchar *device_path, struct libevdev_uinput *shared_output)
+{
+    MouseDevice *device;
+    int rc;
+
+    device = arena_pool_alloc (&device_pool);
+    if (device == NULL)
+        return NULL;
+
+    device->fd = -1;
+    device->output_fd = -1;
+    g_strlcpy (device->input_devnode, device_path, sizeof (device->input_devnode));
+
+    device->fd = open (device_path, O_RDONLY | O_NONBLOCK);
+    if (device->fd < 0) {
+        g_warning ("Failed to open %s: %s", device_path, strerror (errno));
+        mouse_device_free (device);
+        return NULL;
+    }
+
+    rc = libevdev_new_from_fd (device->fd, &device->input_device);
+    if (rc < 0) {
+        g_warning ("Failed to initialize libevdev for %s: %s", device_path, strerror (-rc));
+        mouse_device_free (device);
+        return NULL;
+    }
+
+    /* Monotonic timestamps let us compare against clock_gettime () when
+     * measuring latency; the damper core only ever looks at differences. */
+    rc = libevdev_set_clock_id (device->input_device, CLOCK_MONOTONIC);
+    if (rc < 0)
+        g_warning ("Failed to set monotonic clock for %s: %s", device_path, strerror (-rc));
+
+    if (shared_output) {
+        device->output_device = shared_output;
+    } else {
+        rc = libevdev_uinput_create_from_device (device->input_device,
+                                                 LIBEVDEV_UINPUT_OPEN_MANAGED,
+                                                 &device->output_device);
+        if (rc < 0) {
+            g_warning ("Failed to create uinput device for %s: %s", device_path, strerror (-rc));
+            mouse_device_free (device);
+            return NULL;
+        }
+        device->owns_output = TRUE;
+    }
+
+    device->output_fd = libevdev_uinput_get_fd (device->output_device);
+    g_strlcpy (device->output_devnode, libevdev_uinput_get_devnode (device->output_device),
+               sizeof (device->output_devnode));
+
+    g_print ("Device init for %s: redirected from %s to %s\n",
+             libevdev_get_name (device->input_device),
+             device_path,
+             device->output_devnode);
+
+    damper_state_init (&device->state);
+
+    rc = libevdev_grab (device->input_device, LIBEVDEV_GRAB);
+    if (rc < 0) {
+        g_warning ("Failed to grab device %s: %s", device_path, strerror (-rc));
+        mouse_device_free (device);
+        return NULL;
+    }
+
+    return device;
+}
+
+MouseDevice *
+mouse_device_adopt (gint input_fd, const gchar *input_devnode,
+                    gint output_fd, const gchar *output_devnode)
+{
+    MouseDevice *device;
+    int rc;
+
+    device = arena_pool_alloc (&device_pool);
+    if (device == NULL) {
+        close (input_fd);
+        ioctl (output_fd, UI_DEV_DESTROY, NULL);
+        close (output_fd);
+        return NULL;
+    }
+
+    device->fd = input_fd;
+    device->output_fd = output_fd;
+    device->owns_output = TRUE;
+    g_strlcpy (device->input_devnode, input_devnode, sizeof (device->input_devnode));
+    g_strlcpy (device->output_devnode, output_devnode, sizeof (device->output_devnode));
+
+    /* The grab and the clock belong to the open file and are still in
+     * place; grabbing again would fail with EBUSY */
+    rc = libevdev_new_from_fd (device->fd, &device->input_device);
+    if (rc < 0) {
+        g_warning ("Failed to initialize libevdev for %s: %s", input_devnode, strerror (-rc));
+        mouse_device_free (device);
+        return NULL;
+    }
+
+    g_print ("Device resumed for %s: redirected from %s to %s\n",
+             libevdev_get_name (device->input_device),
+             device->input_devnode,
+             device->output_devnode);
+
+    damper_state_init (&device->state);
+
+    return device;
+}
@@ -0,0 +1,135 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+#ifndef MOUSE_DEVICE_H
+#define MOUSE_DEVICE_H
+
+#include "../../common/damper_core.h"
+#include "latency_stats.h"
+#include "telemetry.h"
+#include "glib_compat.h"
+#include <stdatomic.h>
+#include <libevdev/libevdev.h>
+#include <libevdev/libevdev-uinput.h>
+
+/* Longest run of events buffered before a write to uinput */
+#define MOUSE_DEVICE_FRAME_MAX 64
+/* Room for "/dev/input/eventNNN" and uinput's node names */
+#define MOUSE_DEVICE_DEVNODE_MAX 64
+
+/* Frames are timed separately by whether they went through the damper
+ * core: post-freeze ones hold a button edge, or motion during or ending a
+ * freeze, and pass-through ones everything else */
+typedef enum {
+    MOUSE_DEVICE_FRAME_PASS,
+    MOUSE_DEVICE_FRAME_POST_FREEZE,
+    MOUSE_DEVICE_FRAME_KINDS
+} MouseDeviceFrameKind;
+
+typedef struct {
+    struct libevdev *input_device;
+    /* Either a clone of input_device, or the shared aggregated output */
+    struct libevdev_uinput *output_device;
+    /* Events are written here; output_device is NULL when the output was
+     * handed over by a previous daemon image, see upgrade.h */
+    gint output_fd;
+    gboolean owns_output;
+    DamperState state;
+    gint fd;
+    gchar input_devnode[MOUSE_DEVICE_DEVNODE_MAX];
+    gchar output_devnode[MOUSE_DEVICE_DEVNODE_MAX];
+    /* From each frame's kernel timestamp to its uinput write completing */
+    LatencyStats latency[MOUSE_DEVICE_FRAME_KINDS];
+    /* Pending output, written to uinput in one go at the end of a frame */
+    struct input_event frame[MOUSE_DEVICE_FRAME_MAX];
+    guint frame_len;
+    /* Of the last frame completed in frame */
+    MouseDeviceFrameKind frame_kind;
+    gboolean discarding;
+    /* Input frame in progress: whether it went through the damper core,
+     * and how many of its events were forwarded and dropped */
+    gboolean frame_filtered;
+    guint frame_forwarded;
+    guint frame_dropped;
+    guint64 bypassed_frames;
+    guint64 suppressed_frames;
+    /* Times the kernel buffer overflowed and the state was resynced, and
+     * how many of those were logged, which waits for the event handling
+     * to be done as logging allocates */
+    guint64 drops;
+    guint64 reported_drops;
+    /* Fail-open watchdog, see watchdog.h: events read so far, and the
+     * monotonic span the grab was released for (no end while it still
+     * is). Events timestamped within it reached clients directly. */
+    atomic_uint_fast64_t events_read;
+    atomic_int_fast64_t fail_open_start;
+    atomic_int_fast64_t fail_open_end;
+    /* Set to pass events through unfiltered; the dispatching thread
+     * follows it from the next frame, in bypassing */
+    atomic_bool disabled;
+    gboolean bypassing;
+    /* Slot on the telemetry page, if any, see telemetry.h; published at
+     * frame ends from telemetry_next_usec on, or when a freeze starts or
+     * ends */
+    TelemetryDevice *telemetry;
+    gint64 telemetry_next_usec;
+    gboolean telemetry_frozen;
+} MouseDevice;
+
+/* Latency is always recorded; this reports it on exit */
+extern gboolean mouse_device_measure_latency;
+
+/* shared_output: write to this aggregated device instead of a clone */
+MouseDevice *mouse_device_new (const gchar *device_path, struct libevdev_uinput *shared_output);
+/* Takes over a device grabbed, and an output created, by a previous
+ * daemon image; output_fd belongs to the device from then on */
+MouseDevice *mouse_device_adopt (gint input_fd, const gchar *input_devnode,
+                                 gint output_fd, const gchar *output_devnode);
+void mouse_device_free (MouseDevice *device);
+/* Closes the output without destroying it, for whoever still holds it */
+void mouse_device_disown_output (MouseDevice *device);
+void mouse_device_dispatch (MouseDevice *device);
+/* Handles at most budget events; TRUE if it stopped with events left */
+gboolean mouse_device_dispatch_budget (MouseDevice *device, guint budget);
+gboolean mouse_device_process_event (MouseDevice *device, const struct input_event *ev);
+void mouse_device_write_frame (MouseDevice *device);
+/* After libevdev reported dropped events; raw readers resync themselves */
+void mouse_device_resync (MouseDevice *device);
+void mouse_device_record_latency (MouseDevice *device, const struct timeval *time, MouseDeviceFrameKind kind);
+/* p50/p99/max of each kind of frame */
+void mouse_device_print_latency (MouseDevice *device);
+const gchar *mouse_device_frame_kind_name (MouseDeviceFrameKind kind);
+/* From any thread; takes effect at the device's next frame */
+void mouse_device_set_enabled (MouseDevice *device, gboolean enabled);
+gboolean mouse_device_get_enabled (MouseDevice *device);
+void mouse_device_print_stats (MouseDevice *device);
+/* The damper core's freeze counters, see DamperCounters */
+void mouse_device_print_counters (MouseDevice *device);
+
+/* Aggregated output: relative pointers can feed one virtual device with
+ * the union of their capabilities. Frames written between begin_batch ()
+ * and end_batch () on a thread are merged in timestamp order. */
+gboolean mouse_device_can_share_output (const struct libevdev *dev);
+struct libevdev *mouse_device_new_shared_capabilities (void);
+void mouse_device_merge_capabilities (struct libevdev *into, const struct libevdev *dev);
+/* Whether a device can join an output created from capabilities */
+gboolean mouse_device_capabilities_cover (const struct libevdev *capabilities, const struct libevdev *dev);
+struct libevdev_uinput *mouse_device_create_shared_output (const struct libevdev *capabilities);
+void mouse_device_begin_batch (void);
+void mouse_device_end_batch (void);
+
+#endif
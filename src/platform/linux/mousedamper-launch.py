@@ -41,6 +41,10 @@ KEY_DELTA_THRESHOLD = "delta-threshold"
 KEY_OVERRIDE_GTK_DOUBLE_CLICK = "override-gtk-double-click-time"
 KEY_DOUBLE_CLICK_TIME_OVERRIDE = "double-click-time-override"
 
+# Where the system service (mousedamper.service) takes its parameters
+SERVICE_CONFIG_FIFO = "/run/mousedamper/config"
+SERVICE_GROUP = "mousedamper"
+
 class MouseDamperManager(Gtk.Application):
     def __init__(self):
         super().__init__(
@@ -61,6 +65,8 @@ class MouseDamperManager(Gtk.Application):
 
         # Process management
         self.daemon_process = None
+        self.daemon_stdin = None
+        self.service_fifo = None
         self.restart_count = 0
         self.restart_window_start = GLib.get_monotonic_time()
         self.restart_timeout_id = 0
@@ -73,6 +79,8 @@ class MouseDamperManager(Gtk.Application):
         # Start daemon if enabled
         if self.settings.get_boolean(KEY_ENABLED):
             self.start_daemon()
+        else:
+            self.attach_service()
         self.hold()
 
     def do_command_line(self, command_line):
@@ -119,11 +127,9 @@ class MouseDamperManager(Gtk.Application):
         menu.show_all()
         self.status_icon.set_secondary_menu(menu)
 
-    def start_daemon(self):
-        # Kill any existing instances first
-        subprocess.run(["killall", "mousedamper"], stderr=subprocess.DEVNULL, check=False)
-
-        # Get configuration
+    def get_daemon_params(self):
+        # Double-click time, freeze threshold and threshold scale, as the
+        # daemon takes them on its command line and on stdin
         delta_val = self.settings.get_int(KEY_DELTA_THRESHOLD)
         if self.settings.get_boolean(KEY_OVERRIDE_GTK_DOUBLE_CLICK):
             double_click_time = self.settings.get_int(KEY_DOUBLE_CLICK_TIME_OVERRIDE)
@@ -132,22 +138,76 @@ class MouseDamperManager(Gtk.Application):
 
         threshold_scale = 1.0  # Hardcoded per user requirement
 
-        # Build command
+        return [str(double_click_time), str(delta_val), str(threshold_scale)]
+
+    def attach_service(self):
+        # With the system service running there is nothing to spawn, only
+        # parameters to hand over
+        if self.service_fifo is None:
+            try:
+                self.service_fifo = os.open(SERVICE_CONFIG_FIFO, os.O_WRONLY | os.O_NONBLOCK | os.O_CLOEXEC)
+            except PermissionError:
+                print(f"Not allowed to configure the mousedamper service, the user needs to be in the '{SERVICE_GROUP}' group")
+                return False
+            except OSError:
+                return False
+
+            if self.verbose:
+                print(f"Attached to the mousedamper service at {SERVICE_CONFIG_FIFO}")
+
+        if self.update_service():
+            self.update_tooltip()
+            return True
+
+        return False
+
+    def update_service(self):
+        params = self.get_daemon_params()
+
+        # The service keeps running while disabled; a zero threshold
+        # never freezes the pointer
+        if not self.settings.get_boolean(KEY_ENABLED):
+            params[1] = "0"
+
+        try:
+            os.write(self.service_fifo, (" ".join(params) + "\n").encode())
+            return True
+        except OSError as e:
+            print(f"Failed to update the mousedamper service: {e}")
+            os.close(self.service_fifo)
+            self.service_fifo = None
+            return False
+
+    def start_daemon(self):
+        if self.attach_service():
+            return
+
+        # The service is running and holds the grabs; a daemon of our own
+        # would only fail on every device
+        if os.path.exists(SERVICE_CONFIG_FIFO) and not os.access(SERVICE_CONFIG_FIFO, os.W_OK):
+            self.send_notification(_("Mouse Damper Error"),
+                                   _("The mousedamper service is running, but this user isn't in the '%s' group to configure it.") % SERVICE_GROUP)
+            return
+
+        # Kill any existing instances first
+        subprocess.run(["killall", "mousedamper"], stderr=subprocess.DEVNULL, check=False)
+
+        # Build command; later settings changes are sent over stdin
         cmd = [
             DAEMON_EXEC,
             "verbose" if self.verbose else "terse",
-            str(double_click_time),
-            str(delta_val),
-            str(threshold_scale)
+        ] + self.get_daemon_params() + [
+            "--config-stdin"
         ]
 
         # Launch as subprocess using Gio.Subprocess for async monitoring
         try:
-            flags = Gio.SubprocessFlags.NONE
+            flags = Gio.SubprocessFlags.STDIN_PIPE
             if not self.verbose:
-                flags = Gio.SubprocessFlags.STDOUT_SILENCE | Gio.SubprocessFlags.STDERR_SILENCE
+                flags |= Gio.SubprocessFlags.STDOUT_SILENCE | Gio.SubprocessFlags.STDERR_SILENCE
 
             self.daemon_process = Gio.Subprocess.new(cmd, flags)
+            self.daemon_stdin = self.daemon_process.get_stdin_pipe()
 
             # Monitor for exit asynchronously
             self.daemon_process.wait_async(None, self.on_daemon_exited)
@@ -170,6 +230,7 @@ class MouseDamperManager(Gtk.Application):
             except:
                 subprocess.run(["killall", "mousedamper"], stderr=subprocess.DEVNULL, check=False)
             self.daemon_process = None
+            self.daemon_stdin = None
 
         self.update_tooltip()
 
@@ -181,6 +242,7 @@ class MouseDamperManager(Gtk.Application):
             exit_code = -1
 
         self.daemon_process = None
+        self.daemon_stdin = None
 
         if self.verbose:
             print(f"Mousedamper daemon exited with code {exit_code}")
@@ -211,21 +273,40 @@ class MouseDamperManager(Gtk.Application):
             self.update_tooltip()
 
     def on_settings_changed(self, settings, key):
-        # Restart daemon on any GSettings change
+        # Reconfigure or restart the daemon on any GSettings change
         # Debounce to handle multiple rapid changes
         if self.restart_timeout_id:
             GLib.source_remove(self.restart_timeout_id)
 
         self.restart_timeout_id = GLib.timeout_add(100, self.restart_daemon_delayed)
 
+    def update_daemon(self):
+        # Hands the running daemon its new parameters, keeping its devices
+        line = " ".join(self.get_daemon_params()) + "\n"
+        try:
+            self.daemon_stdin.write_all(line.encode(), None)
+            return True
+        except GLib.Error as e:
+            print(f"Failed to update mousedamper: {e.message}")
+            return False
+
     def restart_daemon_delayed(self):
-        if self.verbose:
-            print("GSettings changed, restarting daemon...")
+        enabled = self.settings.get_boolean(KEY_ENABLED)
 
-        self.stop_daemon()
+        if self.service_fifo is not None and self.update_service():
+            if self.verbose:
+                print("GSettings changed, updated service configuration")
+        elif enabled and self.daemon_process and self.daemon_stdin and self.update_daemon():
+            if self.verbose:
+                print("GSettings changed, updated daemon configuration")
+        else:
+            if self.verbose:
+                print("GSettings changed, restarting daemon...")
 
-        if self.settings.get_boolean(KEY_ENABLED):
-            self.start_daemon()
+            self.stop_daemon()
+
+            if enabled:
+                self.start_daemon()
 
         # Update menu checkbox
         self.enable_item.set_active(self.settings.get_boolean(KEY_ENABLED))
@@ -234,7 +315,9 @@ class MouseDamperManager(Gtk.Application):
         return GLib.SOURCE_REMOVE
 
     def update_tooltip(self):
-        if self.daemon_process:
+        if self.service_fifo is not None and self.settings.get_boolean(KEY_ENABLED):
+            tooltip = _("Mouse Damper - Active (system service)")
+        elif self.daemon_process:
             tooltip = _("Mouse Damper - Active")
         elif self.settings.get_boolean(KEY_ENABLED):
             tooltip = _("Mouse Damper - Starting...")
@@ -275,6 +358,9 @@ class MouseDamperManager(Gtk.Application):
         if self.verbose:
             print("Quitting manager...")
         self.stop_daemon()
+        if self.service_fifo is not None:
+            os.close(self.service_fifo)
+            self.service_fifo = None
         self.quit()
 
 
@@ -0,0 +1,825 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+/* Pipelined backend: a reader thread drains every grabbed evdev fd into a
+ * per-device ring, a processing thread runs the damper over it into a
+ * second ring, and a writer thread drains that into uinput. A slow uinput
+ * write then only stalls the writer. Rings are bounded: when the output
+ * ring is full the processor stops taking input for that device, and when
+ * the input ring is full the reader stops reading the fd, leaving the
+ * kernel's buffer to absorb the rest. Each stall and each kernel overflow
+ * (SYN_DROPPED) is counted. */
+
+#include "event_loop.h"
+#include "arena.h"
+#include "alloc_check.h"
+#include "input_thread.h"
+#include "spsc_ring.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+
+#define MAX_EVENTS 32
+#define MAX_DEVICES 64
+#define READ_CHUNK 64
+#define WRITE_CHUNK 256
+
+int event_loop_pipeline_ring_size = 1024;
+
+typedef struct {
+    MouseDevice *device;
+    SpscRing raw;
+    SpscRing out;
+    atomic_bool removed;
+    /* Reader stopped polling the fd until the processor frees space */
+    atomic_bool paused;
+    /* Processor holds a finished frame until the writer frees space */
+    atomic_bool blocked;
+    bool frame_pending;
+    atomic_uint_fast64_t input_stalls;
+    atomic_uint_fast64_t output_stalls;
+    atomic_uint_fast64_t kernel_overflows;
+    size_t peak_raw;
+    size_t peak_out;
+} PipeDevice;
+
+static ArenaPool device_pool = ARENA_POOL_INIT (PipeDevice);
+/* Sized from event_loop_pipeline_ring_size in pipeline_new () */
+static ArenaPool ring_pool = { 0, NULL };
+
+/* Slots and their rings' storage stay with each other for reuse */
+static void
+pipe_device_free (PipeDevice *pdev)
+{
+    arena_pool_free (&ring_pool, pdev->raw.slots);
+    arena_pool_free (&ring_pool, pdev->out.slots);
+    arena_pool_free (&device_pool, pdev);
+}
+
+/* Lets a consumer sleep on an eventfd without producers paying for a
+ * write () while it is busy */
+typedef struct {
+    int fd;
+    atomic_bool sleeping;
+    /* Bumped every pass and set while blocked, so pipeline_remove_device ()
+     * can tell when the stage has let go of a device */
+    atomic_uint passes;
+    atomic_bool blocked;
+} StageWaker;
+
+typedef struct {
+    EventLoop parent;
+    PipeDevice *devices[MAX_DEVICES];
+    atomic_int n_devices;
+    pthread_t threads[3];
+    int n_threads;
+    int stop_fd;
+    int reader_epoll_fd;
+    StageWaker reader_waker;
+    StageWaker processor_waker;
+    StageWaker writer_waker;
+    int control_epoll_fd;
+    int quit_fd;
+    int signal_fd;
+} Pipeline;
+
+static void
+stage_wake (StageWaker *waker)
+{
+    uint64_t value = 1;
+
+    atomic_thread_fence (memory_order_seq_cst);
+    if (atomic_load (&waker->sleeping) && write (waker->fd, &value, sizeof (value)) < 0)
+        g_warning ("Failed to wake pipeline stage: %s", strerror (errno));
+}
+
+/* Returns false once the pipeline is stopping */
+static bool
+stage_sleep (Pipeline *pipeline, StageWaker *waker, bool (*has_work) (Pipeline *))
+{
+    struct pollfd fds[2] = {
+        { .fd = waker->fd, .events = POLLIN },
+        { .fd = pipeline->stop_fd, .events = POLLIN }
+    };
+    uint64_t value;
+
+    atomic_store (&waker->sleeping, true);
+    atomic_thread_fence (memory_order_seq_cst);
+
+    if (!has_work (pipeline)) {
+        int n;
+
+        atomic_store (&waker->blocked, true);
+        n = poll (fds, 2, -1);
+        atomic_store (&waker->blocked, false);
+
+        if (n > 0 && (fds[1].revents & POLLIN)) {
+            atomic_store (&waker->sleeping, false);
+            return false;
+        }
+        if (n > 0 && read (waker->fd, &value, sizeof (value)) < 0 && errno != EAGAIN)
+            g_warning ("Failed to read pipeline eventfd: %s", strerror (errno));
+    }
+
+    atomic_store (&waker->sleeping, false);
+    return true;
+}
+
+static PipeDevice *
+get_device (Pipeline *pipeline, int i)
+{
+    PipeDevice *pdev = pipeline->devices[i];
+
+    return atomic_load (&pdev->removed) ? NULL : pdev;
+}
+
+/* Reader stage */
+
+static void
+resume_paused (Pipeline *pipeline)
+{
+    int n = atomic_load (&pipeline->n_devices);
+
+    for (int i = 0; i < n; i++) {
+        PipeDevice *pdev = get_device (pipeline, i);
+        struct epoll_event event = { .events = EPOLLIN };
+
+        if (pdev == NULL || !atomic_load (&pdev->paused) || spsc_ring_free_space (&pdev->raw) == 0)
+            continue;
+
+        event.data.ptr = pdev;
+        atomic_store (&pdev->paused, false);
+        epoll_ctl (pipeline->reader_epoll_fd, EPOLL_CTL_MOD, pdev->device->fd, &event);
+    }
+}
+
+static void
+read_device (Pipeline *pipeline, PipeDevice *pdev)
+{
+    struct input_event buffer[READ_CHUNK];
+    size_t space = spsc_ring_free_space (&pdev->raw);
+    size_t depth;
+    ssize_t len;
+    size_t n;
+
+    if (space == 0) {
+        struct epoll_event event = { .events = 0, .data.ptr = pdev };
+
+        atomic_store (&pdev->paused, true);
+        epoll_ctl (pipeline->reader_epoll_fd, EPOLL_CTL_MOD, pdev->device->fd, &event);
+        atomic_fetch_add (&pdev->input_stalls, 1);
+        stage_wake (&pipeline->processor_waker);
+
+        /* The processor may have drained the ring before seeing the flag */
+        atomic_thread_fence (memory_order_seq_cst);
+        if (spsc_ring_free_space (&pdev->raw) > 0)
+            resume_paused (pipeline);
+        return;
+    }
+
+    len = read (pdev->device->fd, buffer, MIN (space, READ_CHUNK) * sizeof (struct input_event));
+    if (len < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            g_warning ("Device disconnected or error occurred: %s", strerror (errno));
+            epoll_ctl (pipeline->reader_epoll_fd, EPOLL_CTL_DEL, pdev->device->fd, NULL);
+        }
+        return;
+    }
+
+    n = len / sizeof (struct input_event);
+    for (size_t i = 0; i < n; i++) {
+        if (buffer[i].type == EV_SYN && buffer[i].code == SYN_DROPPED)
+            atomic_fetch_add (&pdev->kernel_overflows, 1);
+    }
+
+    spsc_ring_push (&pdev->raw, buffer, n);
+
+    depth = spsc_ring_count (&pdev->raw);
+    if (depth > pdev->peak_raw)
+        pdev->peak_raw = depth;
+
+    stage_wake (&pipeline->processor_waker);
+}
+
+static void *
+reader_func (void *data)
+{
+    Pipeline *pipeline = data;
+    struct epoll_event events[MAX_EVENTS];
+
+    if (input_thread_config.enabled)
+        input_thread_setup_current (0);
+
+    /* The reader blocks in epoll, never on the waker */
+    atomic_store (&pipeline->reader_waker.sleeping, true);
+
+    while (true) {
+        int n;
+
+        atomic_store (&pipeline->reader_waker.blocked, true);
+        n = epoll_wait (pipeline->reader_epoll_fd, events, MAX_EVENTS, -1);
+        atomic_store (&pipeline->reader_waker.blocked, false);
+        atomic_fetch_add (&pipeline->reader_waker.passes, 1);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            g_warning ("Pipeline reader: epoll_wait failed: %s", strerror (errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+
+            if (ptr == &pipeline->stop_fd)
+                return NULL;
+
+            if (ptr == &pipeline->reader_waker) {
+                uint64_t value;
+
+                if (read (pipeline->reader_waker.fd, &value, sizeof (value)) < 0 && errno != EAGAIN)
+                    g_warning ("Failed to read pipeline eventfd: %s", strerror (errno));
+                resume_paused (pipeline);
+                continue;
+            }
+
+            /* Removed since epoll_wait () returned; may already be freed */
+            if (atomic_load (&((PipeDevice *) ptr)->removed))
+                continue;
+
+            if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                g_warning ("Device disconnected or error occurred");
+                epoll_ctl (pipeline->reader_epoll_fd, EPOLL_CTL_DEL, ((PipeDevice *) ptr)->device->fd, NULL);
+                continue;
+            }
+
+            read_device (pipeline, ptr);
+        }
+    }
+
+    return NULL;
+}
+
+/* Processor stage */
+
+static bool
+flush_frame (Pipeline *pipeline, PipeDevice *pdev)
+{
+    MouseDevice *device = pdev->device;
+    struct input_event *last = &device->frame[device->frame_len - 1];
+    size_t depth;
+
+    /* The frame's kind rides to the writer in its SYN_REPORT's value,
+     * which the writer zeroes again before writing it out */
+    if (last->type == EV_SYN && last->code == SYN_REPORT)
+        last->value = device->frame_kind;
+
+    if (!spsc_ring_push (&pdev->out, device->frame, device->frame_len)) {
+        if (!atomic_exchange (&pdev->blocked, true))
+            atomic_fetch_add (&pdev->output_stalls, 1);
+
+        /* Retry once in case the writer drained the ring before it could
+         * see the flag */
+        if (!spsc_ring_push (&pdev->out, device->frame, device->frame_len))
+            return false;
+    }
+
+    atomic_store (&pdev->blocked, false);
+    pdev->frame_pending = false;
+    device->frame_len = 0;
+
+    depth = spsc_ring_count (&pdev->out);
+    if (depth > pdev->peak_out)
+        pdev->peak_out = depth;
+
+    stage_wake (&pipeline->writer_waker);
+    return true;
+}
+
+static bool
+process_device (Pipeline *pipeline, PipeDevice *pdev)
+{
+    bool worked = false;
+
+    while (true) {
+        struct input_event *events;
+        size_t n, i;
+
+        if (pdev->frame_pending && !flush_frame (pipeline, pdev))
+            break;
+
+        n = spsc_ring_peek (&pdev->raw, &events, READ_CHUNK);
+        if (n == 0)
+            break;
+
+        for (i = 0; i < n; i++) {
+            /* Resync output is written directly; let the writer catch up
+             * first so it cannot overtake frames from before the drop */
+            if (events[i].type == EV_SYN && events[i].code == SYN_DROPPED) {
+                while (spsc_ring_count (&pdev->out) > 0 && !atomic_load (&pdev->removed)) {
+                    stage_wake (&pipeline->writer_waker);
+                    sched_yield ();
+                }
+            }
+
+            if (mouse_device_process_event (pdev->device, &events[i])) {
+                pdev->frame_pending = true;
+                i++;
+                break;
+            }
+        }
+
+        spsc_ring_consume (&pdev->raw, i);
+        worked = true;
+
+        atomic_thread_fence (memory_order_seq_cst);
+        if (atomic_load (&pdev->paused))
+            stage_wake (&pipeline->reader_waker);
+    }
+
+    return worked;
+}
+
+static bool
+processor_has_work (Pipeline *pipeline)
+{
+    int n = atomic_load (&pipeline->n_devices);
+
+    for (int i = 0; i < n; i++) {
+        PipeDevice *pdev = get_device (pipeline, i);
+
+        if (pdev && spsc_ring_count (&pdev->raw) > 0 &&
+            !(pdev->frame_pending && atomic_load (&pdev->blocked)))
+            return true;
+    }
+
+    return false;
+}
+
+static void *
+processor_func (void *data)
+{
+    Pipeline *pipeline = data;
+
+    if (input_thread_config.enabled)
+        input_thread_setup_current (1);
+
+    while (true) {
+        int n = atomic_load (&pipeline->n_devices);
+        bool worked = false;
+
+        atomic_fetch_add (&pipeline->processor_waker.passes, 1);
+
+        for (int i = 0; i < n; i++) {
+            PipeDevice *pdev = get_device (pipeline, i);
+
+            if (pdev && process_device (pipeline, pdev))
+                worked = true;
+        }
+
+        if (!worked && !stage_sleep (pipeline, &pipeline->processor_waker, processor_has_work))
+            break;
+    }
+
+    return NULL;
+}
+
+/* Writer stage */
+
+static void
+write_device (Pipeline *pipeline, PipeDevice *pdev, struct input_event *events, size_t n)
+{
+    MouseDevice *device = pdev->device;
+    ssize_t size = n * sizeof (struct input_event);
+
+    guint8 kinds[WRITE_CHUNK];
+    size_t n_frames = 0;
+
+    /* See flush_frame () */
+    for (size_t i = 0; i < n; i++) {
+        if (events[i].type == EV_SYN && events[i].code == SYN_REPORT) {
+            kinds[n_frames++] = events[i].value;
+            events[i].value = 0;
+        }
+    }
+
+    if (write (device->output_fd, events, size) != size) {
+        g_warning ("Failed to write to %s: %s", device->output_devnode, strerror (errno));
+        return;
+    }
+
+    n_frames = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (events[i].type == EV_SYN && events[i].code == SYN_REPORT)
+            mouse_device_record_latency (device, &events[i].time, kinds[n_frames++]);
+    }
+}
+
+static bool
+writer_has_work (Pipeline *pipeline)
+{
+    int n = atomic_load (&pipeline->n_devices);
+
+    for (int i = 0; i < n; i++) {
+        PipeDevice *pdev = get_device (pipeline, i);
+
+        if (pdev && spsc_ring_count (&pdev->out) > 0)
+            return true;
+    }
+
+    return false;
+}
+
+static void *
+writer_func (void *data)
+{
+    Pipeline *pipeline = data;
+
+    if (input_thread_config.enabled)
+        input_thread_setup_current (2);
+
+    while (true) {
+        int n_devices = atomic_load (&pipeline->n_devices);
+        bool worked = false;
+
+        atomic_fetch_add (&pipeline->writer_waker.passes, 1);
+
+        for (int i = 0; i < n_devices; i++) {
+            PipeDevice *pdev = get_device (pipeline, i);
+            struct input_event *events;
+            size_t n;
+
+            if (pdev == NULL)
+                continue;
+
+            n = spsc_ring_peek (&pdev->out, &events, WRITE_CHUNK);
+            if (n == 0)
+                continue;
+
+            alloc_check_enter ();
+            write_device (pipeline, pdev, events, n);
+            alloc_check_leave ();
+            spsc_ring_consume (&pdev->out, n);
+            worked = true;
+
+            atomic_thread_fence (memory_order_seq_cst);
+            if (atomic_load (&pdev->blocked))
+                stage_wake (&pipeline->processor_waker);
+        }
+
+        if (!worked && !stage_sleep (pipeline, &pipeline->writer_waker, writer_has_work))
+            break;
+    }
+
+    return NULL;
+}
+
+/* Backend */
+
+static void
+close_fd (int fd)
+{
+    if (fd >= 0)
+        close (fd);
+}
+
+static void
+pipeline_free (EventLoop *base)
+{
+    Pipeline *pipeline = (Pipeline *) base;
+    int n = atomic_load (&pipeline->n_devices);
+
+    for (int i = 0; i < n; i++) {
+        pipe_device_free (pipeline->devices[i]);
+    }
+
+    close_fd (pipeline->stop_fd);
+    close_fd (pipeline->reader_epoll_fd);
+    close_fd (pipeline->reader_waker.fd);
+    close_fd (pipeline->processor_waker.fd);
+    close_fd (pipeline->writer_waker.fd);
+    close_fd (pipeline->control_epoll_fd);
+    close_fd (pipeline->quit_fd);
+    close_fd (pipeline->signal_fd);
+    g_free (pipeline);
+}
+
+static bool
+watch_fd (int epoll_fd, int fd, void *ptr)
+{
+    struct epoll_event event = { 0 };
+
+    event.events = EPOLLIN;
+    event.data.ptr = ptr;
+
+    if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        g_warning ("Failed to add fd %d to epoll set: %s", fd, strerror (errno));
+        return false;
+    }
+
+    return true;
+}
+
+static EventLoop *
+pipeline_new (bool handle_signals)
+{
+    Pipeline *pipeline = g_new0 (Pipeline, 1);
+
+    ring_pool.size = event_loop_pipeline_ring_size * sizeof (struct input_event);
+    pipeline->signal_fd = -1;
+    pipeline->stop_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+    pipeline->quit_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+    pipeline->reader_waker.fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+    pipeline->processor_waker.fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+    pipeline->writer_waker.fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+    pipeline->reader_epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+    pipeline->control_epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+
+    if (pipeline->stop_fd < 0 || pipeline->quit_fd < 0 || pipeline->reader_waker.fd < 0 ||
+        pipeline->processor_waker.fd < 0 || pipeline->writer_waker.fd < 0 ||
+        pipeline->reader_epoll_fd < 0 || pipeline->control_epoll_fd < 0 ||
+        !watch_fd (pipeline->reader_epoll_fd, pipeline->stop_fd, &pipeline->stop_fd) ||
+        !watch_fd (pipeline->reader_epoll_fd, pipeline->reader_waker.fd, &pipeline->reader_waker) ||
+        !watch_fd (pipeline->control_epoll_fd, pipeline->quit_fd, &pipeline->quit_fd)) {
+        g_warning ("Failed to set up the pipeline: %s", strerror (errno));
+        pipeline_free (&pipeline->parent);
+        return NULL;
+    }
+
+    if (handle_signals) {
+        sigset_t mask;
+
+        sigemptyset (&mask);
+        sigaddset (&mask, SIGINT);
+        sigaddset (&mask, SIGTERM);
+        sigprocmask (SIG_BLOCK, &mask, NULL);
+
+        pipeline->signal_fd = signalfd (-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+        if (pipeline->signal_fd < 0 ||
+            !watch_fd (pipeline->control_epoll_fd, pipeline->signal_fd, &pipeline->signal_fd)) {
+            g_warning ("Failed to create signalfd: %s", strerror (errno));
+            pipeline_free (&pipeline->parent);
+            return NULL;
+        }
+    }
+
+    return &pipeline->parent;
+}
+
+static bool
+pipeline_add_device (EventLoop *base, MouseDevice *device)
+{
+    Pipeline *pipeline = (Pipeline *) base;
+    int n = atomic_load (&pipeline->n_devices);
+    PipeDevice *pdev = NULL;
+    int slot = n;
+
+    /* Removal waits for every stage to let go, so removed slots are free */
+    for (int i = 0; i < n; i++) {
+        if (atomic_load (&pipeline->devices[i]->removed)) {
+            slot = i;
+            pdev = pipeline->devices[i];
+            break;
+        }
+    }
+
+    if (slot == MAX_DEVICES) {
+        g_warning ("Pipeline is full, not handling %s", libevdev_get_name (device->input_device));
+        return false;
+    }
+
+    if (pdev == NULL) {
+        pdev = arena_pool_alloc (&device_pool);
+        if (pdev == NULL)
+            return false;
+
+        atomic_init (&pdev->removed, true);
+        pdev->raw.slots = arena_pool_alloc (&ring_pool);
+        pdev->out.slots = arena_pool_alloc (&ring_pool);
+    }
+    pdev->device = device;
+    pdev->frame_pending = false;
+    pdev->peak_raw = 0;
+    pdev->peak_out = 0;
+    atomic_store (&pdev->paused, false);
+    atomic_store (&pdev->blocked, false);
+    atomic_store (&pdev->input_stalls, 0);
+    atomic_store (&pdev->output_stalls, 0);
+    atomic_store (&pdev->kernel_overflows, 0);
+
+    if (!spsc_ring_init (&pdev->raw, pdev->raw.slots, event_loop_pipeline_ring_size) ||
+        !spsc_ring_init (&pdev->out, pdev->out.slots, event_loop_pipeline_ring_size)) {
+        g_warning ("Failed to allocate pipeline rings");
+        goto fail;
+    }
+
+    if (!watch_fd (pipeline->reader_epoll_fd, device->fd, pdev))
+        goto fail;
+
+    /* Publish only once fully set up; stages check removed first */
+    pipeline->devices[slot] = pdev;
+    atomic_store (&pdev->removed, false);
+    if (slot == n)
+        atomic_store (&pipeline->n_devices, n + 1);
+
+    return true;
+
+fail:
+    if (slot == n)
+        pipe_device_free (pdev);
+    return false;
+}
+
+static void
+wait_for_stages (Pipeline *pipeline)
+{
+    StageWaker *stages[] = {
+        &pipeline->reader_waker,
+        &pipeline->processor_waker,
+        &pipeline->writer_waker
+    };
+
+    if (pipeline->n_threads == 0)
+        return;
+
+    for (guint i = 0; i < G_N_ELEMENTS (stages); i++) {
+        unsigned int passes = atomic_load (&stages[i]->passes);
+
+        while (!atomic_load (&stages[i]->blocked) && atomic_load (&stages[i]->passes) == passes)
+            sched_yield ();
+    }
+}
+
+static void
+pipeline_remove_device (EventLoop *base, MouseDevice *device)
+{
+    Pipeline *pipeline = (Pipeline *) base;
+    int n = atomic_load (&pipeline->n_devices);
+
+    for (int i = 0; i < n; i++) {
+        PipeDevice *pdev = pipeline->devices[i];
+
+        if (pdev->device == device && !atomic_load (&pdev->removed)) {
+            atomic_store (&pdev->removed, true);
+            epoll_ctl (pipeline->reader_epoll_fd, EPOLL_CTL_DEL, device->fd, NULL);
+            wait_for_stages (pipeline);
+            return;
+        }
+    }
+}
+
+static bool
+pipeline_add_watch (EventLoop *base, EventLoopWatch *watch)
+{
+    Pipeline *pipeline = (Pipeline *) base;
+
+    return watch_fd (pipeline->control_epoll_fd, watch->fd, watch);
+}
+
+static void
+pipeline_remove_watch (EventLoop *base, EventLoopWatch *watch)
+{
+    Pipeline *pipeline = (Pipeline *) base;
+
+    epoll_ctl (pipeline->control_epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+}
+
+static void
+print_stats (Pipeline *pipeline)
+{
+    int n = atomic_load (&pipeline->n_devices);
+
+    for (int i = 0; i < n; i++) {
+        PipeDevice *pdev = get_device (pipeline, i);
+
+        if (pdev == NULL)
+            continue;
+
+        g_print ("Pipeline for %s: %lu input stalls, %lu output stalls, %lu kernel overflows, "
+                 "peak depth %zu/%zu of %d\n",
+                 libevdev_get_name (pdev->device->input_device),
+                 (unsigned long) atomic_load (&pdev->input_stalls),
+                 (unsigned long) atomic_load (&pdev->output_stalls),
+                 (unsigned long) atomic_load (&pdev->kernel_overflows),
+                 pdev->peak_raw,
+                 pdev->peak_out,
+                 event_loop_pipeline_ring_size);
+    }
+}
+
+static void
+pipeline_run (EventLoop *base)
+{
+    Pipeline *pipeline = (Pipeline *) base;
+    void *(*stages[]) (void *) = { reader_func, processor_func, writer_func };
+    bool running = true;
+    uint64_t value = 1;
+
+    if (input_thread_config.enabled)
+        input_thread_acquire_resources ();
+
+    for (guint i = 0; i < G_N_ELEMENTS (stages); i++) {
+        pthread_attr_t attr;
+        int rc;
+
+        pthread_attr_init (&attr);
+        pthread_attr_setstacksize (&attr, INPUT_THREAD_STACK_SIZE_BYTES);
+        rc = pthread_create (&pipeline->threads[i], &attr, stages[i], pipeline);
+        pthread_attr_destroy (&attr);
+
+        if (rc != 0) {
+            g_warning ("Failed to start pipeline stage %u: %s", i, strerror (rc));
+            running = false;
+            break;
+        }
+        pipeline->n_threads++;
+    }
+
+    while (running) {
+        struct epoll_event events[2 + EVENT_LOOP_MAX_WATCHES];
+        int n = epoll_wait (pipeline->control_epoll_fd, events, G_N_ELEMENTS (events), -1);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            g_warning ("epoll_wait failed: %s", strerror (errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            EventLoopWatch *watch = events[i].data.ptr;
+
+            if (event_loop_is_watch (base, watch)) {
+                if (watch->fd >= 0)
+                    watch->callback (watch->data);
+                continue;
+            }
+
+            if (events[i].data.ptr == &pipeline->signal_fd) {
+                struct signalfd_siginfo info;
+
+                if (read (pipeline->signal_fd, &info, sizeof (info)) == sizeof (info))
+                    g_print ("Received signal, shutting down...\n");
+            }
+            running = false;
+        }
+    }
+
+    if (write (pipeline->stop_fd, &value, sizeof (value)) < 0)
+        g_warning ("Failed to stop the pipeline: %s", strerror (errno));
+
+    for (int i = 0; i < pipeline->n_threads; i++)
+        pthread_join (pipeline->threads[i], NULL);
+    pipeline->n_threads = 0;
+
+    print_stats (pipeline);
+
+    if (input_thread_config.enabled)
+        input_thread_release_resources ();
+}
+
+static void
+pipeline_quit (EventLoop *base)
+{
+    Pipeline *pipeline = (Pipeline *) base;
+    uint64_t value = 1;
+
+    if (write (pipeline->quit_fd, &value, sizeof (value)) < 0)
+        g_warning ("Failed to wake the pipeline: %s", strerror (errno));
+}
+
+const EventLoopBackend event_loop_backend_pipeline = {
+    .name = "pipeline",
+    .new = pipeline_new,
+    .add_device = pipeline_add_device,
+    .remove_device = pipeline_remove_device,
+    .add_watch = pipeline_add_watch,
+    .remove_watch = pipeline_remove_watch,
+    .run = pipeline_run,
+    .quit = pipeline_quit,
+    .free = pipeline_free
+};
@@ -16,300 +16,1683 @@
 
 #include "../../common/platform.h"
 #include "../../common/damper_core.h"
+#include "mouse_device.h"
+#include "event_loop.h"
+#include "input_thread.h"
+#include "hid_filter.h"
+#include "arena.h"
+#include "alloc_check.h"
+#include "upgrade.h"
+#include "service.h"
+#include "watchdog.h"
+#include "control.h"
+#include "telemetry.h"
+#include "log_thread.h"
 #include <glib-unix.h>
-#include <libevdev/libevdev.h>
-#include <libevdev/libevdev-uinput.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <unistd.h>
 #include <string.h>
-#include <errno.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+
+typedef struct {
+    const char *name;
+    bool (*apply) (const char *value);
+} PlatformOption;
+
+static GPtrArray *mouse_devices = NULL;
+/* Devices filtered in the kernel instead, see hid_filter.h */
+static GPtrArray *hid_filters = NULL;
+static const EventLoopBackend *event_loop_backend = NULL;
+static EventLoop *event_loop = NULL;
+static GMainLoop *main_loop = NULL;
+static gboolean aggregate_output = FALSE;
+static struct libevdev_uinput *shared_output = NULL;
+/* Kept to check whether devices plugged in later fit the shared output */
+static struct libevdev *shared_capabilities = NULL;
+static gint hotplug_fd = -1;
+/* Parameter updates read from stdin or a FIFO, see watch_config () */
+static gboolean config_stdin = FALSE;
+static gchar *config_fifo = NULL;
+static gboolean publish_telemetry = FALSE;
+static gint config_fd = -1;
+static gchar config_line[256];
+static gsize config_line_len = 0;
+/* SIGUSR2 starts a live upgrade, see upgrade.h */
+static gint upgrade_fd = -1;
+/* SIGUSR1 prints each device's latency */
+static gint latency_fd = -1;
+static gint resume_fd = -1;
+
+#define INPUT_DIR "/dev/input"
+
+/* Devices whose name contains one of the patterns share a freeze */
+typedef struct {
+    gchar **patterns;
+    gboolean all;
+    DamperDomain domain;
+} FreezeGroup;
+
+static GPtrArray *freeze_groups = NULL;
+
+static void
+freeze_group_free (FreezeGroup *group)
+{
+    g_strfreev (group->patterns);
+    g_free (group);
+}
+
+static void
+join_freeze_group (MouseDevice *device)
+{
+    const gchar *name = libevdev_get_name (device->input_device);
+    gchar *folded_name = g_utf8_casefold (name, -1);
+
+    for (guint i = 0; freeze_groups && i < freeze_groups->len; i++) {
+        FreezeGroup *group = g_ptr_array_index (freeze_groups, i);
+        gboolean match = group->all;
+
+        for (gchar **pattern = group->patterns; !match && *pattern; pattern++)
+            match = **pattern != '\0' && strstr (folded_name, *pattern) != NULL;
+
+        if (match) {
+            damper_state_set_domain (&device->state, &group->domain);
+            g_print ("Device %s is in freeze group %u\n", name, i + 1);
+            break;
+        }
+    }
+
+    g_free (folded_name);
+}
+
+/* The aggregated output outlives every device writing to it */
+static void
+free_devices (void)
+{
+    g_ptr_array_unref (mouse_devices);
+    g_ptr_array_unref (hid_filters);
+
+    if (shared_output)
+        libevdev_uinput_destroy (shared_output);
+    shared_output = NULL;
+
+    if (shared_capabilities)
+        libevdev_free (shared_capabilities);
+    shared_capabilities = NULL;
+}
+
+static MouseDevice *
+find_device (const gchar *input_devnode)
+{
+    for (guint i = 0; i < mouse_devices->len; i++) {
+        MouseDevice *device = g_ptr_array_index (mouse_devices, i);
+
+        if (g_strcmp0 (device->input_devnode, input_devnode) == 0)
+            return device;
+    }
+
+    return NULL;
+}
+
+static HidFilter *
+find_hid_filter (const gchar *devnode)
+{
+    for (guint i = 0; i < hid_filters->len; i++) {
+        HidFilter *filter = g_ptr_array_index (hid_filters, i);
+
+        if (g_strcmp0 (hid_filter_get_devnode (filter), devnode) == 0)
+            return filter;
+    }
+
+    return NULL;
+}
+
+/* Whether the mouse at path is now filtered in the kernel. Only the first
+ * node of a HID device gets the program; any other goes to userspace. */
+static gboolean
+try_hid_filter (const gchar *path)
+{
+    gint hid_id = hid_filter_hid_id (path);
+    HidFilter *filter;
+
+    if (hid_id < 0)
+        return FALSE;
+
+    for (guint i = 0; i < hid_filters->len; i++) {
+        if (hid_filter_get_hid_id (g_ptr_array_index (hid_filters, i)) == hid_id)
+            return FALSE;
+    }
+
+    filter = hid_filter_new (path, hid_id);
+    if (filter == NULL)
+        return FALSE;
+
+    g_ptr_array_add (hid_filters, filter);
+
+    return TRUE;
+}
+
+static gboolean
+is_own_device (const gchar *path)
+{
+    if (shared_output && g_strcmp0 (libevdev_uinput_get_devnode (shared_output), path) == 0)
+        return TRUE;
+
+    for (guint i = 0; i < mouse_devices->len; i++) {
+        MouseDevice *device = g_ptr_array_index (mouse_devices, i);
+
+        if (g_strcmp0 (device->output_devnode, path) == 0)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* Tells from the node's sysfs capability bitmap whether it reports a key
+ * code, without opening it; -1 if sysfs can't say. */
+static gint
+sysfs_has_key (const gchar *path, guint code)
+{
+    const guint bits_per_word = sizeof (gulong) * 8;
+    gchar *name = g_path_get_basename (path);
+    gchar *caps_path = g_build_filename ("/sys/class/input", name, "device", "capabilities", "key", NULL);
+    gchar *contents = NULL;
+    gint result = -1;
+
+    if (g_file_get_contents (caps_path, &contents, NULL, NULL)) {
+        /* Most significant word first */
+        gchar **words = g_strsplit (g_strstrip (contents), " ", -1);
+        guint n_words = g_strv_length (words);
+        guint word = code / bits_per_word;
+
+        result = FALSE;
+        if (word < n_words)
+            result = (g_ascii_strtoull (words[n_words - 1 - word], NULL, 16) >> (code % bits_per_word)) & 1;
+
+        g_strfreev (words);
+    }
+
+    g_free (contents);
+    g_free (caps_path);
+    g_free (name);
+
+    return result;
+}
+
+static void
+release_probe (struct libevdev *dev)
+{
+    gint fd = libevdev_get_fd (dev);
+
+    libevdev_free (dev);
+    close (fd);
+}
+
+/* Tells whether the node at path is a mouse we should handle. Only if dev
+ * is given, or sysfs can't tell, is the node opened; then *dev is left
+ * open for the caller to inspect and release. */
+static gboolean
+probe_mouse (const gchar *path, struct libevdev **dev)
+{
+    struct libevdev *probe = NULL;
+    gint has_left;
+    gint fd;
+
+    if (find_device (path) || find_hid_filter (path))
+        return FALSE;
+
+    if (is_own_device (path)) {
+        if (damper_verbose)
+            g_print ("Device at %s is our own virtual device, skipping\n", path);
+        return FALSE;
+    }
+
+    has_left = sysfs_has_key (path, BTN_LEFT);
+
+    if (has_left < 0 || dev != NULL) {
+        fd = open (path, O_RDONLY | O_NONBLOCK);
+        if (fd < 0)
+            return FALSE;
+
+        if (libevdev_new_from_fd (fd, &probe) < 0) {
+            close (fd);
+            return FALSE;
+        }
+
+        has_left = libevdev_has_event_type (probe, EV_KEY) &&
+                   libevdev_has_event_code (probe, EV_KEY, BTN_LEFT);
+    }
+
+    if (damper_verbose)
+        g_print ("Device at %s is %s\n", path, has_left ? "a mouse" : "NOT a mouse");
+
+    if (probe && (dev == NULL || !has_left))
+        release_probe (probe);
+    else if (probe)
+        *dev = probe;
+
+    return has_left;
+}
+
+static void
+track_device (MouseDevice *device)
+{
+    join_freeze_group (device);
+    device->telemetry = telemetry_claim (device->input_devnode, libevdev_get_name (device->input_device));
+    g_ptr_array_add (mouse_devices, device);
+
+    if (event_loop && !event_loop_add_device (event_loop, device)) {
+        telemetry_release (device->telemetry);
+        service_forget_device (device);
+        g_ptr_array_remove (mouse_devices, device);
+        return;
+    }
+
+    watchdog_add_device (device);
+}
+
+/* As opposed to one taken over from a previous run */
+static void
+track_new_device (MouseDevice *device)
+{
+    service_store_device (device);
+    track_device (device);
+}
+
+static void
+add_mouse_device (const gchar *path, gboolean share)
+{
+    MouseDevice *device = mouse_device_new (path, share ? shared_output : NULL);
+
+    if (device)
+        track_new_device (device);
+}
+
+static gint
+compare_event_nodes (gconstpointer a, gconstpointer b)
+{
+    const gchar *name_a = *(const gchar **) a;
+    const gchar *name_b = *(const gchar **) b;
+
+    return atoi (name_a + strlen ("event")) - atoi (name_b + strlen ("event"));
+}
+
+/* Every eventN node, in numeric order; numbering may have gaps */
+static GPtrArray *
+list_event_nodes (void)
+{
+    GPtrArray *paths = g_ptr_array_new_with_free_func (g_free);
+    GPtrArray *names = g_ptr_array_new ();
+    GDir *dir = g_dir_open (INPUT_DIR, 0, NULL);
+    const gchar *name;
+
+    if (dir == NULL) {
+        g_warning ("Could not list %s", INPUT_DIR);
+        g_ptr_array_unref (names);
+        return paths;
+    }
+
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        if (g_str_has_prefix (name, "event"))
+            g_ptr_array_add (names, (gpointer) name);
+    }
+
+    g_ptr_array_sort (names, compare_event_nodes);
+
+    for (guint i = 0; i < names->len; i++)
+        g_ptr_array_add (paths, g_build_filename (INPUT_DIR, g_ptr_array_index (names, i), NULL));
+
+    g_ptr_array_unref (names);
+    g_dir_close (dir);
+
+    return paths;
+}
+
+typedef struct {
+    const gchar *path;
+    gboolean share;
+    MouseDevice *device;
+} PendingDevice;
+
+static gpointer
+create_device_thread (gpointer data)
+{
+    PendingDevice *pending = data;
+
+    pending->device = mouse_device_new (pending->path, pending->share ? shared_output : NULL);
+
+    return NULL;
+}
+
+static void
+discover_mouse_devices (void)
+{
+    GPtrArray *nodes = list_event_nodes ();
+    GArray *pending = g_array_new (FALSE, TRUE, sizeof (PendingDevice));
+    GPtrArray *threads = g_ptr_array_new ();
+    gboolean any_shareable = FALSE;
+
+    if (aggregate_output)
+        shared_capabilities = mouse_device_new_shared_capabilities ();
+
+    for (guint i = 0; i < nodes->len; i++) {
+        PendingDevice device = { g_ptr_array_index (nodes, i), FALSE, NULL };
+        struct libevdev *dev = NULL;
+
+        if (!probe_mouse (device.path, aggregate_output ? &dev : NULL))
+            continue;
+
+        if (hid_filter_enabled && try_hid_filter (device.path)) {
+            if (dev)
+                release_probe (dev);
+            continue;
+        }
+
+        if (dev) {
+            device.share = mouse_device_can_share_output (dev);
+            if (device.share) {
+                mouse_device_merge_capabilities (shared_capabilities, dev);
+                any_shareable = TRUE;
+            }
+            release_probe (dev);
+        }
+
+        g_array_append_val (pending, device);
+    }
+
+    /* The output's capabilities are fixed once created, so every device
+     * has to be probed before any is grabbed */
+    if (any_shareable)
+        shared_output = mouse_device_create_shared_output (shared_capabilities);
+
+    /* Each uinput clone waits on the kernel and udev to appear, so create
+     * them all at once */
+    for (guint i = 0; i < pending->len; i++) {
+        PendingDevice *device = &g_array_index (pending, PendingDevice, i);
+        GThread *thread = g_thread_try_new ("mousedamper-init", create_device_thread, device, NULL);
+
+        if (thread)
+            g_ptr_array_add (threads, thread);
+        else
+            create_device_thread (device);
+    }
+
+    for (guint i = 0; i < threads->len; i++)
+        g_thread_join (g_ptr_array_index (threads, i));
+
+    for (guint i = 0; i < pending->len; i++) {
+        PendingDevice *device = &g_array_index (pending, PendingDevice, i);
+
+        if (device->device)
+            track_new_device (device->device);
+    }
+
+    g_ptr_array_unref (threads);
+    g_array_unref (pending);
+    g_ptr_array_unref (nodes);
+}
+
+static void
+hotplug_add (const gchar *path)
+{
+    struct libevdev *dev = NULL;
+    gboolean share;
+
+    if (!probe_mouse (path, aggregate_output ? &dev : NULL))
+        return;
+
+    if (hid_filter_enabled && try_hid_filter (path)) {
+        if (dev)
+            release_probe (dev);
+        return;
+    }
+
+    share = dev && mouse_device_can_share_output (dev);
+
+    if (share && shared_output == NULL) {
+        if (shared_capabilities == NULL)
+            shared_capabilities = mouse_device_new_shared_capabilities ();
+        mouse_device_merge_capabilities (shared_capabilities, dev);
+        shared_output = mouse_device_create_shared_output (shared_capabilities);
+    } else if (share && !mouse_device_capabilities_cover (shared_capabilities, dev)) {
+        g_print ("%s has buttons or axes the aggregated device lacks, giving it its own\n",
+                 libevdev_get_name (dev));
+        share = FALSE;
+    }
+
+    if (dev)
+        release_probe (dev);
+    add_mouse_device (path, share);
+}
+
+static void
+remove_mouse_device (MouseDevice *device)
+{
+    g_print ("Device %s at %s removed\n", libevdev_get_name (device->input_device), device->input_devnode);
+
+    watchdog_remove_device (device);
+    event_loop_remove_device (event_loop, device);
+    telemetry_release (device->telemetry);
+    service_forget_device (device);
+    g_ptr_array_remove (mouse_devices, device);
+}
+
+static void
+remove_hid_filter (HidFilter *filter)
+{
+    g_print ("Device at %s removed\n", hid_filter_get_devnode (filter));
+
+    hid_filter_print_stats (filter);
+    g_ptr_array_remove (hid_filters, filter);
+}
+
+/* After an inotify queue overflow nothing can be assumed, so drop the
+ * devices whose node is gone and pick up any new ones */
+static void
+rescan_devices (void)
+{
+    GPtrArray *nodes;
+
+    for (guint i = mouse_devices->len; i > 0; i--) {
+        MouseDevice *device = g_ptr_array_index (mouse_devices, i - 1);
+
+        if (access (device->input_devnode, F_OK) < 0)
+            remove_mouse_device (device);
+    }
+
+    for (guint i = hid_filters->len; i > 0; i--) {
+        HidFilter *filter = g_ptr_array_index (hid_filters, i - 1);
+
+        if (access (hid_filter_get_devnode (filter), F_OK) < 0)
+            remove_hid_filter (filter);
+    }
+
+    nodes = list_event_nodes ();
+    for (guint i = 0; i < nodes->len; i++)
+        hotplug_add (g_ptr_array_index (nodes, i));
+    g_ptr_array_unref (nodes);
+}
+
+/* Runs on the event loop's thread, see EventLoopWatch */
+static void
+hotplug_callback (void *data)
+{
+    gchar buffer[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+    gboolean rescan = FALSE;
+    gssize len;
+
+    while ((len = read (hotplug_fd, buffer, sizeof (buffer))) > 0) {
+        const struct inotify_event *event;
+
+        for (gchar *ptr = buffer; ptr < buffer + len; ptr += sizeof (struct inotify_event) + event->len) {
+            gchar *path;
+
+            event = (const struct inotify_event *) ptr;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                rescan = TRUE;
+                continue;
+            }
+
+            if (event->len == 0 || !g_str_has_prefix (event->name, "event"))
+                continue;
+
+            path = g_build_filename (INPUT_DIR, event->name, NULL);
+
+            if (event->mask & IN_DELETE) {
+                MouseDevice *device = find_device (path);
+                HidFilter *filter = find_hid_filter (path);
+
+                if (device)
+                    remove_mouse_device (device);
+                if (filter)
+                    remove_hid_filter (filter);
+            } else {
+                /* IN_ATTRIB too: a node udev had not finished with may
+                 * have failed to open on IN_CREATE */
+                hotplug_add (path);
+            }
+
+            g_free (path);
+        }
+    }
+
+    if (rescan)
+        rescan_devices ();
+}
+
+static void
+watch_hotplug (void)
+{
+    hotplug_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    if (hotplug_fd < 0 || inotify_add_watch (hotplug_fd, INPUT_DIR, IN_CREATE | IN_DELETE | IN_ATTRIB) < 0 ||
+        !event_loop_add_watch (event_loop, hotplug_fd, hotplug_callback, NULL)) {
+        g_warning ("Could not watch %s, devices plugged in later will not be handled", INPUT_DIR);
+        if (hotplug_fd >= 0)
+            close (hotplug_fd);
+        hotplug_fd = -1;
+    }
+}
+
+/* A line holds the daemon's own positional parameters:
+ * <double-click-time-ms> <freeze-threshold-px> <threshold-scale> */
+static gboolean
+apply_config_line (const gchar *line)
+{
+    gint64 double_click_ms;
+    gint threshold;
+    gdouble scale;
+    gchar extra;
+
+    if (sscanf (line, "%" G_GINT64_FORMAT " %d %lf %c", &double_click_ms, &threshold, &scale, &extra) != 3 ||
+        double_click_ms < 0 || threshold < 0 || scale <= 0) {
+        g_warning ("Ignoring invalid configuration '%s'", line);
+        return FALSE;
+    }
+
+    damper_update_params (double_click_ms * G_TIME_SPAN_MILLISECOND, threshold, scale);
+
+    for (guint i = 0; i < hid_filters->len; i++)
+        hid_filter_update_config (g_ptr_array_index (hid_filters, i));
+
+    g_print ("Configuration updated (double-click: %" G_GINT64_FORMAT "ms, threshold: %dpx, scale: %.2f)\n",
+             double_click_ms, threshold, scale);
+    return TRUE;
+}
+
+/* Runs on the event loop's thread, between device dispatches. Each
+ * device takes the new parameters up at its next frame. */
+static void
+config_callback (void *data)
+{
+    gssize len;
+
+    while ((len = read (config_fd, config_line + config_line_len,
+                        sizeof (config_line) - 1 - config_line_len)) > 0) {
+        gchar *start = config_line;
+        gchar *newline;
+
+        config_line_len += len;
+        config_line[config_line_len] = '\0';
+
+        while ((newline = strchr (start, '\n')) != NULL) {
+            *newline = '\0';
+            apply_config_line (start);
+            start = newline + 1;
+        }
+
+        config_line_len -= start - config_line;
+        memmove (config_line, start, config_line_len);
+
+        if (config_line_len == sizeof (config_line) - 1) {
+            g_warning ("Configuration line too long, ignoring it");
+            config_line_len = 0;
+        }
+    }
+
+    if (len == 0 || (errno != EAGAIN && errno != EINTR)) {
+        /* Whoever was sending updates is gone, keep the current ones */
+        event_loop_remove_watch (event_loop, config_fd);
+        config_fd = -1;
+    }
+}
+
+/* Read-write, so there is no EOF between one writer and the next. The
+ * FIFO is changed through the fd only, never through a symlink. */
+static gint
+open_config_fifo (void)
+{
+    gid_t group = service_group_id ();
+    struct stat st;
+    gint fd;
+
+    if (mkfifo (config_fifo, 0600) < 0 && errno != EEXIST)
+        return -1;
+
+    fd = open (config_fifo, O_RDWR | O_NONBLOCK | O_CLOEXEC | O_NOFOLLOW | O_NOCTTY);
+    if (fd < 0)
+        return -1;
+
+    if (fstat (fd, &st) < 0 || !S_ISFIFO (st.st_mode)) {
+        close (fd);
+        errno = EEXIST;
+        return -1;
+    }
+
+    /* Writable by the launchers of desktop users in SERVICE_GROUP */
+    if ((group != (gid_t) -1 && fchown (fd, -1, group) < 0) ||
+        fchmod (fd, group != (gid_t) -1 ? 0620 : 0600) < 0) {
+        close (fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void
+watch_config (void)
+{
+    gint flags;
+
+    if (config_fifo) {
+        config_fd = open_config_fifo ();
+        if (config_fd < 0) {
+            g_warning ("Could not create %s: %s", config_fifo, strerror (errno));
+            return;
+        }
+    } else {
+        config_fd = STDIN_FILENO;
+    }
+
+    flags = config_fd >= 0 ? fcntl (config_fd, F_GETFL) : -1;
+
+    if (flags < 0 || fcntl (config_fd, F_SETFL, flags | O_NONBLOCK) < 0 ||
+        !event_loop_add_watch (event_loop, config_fd, config_callback, NULL)) {
+        g_warning ("Could not watch %s, configuration changes will need a restart",
+                   config_fifo ? config_fifo : "stdin");
+        if (config_fd > STDIN_FILENO)
+            close (config_fd);
+        config_fd = -1;
+    }
+}
+
+/* The handover happens between dispatches on the loop's thread, which
+ * leaves nothing in flight only if no other thread handles devices. The
+ * aggregated output and HID-BPF programs can't be handed over. */
+static gboolean
+upgrade_supported (void)
+{
+    if (event_loop_backend != &event_loop_backend_epoll &&
+        event_loop_backend != &event_loop_backend_glib &&
+        event_loop_backend != &event_loop_backend_busy_poll) {
+        g_warning ("Live upgrade is not supported with the %s event loop, restart the daemon instead",
+                   event_loop_backend->name);
+        return FALSE;
+    }
+
+    if (shared_output != NULL || hid_filters->len > 0) {
+        g_warning ("Live upgrade is not supported with --aggregate or --hid-bpf, restart the daemon instead");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Control requests, see control.h. Device arguments are event node
+ * names, with or without the /dev/input/ prefix. */
+static MouseDevice *
+control_find_device (const gchar *node)
+{
+    gchar *path;
+    MouseDevice *device;
+
+    if (node == NULL)
+        return NULL;
+
+    path = g_path_is_absolute (node) ? g_strdup (node) : g_build_filename (INPUT_DIR, node, NULL);
+    device = find_device (path);
+    g_free (path);
+
+    return device;
+}
+
+static const gchar *
+control_devices (gchar **args, GString *reply)
+{
+    /* The name goes last as it may contain spaces */
+    for (guint i = 0; i < mouse_devices->len; i++) {
+        MouseDevice *device = g_ptr_array_index (mouse_devices, i);
+
+        g_string_append_printf (reply, "%s %s %s %s\n",
+                                device->input_devnode,
+                                mouse_device_get_enabled (device) ? "enabled" : "disabled",
+                                device->output_devnode,
+                                libevdev_get_name (device->input_device));
+    }
+
+    for (guint i = 0; i < hid_filters->len; i++)
+        g_string_append_printf (reply, "%s kernel - -\n", hid_filter_get_devnode (g_ptr_array_index (hid_filters, i)));
+
+    return NULL;
+}
+
+/* Read while the device's own thread may be updating them, so a
+ * snapshot that can be a frame behind */
+static const gchar *
+control_state (gchar **args, GString *reply)
+{
+    MouseDevice *device = control_find_device (args[1]);
+    const DamperCounters *counters;
+
+    if (device == NULL)
+        return "no such device";
+
+    counters = &device->state.counters;
+    g_string_append_printf (reply,
+                            "enabled=%d frozen=%d events=%" G_GUINT64_FORMAT " bypassed=%" G_GUINT64_FORMAT
+                            " suppressed=%" G_GUINT64_FORMAT " drops=%" G_GUINT64_FORMAT,
+                            mouse_device_get_enabled (device),
+                            device->state.motion_frozen,
+                            (guint64) atomic_load_explicit (&device->events_read, memory_order_relaxed),
+                            device->bypassed_frames,
+                            device->suppressed_frames,
+                            device->drops);
+
+    g_string_append_printf (reply, " freezes=%" G_GUINT64_FORMAT " frozen-ms=%" G_GUINT64_FORMAT,
+                            counters->freezes, counters->frozen_usec / 1000);
+    for (int reason = 0; reason < DAMPER_END_COUNT; reason++)
+        g_string_append_printf (reply, " end-%s=%" G_GUINT64_FORMAT,
+                                damper_end_reason_name (reason), counters->ends[reason]);
+    g_string_append_printf (reply, " dropped=%" G_GUINT64_FORMAT " dropped-px=%" G_GUINT64_FORMAT "\n",
+                            counters->dropped_events, counters->dropped_px);
+    return NULL;
+}
+
+static void
+append_latency (MouseDevice *device, GString *reply)
+{
+    for (int kind = 0; kind < MOUSE_DEVICE_FRAME_KINDS; kind++) {
+        const LatencyStats *stats = &device->latency[kind];
+
+        g_string_append_printf (reply, "%s %s frames=%" G_GUINT64_FORMAT " p50=%" G_GINT64_FORMAT
+                                " p99=%" G_GINT64_FORMAT " max=%" G_GINT64_FORMAT "\n",
+                                device->input_devnode, mouse_device_frame_kind_name (kind),
+                                (guint64) stats->count,
+                                (gint64) latency_stats_percentile (stats, 50.0),
+                                (gint64) latency_stats_percentile (stats, 99.0),
+                                (gint64) stats->max_usec);
+    }
+}
+
+/* Microseconds from kernel timestamp to uinput write, for one device or all */
+static const gchar *
+control_latency (gchar **args, GString *reply)
+{
+    MouseDevice *device;
+
+    if (args[1] == NULL) {
+        for (guint i = 0; i < mouse_devices->len; i++)
+            append_latency (g_ptr_array_index (mouse_devices, i), reply);
+        return NULL;
+    }
+
+    device = control_find_device (args[1]);
+    if (device == NULL)
+        return "no such device";
+
+    append_latency (device, reply);
+    return NULL;
+}
+
+static const gchar *
+control_get (gchar **args, GString *reply)
+{
+    g_string_append_printf (reply, "%" G_GINT64_FORMAT " %d %.2f\n",
+                            damper_double_click_wait_time / G_TIME_SPAN_MILLISECOND,
+                            damper_button_freeze_delta_threshold,
+                            damper_threshold_scale_factor);
+    return NULL;
+}
+
+static const gchar *
+control_set (gchar **args, GString *reply)
+{
+    gchar *line;
+    gboolean applied;
+
+    if (g_strv_length (args) != 4)
+        return "expected <double-click-time-ms> <freeze-threshold-px> <threshold-scale>";
+
+    line = g_strjoinv (" ", args + 1);
+    applied = apply_config_line (line);
+    g_free (line);
+
+    return applied ? NULL : "invalid parameters";
+}
+
+static const gchar *
+control_enable (gchar **args, GString *reply)
+{
+    MouseDevice *device = control_find_device (args[1]);
+    gboolean enable = g_strcmp0 (args[0], "enable") == 0;
+
+    if (device == NULL)
+        return "no such device";
+
+    mouse_device_set_enabled (device, enable);
+    g_print ("Filtering %s for %s\n", enable ? "enabled" : "disabled", device->input_devnode);
+    return NULL;
+}
+
+static const gchar *
+control_verbose (gchar **args, GString *reply)
+{
+    if (g_strcmp0 (args[1], "on") == 0)
+        damper_verbose = true;
+    else if (g_strcmp0 (args[1], "off") == 0)
+        damper_verbose = false;
+    else
+        return "expected on or off";
+
+    return NULL;
+}
+
+static const struct {
+    const char *name;
+    const gchar *(*handle) (gchar **args, GString *reply);
+} control_commands[] = {
+    { "devices", control_devices },
+    { "state", control_state },
+    { "latency", control_latency },
+    { "get", control_get },
+    { "set", control_set },
+    { "enable", control_enable },
+    { "disable", control_enable },
+    { "verbose", control_verbose },
+};
+
+static const gchar *
+handle_control_request (gchar **args, GString *reply)
+{
+    for (guint i = 0; i < G_N_ELEMENTS (control_commands); i++) {
+        if (g_strcmp0 (control_commands[i].name, args[0]) == 0)
+            return control_commands[i].handle (args, reply);
+    }
+
+    return "unknown command";
+}
+
+static void
+start_watchdog (void)
+{
+    if (!watchdog_start ())
+        return;
+
+    for (guint i = 0; i < mouse_devices->len; i++)
+        watchdog_add_device (g_ptr_array_index (mouse_devices, i));
+}
+
+static void
+upgrade_callback (void *data)
+{
+    struct signalfd_siginfo info;
+    gboolean requested = FALSE;
+
+    while (read (upgrade_fd, &info, sizeof (info)) == sizeof (info))
+        requested = TRUE;
+
+    if (!requested || !upgrade_supported ())
+        return;
+
+    /* Devices are handed over grabbed; the watchdog carries on if the
+     * upgrade fails */
+    watchdog_stop ();
+    telemetry_set_running (FALSE);
+    upgrade_exec (mouse_devices);
+    telemetry_set_running (TRUE);
+    start_watchdog ();
+}
+
+static void
+watch_upgrade_signal (void)
+{
+    sigset_t mask;
+
+    /* The caller can signal us, and the new image would run as root */
+    if (getuid () != geteuid ())
+        return;
+
+    sigemptyset (&mask);
+    sigaddset (&mask, SIGUSR2);
+
+    upgrade_fd = signalfd (-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (upgrade_fd < 0 || !event_loop_add_watch (event_loop, upgrade_fd, upgrade_callback, NULL)) {
+        g_warning ("Could not watch SIGUSR2, live upgrades are unavailable");
+        if (upgrade_fd >= 0)
+            close (upgrade_fd);
+        upgrade_fd = -1;
+    }
+}
+
+static void
+latency_callback (void *data)
+{
+    struct signalfd_siginfo info;
+    gboolean requested = FALSE;
+
+    while (read (latency_fd, &info, sizeof (info)) == sizeof (info))
+        requested = TRUE;
+
+    if (!requested)
+        return;
+
+    for (guint i = 0; i < mouse_devices->len; i++)
+        mouse_device_print_latency (g_ptr_array_index (mouse_devices, i));
+}
+
+static void
+watch_latency_signal (void)
+{
+    sigset_t mask;
+
+    sigemptyset (&mask);
+    sigaddset (&mask, SIGUSR1);
+
+    latency_fd = signalfd (-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (latency_fd < 0 || !event_loop_add_watch (event_loop, latency_fd, latency_callback, NULL)) {
+        g_warning ("Could not watch SIGUSR1, latency will not be printed on request");
+        if (latency_fd >= 0)
+            close (latency_fd);
+        latency_fd = -1;
+    }
+}
+
+static bool
+parse_int (const char *name, const char *value, int min, int max, int *out)
+{
+    char *end;
+    long parsed;
+
+    if (value == NULL || *value == '\0') {
+        g_printerr ("--%s needs a value\n", name);
+        return false;
+    }
+
+    parsed = strtol (value, &end, 10);
+    if (*end != '\0' || parsed < min || parsed > max) {
+        g_printerr ("--%s must be a number between %d and %d\n", name, min, max);
+        return false;
+    }
+
+    *out = (int) parsed;
+    return true;
+}
+
+/* The daemon is installed setuid root so desktop users can grab their
+ * mice with it. Options creating files where the caller says, or raising
+ * the daemon's priority, are only for callers who are root already. */
+static gboolean
+refuse_when_setuid (const char *name)
+{
+    if (getuid () == geteuid ())
+        return FALSE;
+
+    g_printerr ("--%s is only available when running as root\n", name);
+    return TRUE;
+}
+
+static bool
+option_event_loop (const char *value)
+{
+    event_loop_backend = event_loop_backend_lookup (value);
+    if (event_loop_backend == NULL) {
+        g_printerr ("Unknown event loop '%s' (available: epoll, io_uring, glib, workers, pipeline, busy-poll)\n", value ? value : "");
+        return false;
+    }
+
+    return true;
+}
+
+static bool
+option_measure_latency (const char *value)
+{
+    mouse_device_measure_latency = TRUE;
+    return true;
+}
+
+static bool
+option_io_uring_sqpoll (const char *value)
+{
+    event_loop_uring_sqpoll = true;
+    return true;
+}
+
+static bool
+option_input_thread (const char *value)
+{
+    input_thread_config.enabled = true;
+    return true;
+}
 
-#define USEC_IN_SEC 1000000
+static bool
+option_rt_policy (const char *value)
+{
+    if ((g_strcmp0 (value, "fifo") == 0 || g_strcmp0 (value, "deadline") == 0) &&
+        refuse_when_setuid ("rt-policy"))
+        return false;
 
-typedef struct {
-    struct libevdev *input_device;
-    struct libevdev_uinput *output_device;
-    DamperState state;
-    gint fd;
-    GIOChannel *channel;
-    guint watch_id;
-    gchar *output_devnode;
-} MouseDevice;
+    if (g_strcmp0 (value, "fifo") == 0) {
+        input_thread_config.policy = INPUT_THREAD_SCHED_FIFO;
+    } else if (g_strcmp0 (value, "deadline") == 0) {
+        input_thread_config.policy = INPUT_THREAD_SCHED_DEADLINE;
+    } else if (g_strcmp0 (value, "other") == 0) {
+        input_thread_config.policy = INPUT_THREAD_SCHED_OTHER;
+    } else {
+        g_printerr ("Unknown scheduling policy '%s' (available: fifo, deadline, other)\n", value ? value : "");
+        return false;
+    }
 
-static GMainLoop *main_loop = NULL;
-static GPtrArray *mouse_devices = NULL;
+    input_thread_config.enabled = true;
+    return true;
+}
 
-static PlatformButton
-translate_button_code (guint code)
+static bool
+option_rt_priority (const char *value)
 {
-    switch (code) {
-        case BTN_LEFT:
-            return PLATFORM_BUTTON_LEFT;
-        case BTN_RIGHT:
-            return PLATFORM_BUTTON_RIGHT;
-        case BTN_MIDDLE:
-            return PLATFORM_BUTTON_MIDDLE;
-        default:
-            return PLATFORM_BUTTON_LEFT;
-    }
+    input_thread_config.enabled = true;
+    return parse_int ("rt-priority", value, 1, 99, &input_thread_config.priority);
 }
 
-static gboolean
-device_event_callback (GIOChannel *source, GIOCondition condition, gpointer user_data)
-{
-    MouseDevice *device = user_data;
-    struct input_event ev;
-    int rc;
-
-    if (condition & (G_IO_HUP | G_IO_ERR)) {
-        g_warning ("Device disconnected or error occurred");
-        return G_SOURCE_REMOVE;
-    }
-
-    do {
-        rc = libevdev_next_event (device->input_device, LIBEVDEV_READ_FLAG_NORMAL, &ev);
-        if (rc == LIBEVDEV_READ_STATUS_SUCCESS) {
-            PlatformEvent platform_ev;
-            PlatformAction action = PLATFORM_ACTION_PASS;
-            gboolean is_handled = FALSE;
-
-            if (ev.type == EV_KEY &&
-                (ev.code == BTN_LEFT || ev.code == BTN_RIGHT || ev.code == BTN_MIDDLE)) {
-                platform_ev.type = (ev.value == 1) ? PLATFORM_EVENT_BUTTON_PRESS : PLATFORM_EVENT_BUTTON_RELEASE;
-                platform_ev.timestamp_usec = ((gint64)ev.time.tv_sec * USEC_IN_SEC) + ev.time.tv_usec;
-                platform_ev.data.button.button = translate_button_code (ev.code);
-
-                action = damper_handle_event (&device->state, &platform_ev);
-                is_handled = TRUE;
-            } else if (ev.type == EV_REL && (ev.code == REL_X || ev.code == REL_Y)) {
-                platform_ev.type = PLATFORM_EVENT_MOTION;
-                platform_ev.timestamp_usec = ((gint64)ev.time.tv_sec * USEC_IN_SEC) + ev.time.tv_usec;
-                platform_ev.data.motion.dx = (ev.code == REL_X) ? ev.value : 0;
-                platform_ev.data.motion.dy = (ev.code == REL_Y) ? ev.value : 0;
-
-                action = damper_handle_event (&device->state, &platform_ev);
-                is_handled = TRUE;
-            }
+static bool
+option_rt_deadline (const char *value)
+{
+    int runtime, period;
 
-            if (is_handled && action == PLATFORM_ACTION_DROP) {
-                continue;
-            }
+    if (value == NULL || sscanf (value, "%d/%d", &runtime, &period) != 2 ||
+        runtime <= 0 || period < runtime) {
+        g_printerr ("--rt-deadline expects RUNTIME/PERIOD in microseconds, e.g. 200/1000\n");
+        return false;
+    }
 
-            libevdev_uinput_write_event (device->output_device, ev.type, ev.code, ev.value);
-            if (ev.type == EV_SYN)
-                libevdev_uinput_write_event (device->output_device, EV_SYN, SYN_REPORT, 0);
-
-        } else if (rc == LIBEVDEV_READ_STATUS_SYNC) {
-            g_warning ("Events dropped, resyncing");
-            while (rc == LIBEVDEV_READ_STATUS_SYNC) {
-                rc = libevdev_next_event (device->input_device, LIBEVDEV_READ_FLAG_SYNC, &ev);
-                if (rc == LIBEVDEV_READ_STATUS_SYNC || rc == LIBEVDEV_READ_STATUS_SUCCESS) {
-                    libevdev_uinput_write_event (device->output_device, ev.type, ev.code, ev.value);
-                    if (ev.type == EV_SYN)
-                        libevdev_uinput_write_event (device->output_device, EV_SYN, SYN_REPORT, 0);
-                }
-            }
-        }
-    } while (rc == LIBEVDEV_READ_STATUS_SUCCESS);
+    input_thread_config.runtime_usec = runtime;
+    input_thread_config.period_usec = period;
+    input_thread_config.enabled = true;
+    return true;
+}
 
-    return G_SOURCE_CONTINUE;
+static bool
+option_rt_cpu (const char *value)
+{
+    input_thread_config.enabled = true;
+    return parse_int ("rt-cpu", value, 0, INPUT_THREAD_MAX_CPU, &input_thread_config.cpu);
 }
 
-static void
-mouse_device_free (MouseDevice *device)
+static bool
+option_mlock (const char *value)
+{
+    if (refuse_when_setuid ("mlock"))
+        return false;
+
+    input_thread_config.lock_memory = true;
+    input_thread_config.enabled = true;
+    return true;
+}
+
+static bool
+option_cpu_dma_latency (const char *value)
 {
-    if (device->watch_id > 0)
-        g_source_remove (device->watch_id);
+    if (refuse_when_setuid ("cpu-dma-latency"))
+        return false;
 
-    if (device->channel) {
-        g_io_channel_shutdown (device->channel, FALSE, NULL);
-        g_io_channel_unref (device->channel);
+    input_thread_config.enabled = true;
+
+    if (value == NULL) {
+        input_thread_config.dma_latency_usec = 0;
+        return true;
     }
 
-    if (device->output_device)
-        libevdev_uinput_destroy (device->output_device);
+    return parse_int ("cpu-dma-latency", value, 0, G_MAXINT32, &input_thread_config.dma_latency_usec);
+}
 
-    if (device->input_device)
-        libevdev_free (device->input_device);
+static bool
+option_workers (const char *value)
+{
+    event_loop_backend = &event_loop_backend_workers;
+    return parse_int ("workers", value, 1, 64, &event_loop_workers);
+}
 
-    if (device->fd >= 0)
-        close (device->fd);
+static bool
+option_worker_stats (const char *value)
+{
+    return parse_int ("worker-stats", value, 1, 3600, &event_loop_worker_stats_interval);
+}
 
-    g_free (device->output_devnode);
-    g_free (device);
+static bool
+option_pipeline (const char *value)
+{
+    event_loop_backend = &event_loop_backend_pipeline;
+    return true;
 }
 
-static MouseDevice *
-create_mouse_device (const gchar *device_path)
+static bool
+option_pipeline_ring (const char *value)
 {
-    MouseDevice *device;
-    int rc;
+    int size;
 
-    device = g_new0 (MouseDevice, 1);
-    device->fd = -1;
+    if (!parse_int ("pipeline-ring", value, 64, 65536, &size))
+        return false;
 
-    device->fd = open (device_path, O_RDONLY | O_NONBLOCK);
-    if (device->fd < 0) {
-        g_warning ("Failed to open %s: %s", device_path, strerror (errno));
-        mouse_device_free (device);
-        return NULL;
+    if ((size & (size - 1)) != 0) {
+        g_printerr ("Option --pipeline-ring must be a power of two\n");
+        return false;
     }
 
-    rc = libevdev_new_from_fd (device->fd, &device->input_device);
-    if (rc < 0) {
-        g_warning ("Failed to initialize libevdev for %s: %s", device_path, strerror (-rc));
-        mouse_device_free (device);
-        return NULL;
+    event_loop_pipeline_ring_size = size;
+    return true;
+}
+
+static bool
+option_busy_poll (const char *value)
+{
+    event_loop_backend = &event_loop_backend_busy_poll;
+
+    if (value == NULL) {
+        event_loop_busy_poll_spin_usec = -1;
+        return true;
     }
 
-    rc = libevdev_uinput_create_from_device (device->input_device,
-                                             LIBEVDEV_UINPUT_OPEN_MANAGED,
-                                             &device->output_device);
-    if (rc < 0) {
-        g_warning ("Failed to create uinput device for %s: %s", device_path, strerror (-rc));
-        mouse_device_free (device);
-        return NULL;
+    return parse_int ("busy-poll", value, 0, 1000000, &event_loop_busy_poll_spin_usec);
+}
+
+static bool
+option_watchdog (const char *value)
+{
+    if (value == NULL) {
+        watchdog_budget_msec = WATCHDOG_DEFAULT_BUDGET_MSEC;
+        return true;
     }
 
-    device->output_devnode = g_strdup (libevdev_uinput_get_devnode (device->output_device));
+    return parse_int ("watchdog", value, 1, 10000, &watchdog_budget_msec);
+}
 
-    g_print ("Device init for %s: redirected from %s to %s\n",
-             libevdev_get_name (device->input_device),
-             device_path,
-             device->output_devnode);
+static bool
+option_hid_bpf (const char *value)
+{
+    hid_filter_enabled = TRUE;
+    return true;
+}
 
-    damper_state_init (&device->state);
+static bool
+option_arena (const char *value)
+{
+    int kib;
 
-    rc = libevdev_grab (device->input_device, LIBEVDEV_GRAB);
-    if (rc < 0) {
-        g_warning ("Failed to grab device %s: %s", device_path, strerror (-rc));
-        mouse_device_free (device);
-        return NULL;
+    if (!parse_int ("arena", value, 64, 1024 * 1024, &kib))
+        return false;
+
+    arena_size_bytes = (size_t) kib * 1024;
+    return true;
+}
+
+static bool
+option_alloc_check (const char *value)
+{
+    if (!alloc_check_supported ()) {
+        g_warning ("--alloc-check is not supported with this C library, ignoring it");
+        return true;
     }
 
-    device->channel = g_io_channel_unix_new (device->fd);
-    g_io_channel_set_encoding (device->channel, NULL, NULL);
-    g_io_channel_set_buffered (device->channel, FALSE);
+    alloc_check_enabled = true;
+    return true;
+}
 
-    device->watch_id = g_io_add_watch (device->channel,
-                                       G_IO_IN | G_IO_HUP | G_IO_ERR,
-                                       device_event_callback,
-                                       device);
+static bool
+option_config_stdin (const char *value)
+{
+    config_stdin = TRUE;
+    return true;
+}
 
-    return device;
+static bool
+option_config_fifo (const char *value)
+{
+    if (refuse_when_setuid ("config-fifo"))
+        return false;
+
+    if (value == NULL || *value == '\0') {
+        g_printerr ("--config-fifo needs a path\n");
+        return false;
+    }
+
+    g_free (config_fifo);
+    config_fifo = g_strdup (value);
+    return true;
 }
 
-static gboolean
-output_devnode_equal (gconstpointer a, gconstpointer b)
+static bool
+option_control_socket (const char *value)
 {
-    const MouseDevice *device = a;
-    const gchar *path = b;
-    return g_strcmp0 (device->output_devnode, path) == 0;
+    if (refuse_when_setuid ("control-socket"))
+        return false;
+
+    if (value == NULL || *value == '\0') {
+        g_printerr ("--control-socket needs a path\n");
+        return false;
+    }
+
+    g_free (control_socket_path);
+    control_socket_path = g_strdup (value);
+    return true;
 }
 
-static void
-discover_mouse_devices (void)
+static bool
+option_telemetry (const char *value)
 {
-    gint fd_code = 0;
+    if (refuse_when_setuid ("telemetry"))
+        return false;
 
-    while (TRUE) {
-        gchar *device_path = g_strdup_printf ("/dev/input/event%d", fd_code);
-        gint fd = open (device_path, O_RDONLY);
+    if (value != NULL) {
+        g_printerr ("--telemetry always publishes to %s and takes no path\n", TELEMETRY_PATH);
+        return false;
+    }
 
-        if (fd < 0) {
-            g_free (device_path);
-            break;
-        }
+    publish_telemetry = TRUE;
+    return true;
+}
 
-        struct libevdev *dev = NULL;
-        int rc = libevdev_new_from_fd (fd, &dev);
-
-        if (rc >= 0) {
-            guint idx;
-            gboolean already_handled = g_ptr_array_find_with_equal_func (mouse_devices,
-                                                                          device_path,
-                                                                          output_devnode_equal,
-                                                                          &idx);
-
-            if (already_handled) {
-                if (damper_verbose)
-                    g_print ("Device at %s is our own virtual device, skipping\n", device_path);
-            } else if (libevdev_has_event_type (dev, EV_KEY) &&
-                       libevdev_has_event_code (dev, EV_KEY, BTN_LEFT)) {
-                if (damper_verbose)
-                    g_print ("Device at %s is a mouse\n", device_path);
-
-                MouseDevice *mouse_device = create_mouse_device (device_path);
-                if (mouse_device)
-                    g_ptr_array_add (mouse_devices, mouse_device);
-            } else {
-                if (damper_verbose)
-                    g_print ("Device at %s is NOT a mouse\n", device_path);
-            }
-            libevdev_free (dev);
-        }
+static bool
+option_fd_store (const char *value)
+{
+    if (refuse_when_setuid ("fd-store"))
+        return false;
 
-        close (fd);
-        g_free (device_path);
-        fd_code++;
+    service_fd_store = TRUE;
+    return true;
+}
+
+static bool
+option_resume (const char *value)
+{
+    if (refuse_when_setuid ("resume"))
+        return false;
+
+    return parse_int ("resume", value, 0, G_MAXINT, &resume_fd);
+}
+
+static bool
+option_aggregate (const char *value)
+{
+    aggregate_output = TRUE;
+    return true;
+}
+
+static bool
+option_freeze_group (const char *value)
+{
+    FreezeGroup *group;
+    gchar *folded;
+
+    if (value == NULL || *value == '\0') {
+        g_printerr ("Option --freeze-group requires 'all' or a comma-separated list of device names\n");
+        return false;
     }
+
+    if (freeze_groups == NULL)
+        freeze_groups = g_ptr_array_new_with_free_func ((GDestroyNotify) freeze_group_free);
+
+    group = g_new0 (FreezeGroup, 1);
+    folded = g_utf8_casefold (value, -1);
+    group->all = g_strcmp0 (value, "all") == 0;
+    group->patterns = group->all ? g_new0 (gchar *, 1) : g_strsplit (folded, ",", -1);
+    damper_domain_init (&group->domain);
+    g_free (folded);
+
+    for (gchar **pattern = group->patterns; *pattern; pattern++)
+        g_strstrip (*pattern);
+
+    g_ptr_array_add (freeze_groups, group);
+    return true;
 }
 
-static gboolean
-signal_handler (gpointer user_data)
+static const PlatformOption platform_options[] = {
+    { "event-loop", option_event_loop },
+    { "io-uring-sqpoll", option_io_uring_sqpoll },
+    { "measure-latency", option_measure_latency },
+    { "input-thread", option_input_thread },
+    { "rt-policy", option_rt_policy },
+    { "rt-priority", option_rt_priority },
+    { "rt-deadline", option_rt_deadline },
+    { "rt-cpu", option_rt_cpu },
+    { "mlock", option_mlock },
+    { "cpu-dma-latency", option_cpu_dma_latency },
+    { "workers", option_workers },
+    { "worker-stats", option_worker_stats },
+    { "pipeline", option_pipeline },
+    { "pipeline-ring", option_pipeline_ring },
+    { "busy-poll", option_busy_poll },
+    { "watchdog", option_watchdog },
+    { "aggregate", option_aggregate },
+    { "freeze-group", option_freeze_group },
+    { "hid-bpf", option_hid_bpf },
+    { "arena", option_arena },
+    { "alloc-check", option_alloc_check },
+    { "config-stdin", option_config_stdin },
+    { "config-fifo", option_config_fifo },
+    { "fd-store", option_fd_store },
+    { "control-socket", option_control_socket },
+    { "telemetry", option_telemetry },
+    { "resume", option_resume },
+};
+
+static bool
+platform_linux_set_option (const char *name, const char *value)
 {
-    g_print ("Received signal, shutting down...\n");
-    g_main_loop_quit (main_loop);
-    return G_SOURCE_REMOVE;
+    for (guint i = 0; i < G_N_ELEMENTS (platform_options); i++) {
+        if (g_strcmp0 (platform_options[i].name, name) == 0)
+            return platform_options[i].apply (value);
+    }
+
+    return false;
+}
+
+/* The worker pool and the pipeline run their own threads and apply the
+ * input thread settings to each of them instead */
+static bool
+use_input_thread (void)
+{
+    return input_thread_config.enabled &&
+           event_loop_backend != &event_loop_backend_workers &&
+           event_loop_backend != &event_loop_backend_pipeline;
 }
 
 static bool
 platform_linux_init (int64_t double_click_time_usec, int threshold_px, bool verbose)
 {
+    sigset_t signal_mask;
+
     damper_double_click_wait_time = double_click_time_usec;
     damper_button_freeze_delta_threshold = threshold_px;
     damper_verbose = verbose;
 
+    if (!arena_init ())
+        return false;
+
+    /* Blocked before any thread starts, so only the signalfds see them */
+    sigemptyset (&signal_mask);
+    sigaddset (&signal_mask, SIGUSR1);
+    sigaddset (&signal_mask, SIGUSR2);
+    pthread_sigmask (SIG_BLOCK, &signal_mask, NULL);
+
     mouse_devices = g_ptr_array_new_with_free_func ((GDestroyNotify) mouse_device_free);
+    hid_filters = g_ptr_array_new_with_free_func ((GDestroyNotify) hid_filter_free);
+
+    /* Verbose messages are printed off the input path from here on */
+    log_thread_start ();
+
+    /* Before any device is tracked, so each gets a slot */
+    if (publish_telemetry)
+        telemetry_start ();
+
+    /* Devices handed over by the previous image first; discovery then
+     * picks up anything plugged in during the upgrade */
+    if (resume_fd >= 0) {
+        upgrade_resume (resume_fd, track_device);
+        resume_fd = -1;
+    }
+
+    if (service_fd_store)
+        service_restore_devices (track_device);
 
     discover_mouse_devices ();
 
-    if (mouse_devices->len == 0) {
-        g_printerr ("No mouse devices found\n");
-        g_ptr_array_unref (mouse_devices);
+    if (event_loop_backend == NULL)
+        event_loop_backend = event_loop_backend_lookup (EVENT_LOOP_DEFAULT_BACKEND);
+
+    /* With an input thread, signals stay with the main thread */
+    event_loop = event_loop_new (event_loop_backend, !use_input_thread ());
+    if (event_loop == NULL && event_loop_backend != &event_loop_backend_epoll) {
+        g_warning ("Could not start the %s event loop, falling back to epoll", event_loop_backend->name);
+        event_loop_backend = &event_loop_backend_epoll;
+        event_loop = event_loop_new (event_loop_backend, !use_input_thread ());
+    }
+
+    if (event_loop == NULL) {
+        g_printerr ("Failed to create %s event loop\n", event_loop_backend->name);
+        free_devices ();
+        telemetry_stop ();
+        log_thread_stop ();
+        arena_free ();
         return false;
     }
 
-    g_print ("Starting filters for %u device(s)\n", mouse_devices->len);
+    for (guint i = 0; i < mouse_devices->len; i++)
+        event_loop_add_device (event_loop, g_ptr_array_index (mouse_devices, i));
+
+    watch_hotplug ();
+    watch_upgrade_signal ();
+    watch_latency_signal ();
+
+    if (config_stdin || config_fifo)
+        watch_config ();
+
+    if (control_socket_path)
+        control_start (event_loop, handle_control_request);
+
+    if (mouse_devices->len == 0 && hid_filters->len == 0) {
+        if (hotplug_fd < 0) {
+            g_printerr ("No mouse devices found\n");
+            event_loop_free (event_loop);
+            event_loop = NULL;
+            free_devices ();
+            telemetry_stop ();
+            log_thread_stop ();
+            arena_free ();
+            return false;
+        }
+
+        g_print ("No mouse devices found, waiting for one to be plugged in\n");
+    }
+
+    g_print ("Starting filters for %u device(s) using the %s event loop\n",
+             mouse_devices->len, event_loop_backend->name);
+
+    if (hid_filters->len > 0)
+        g_print ("%u device(s) filtered in the kernel\n", hid_filters->len);
+
+    start_watchdog ();
+    service_notify_ready (mouse_devices->len);
 
     return true;
 }
 
+static gboolean
+signal_handler (gpointer user_data)
+{
+    g_print ("Received signal, shutting down...\n");
+    g_main_loop_quit (main_loop);
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+quit_main_loop (gpointer user_data)
+{
+    g_main_loop_quit (main_loop);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+input_thread_stopped (void)
+{
+    g_idle_add (quit_main_loop, NULL);
+}
+
 static void
 platform_linux_run (void)
 {
+    guint sigint_id, sigterm_id;
+
+    /* Everything per device exists by now, see alloc_check.h */
+    alloc_check_armed = alloc_check_enabled;
+
+    if (!use_input_thread ()) {
+        event_loop_run (event_loop);
+        return;
+    }
+
     main_loop = g_main_loop_new (NULL, FALSE);
+    sigint_id = g_unix_signal_add (SIGINT, signal_handler, NULL);
+    sigterm_id = g_unix_signal_add (SIGTERM, signal_handler, NULL);
 
-    g_unix_signal_add (SIGINT, signal_handler, NULL);
-    g_unix_signal_add (SIGTERM, signal_handler, NULL);
+    if (input_thread_start (event_loop, input_thread_stopped))
+        g_main_loop_run (main_loop);
 
-    g_main_loop_run (main_loop);
+    input_thread_stop ();
 
+    g_source_remove (sigint_id);
+    g_source_remove (sigterm_id);
     g_main_loop_unref (main_loop);
 }
 
+static gchar *
+latency_results_path (const EventLoopBackend *backend)
+{
+    gchar *name = g_strdup_printf ("latency-%s", backend->name);
+    gchar *dir = g_build_filename (g_get_user_cache_dir (), "mousedamper", NULL);
+    gchar *path = NULL;
+
+    if (g_mkdir_with_parents (dir, 0755) == 0)
+        path = g_build_filename (dir, name, NULL);
+
+    g_free (dir);
+    g_free (name);
+    return path;
+}
+
+/* Keeps the combined results of each event loop's last measured run, and
+ * compares against the default loop's so the gain of another loop can be
+ * read off directly */
+static void
+save_and_compare_latency (const LatencyStats *total)
+{
+    const EventLoopBackend *baseline_backend = event_loop_backend_lookup (EVENT_LOOP_DEFAULT_BACKEND);
+    gchar *path;
+
+    path = latency_results_path (event_loop_backend);
+    if (path == NULL || !latency_stats_save (total, path))
+        g_warning ("Could not save latency results for the %s event loop", event_loop_backend->name);
+    g_free (path);
+
+    if (event_loop_backend != baseline_backend) {
+        LatencyStats *baseline = g_new0 (LatencyStats, 1);
+
+        path = latency_results_path (baseline_backend);
+        if (path && latency_stats_load (baseline, path))
+            latency_stats_print_comparison (total, event_loop_backend->name, baseline, baseline_backend->name);
+        else
+            g_print ("No %s results to compare with, run once with only --measure-latency\n",
+                     baseline_backend->name);
+
+        g_free (path);
+        g_free (baseline);
+    }
+}
+
+static void
+report_latency (void)
+{
+    LatencyStats *total = g_new0 (LatencyStats, 1);
+    uid_t euid = geteuid ();
+
+    for (guint i = 0; i < mouse_devices->len; i++) {
+        MouseDevice *device = g_ptr_array_index (mouse_devices, i);
+
+        for (int kind = 0; kind < MOUSE_DEVICE_FRAME_KINDS; kind++) {
+            gchar *label = g_strdup_printf ("%s (%s) [%s]",
+                                            libevdev_get_name (device->input_device),
+                                            mouse_device_frame_kind_name (kind),
+                                            event_loop_backend->name);
+
+            latency_stats_print (&device->latency[kind], label);
+            latency_stats_merge (total, &device->latency[kind]);
+            g_free (label);
+        }
+    }
+
+    if (total->count == 0) {
+        g_free (total);
+        return;
+    }
+
+    /* The cache belongs to whoever started the daemon, setuid or not,
+     * and is only ever touched with their privileges */
+    if (seteuid (getuid ()) < 0) {
+        g_warning ("Could not drop privileges, not saving latency results: %s", strerror (errno));
+    } else {
+        save_and_compare_latency (total);
+
+        if (seteuid (euid) < 0)
+            g_warning ("Could not regain privileges: %s", strerror (errno));
+    }
+
+    g_free (total);
+}
+
 static void
 platform_linux_cleanup (void)
 {
-    g_ptr_array_unref (mouse_devices);
+    alloc_check_armed = false;
+
+    service_notify_stopping ();
+    watchdog_stop ();
+
+    for (guint i = 0; i < mouse_devices->len; i++)
+        mouse_device_print_stats (g_ptr_array_index (mouse_devices, i));
+
+    for (guint i = 0; i < hid_filters->len; i++)
+        hid_filter_print_stats (g_ptr_array_index (hid_filters, i));
+
+    if (mouse_device_measure_latency)
+        report_latency ();
+
+    if (config_fd >= 0) {
+        event_loop_remove_watch (event_loop, config_fd);
+        if (config_fd != STDIN_FILENO)
+            close (config_fd);
+        config_fd = -1;
+    }
+    g_clear_pointer (&config_fifo, g_free);
+
+    control_stop ();
+    g_clear_pointer (&control_socket_path, g_free);
+
+    if (upgrade_fd >= 0) {
+        event_loop_remove_watch (event_loop, upgrade_fd);
+        close (upgrade_fd);
+        upgrade_fd = -1;
+    }
+
+    if (latency_fd >= 0) {
+        event_loop_remove_watch (event_loop, latency_fd);
+        close (latency_fd);
+        latency_fd = -1;
+    }
+
+    if (hotplug_fd >= 0) {
+        event_loop_remove_watch (event_loop, hotplug_fd);
+        close (hotplug_fd);
+        hotplug_fd = -1;
+    }
+
+    event_loop_free (event_loop);
+
+    /* Only once no thread dispatches devices */
+    telemetry_stop ();
+    log_thread_stop ();
+
+    /* The fd store keeps the clones, and the grabs, for the next start */
+    if (service_fd_store) {
+        for (guint i = 0; i < mouse_devices->len; i++)
+            mouse_device_disown_output (g_ptr_array_index (mouse_devices, i));
+    }
+
+    free_devices ();
+    g_clear_pointer (&freeze_groups, g_ptr_array_unref);
+
+    arena_print_stats ();
+    arena_free ();
 }
 
 const PlatformInterface *
 platform_get_interface (void)
 {
     static const PlatformInterface linux_platform = {
+        .set_option = platform_linux_set_option,
         .init = platform_linux_init,
         .run = platform_linux_run,
         .cleanup = platform_linux_cleanup
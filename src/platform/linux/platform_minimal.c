@@ -0,0 +1,280 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+/* Platform for the GLib-free daemon build (-Dminimal_daemon=true): the
+ * devices present at startup, each with its own clone, driven by the
+ * epoll loop. Hotplug, aggregation, freeze groups, HID-BPF and the
+ * threaded loops need the full build. */
+
+#include "../../common/platform.h"
+#include "../../common/damper_core.h"
+#include "mouse_device.h"
+#include "event_loop.h"
+#include "arena.h"
+#include "alloc_check.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define INPUT_DIR "/dev/input"
+#define MAX_DEVICES 32
+
+typedef struct {
+    const char *name;
+    bool (*apply) (const char *value);
+} PlatformOption;
+
+static MouseDevice *mouse_devices[MAX_DEVICES];
+static int n_mouse_devices = 0;
+static EventLoop *event_loop = NULL;
+
+static bool
+is_mouse (const char *path)
+{
+    struct libevdev *dev = NULL;
+    bool result;
+    int fd;
+
+    fd = open (path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0)
+        return false;
+
+    if (libevdev_new_from_fd (fd, &dev) < 0) {
+        close (fd);
+        return false;
+    }
+
+    result = libevdev_has_event_type (dev, EV_KEY) &&
+             libevdev_has_event_code (dev, EV_KEY, BTN_LEFT);
+
+    if (damper_verbose)
+        printf ("Device at %s is %s\n", path, result ? "a mouse" : "NOT a mouse");
+
+    libevdev_free (dev);
+    close (fd);
+
+    return result;
+}
+
+static int
+filter_event_nodes (const struct dirent *entry)
+{
+    return strncmp (entry->d_name, "event", 5) == 0;
+}
+
+/* eventN in numeric order, so event10 comes after event9 */
+static int
+compare_event_nodes (const struct dirent **a, const struct dirent **b)
+{
+    long num_a = strtol ((*a)->d_name + 5, NULL, 10);
+    long num_b = strtol ((*b)->d_name + 5, NULL, 10);
+
+    return (num_a > num_b) - (num_a < num_b);
+}
+
+/* Lists the nodes before creating any clone, so our own virtual devices
+ * never show up in the scan */
+static void
+discover_mouse_devices (void)
+{
+    struct dirent **entries;
+    int n_entries;
+
+    n_entries = scandir (INPUT_DIR, &entries, filter_event_nodes, compare_event_nodes);
+    if (n_entries < 0) {
+        perror ("Failed to scan " INPUT_DIR);
+        return;
+    }
+
+    for (int i = 0; i < n_entries; i++) {
+        char path[MOUSE_DEVICE_DEVNODE_MAX];
+
+        snprintf (path, sizeof (path), INPUT_DIR "/%s", entries[i]->d_name);
+        free (entries[i]);
+
+        if (n_mouse_devices == MAX_DEVICES) {
+            if (damper_verbose)
+                printf ("Skipping %s, already handling %d devices\n", path, MAX_DEVICES);
+            continue;
+        }
+
+        if (is_mouse (path)) {
+            MouseDevice *device = mouse_device_new (path, NULL);
+
+            if (device)
+                mouse_devices[n_mouse_devices++] = device;
+        }
+    }
+
+    free (entries);
+}
+
+static void
+free_devices (void)
+{
+    for (int i = 0; i < n_mouse_devices; i++)
+        mouse_device_free (mouse_devices[i]);
+
+    n_mouse_devices = 0;
+}
+
+static bool
+option_event_loop (const char *value)
+{
+    if (value == NULL || strcmp (value, "epoll") != 0) {
+        fprintf (stderr, "Only the epoll event loop is available in this build\n");
+        return false;
+    }
+
+    return true;
+}
+
+static bool
+option_measure_latency (const char *value)
+{
+    mouse_device_measure_latency = TRUE;
+    return true;
+}
+
+static bool
+option_arena (const char *value)
+{
+    char *end;
+    long kib;
+
+    if (value == NULL || *value == '\0') {
+        fprintf (stderr, "--arena needs a value\n");
+        return false;
+    }
+
+    kib = strtol (value, &end, 10);
+    if (*end != '\0' || kib < 64 || kib > 1024 * 1024) {
+        fprintf (stderr, "--arena must be a number between %d and %d\n", 64, 1024 * 1024);
+        return false;
+    }
+
+    arena_size_bytes = (size_t) kib * 1024;
+    return true;
+}
+
+static bool
+option_alloc_check (const char *value)
+{
+    if (!alloc_check_supported ()) {
+        fprintf (stderr, "--alloc-check is not supported with this C library, ignoring it\n");
+        return true;
+    }
+
+    alloc_check_enabled = true;
+    return true;
+}
+
+static const PlatformOption platform_options[] = {
+    { "event-loop", option_event_loop },
+    { "measure-latency", option_measure_latency },
+    { "arena", option_arena },
+    { "alloc-check", option_alloc_check },
+};
+
+static bool
+platform_minimal_set_option (const char *name, const char *value)
+{
+    for (size_t i = 0; i < sizeof (platform_options) / sizeof (platform_options[0]); i++) {
+        if (strcmp (platform_options[i].name, name) == 0)
+            return platform_options[i].apply (value);
+    }
+
+    return false;
+}
+
+static bool
+platform_minimal_init (int64_t double_click_time_usec, int threshold_px, bool verbose)
+{
+    damper_double_click_wait_time = double_click_time_usec;
+    damper_button_freeze_delta_threshold = threshold_px;
+    damper_verbose = verbose;
+
+    if (!arena_init ())
+        return false;
+
+    discover_mouse_devices ();
+
+    if (n_mouse_devices == 0) {
+        fprintf (stderr, "No mouse devices found\n");
+        arena_free ();
+        return false;
+    }
+
+    event_loop = event_loop_new (&event_loop_backend_epoll, true);
+    if (event_loop == NULL) {
+        fprintf (stderr, "Failed to create epoll event loop\n");
+        free_devices ();
+        arena_free ();
+        return false;
+    }
+
+    for (int i = 0; i < n_mouse_devices; i++)
+        event_loop_add_device (event_loop, mouse_devices[i]);
+
+    printf ("Starting filters for %d device(s) using the epoll event loop\n", n_mouse_devices);
+
+    return true;
+}
+
+static void
+platform_minimal_run (void)
+{
+    /* Everything per device exists by now, see alloc_check.h */
+    alloc_check_armed = alloc_check_enabled;
+
+    event_loop_run (event_loop);
+}
+
+static void
+platform_minimal_cleanup (void)
+{
+    alloc_check_armed = false;
+
+    for (int i = 0; i < n_mouse_devices; i++) {
+        MouseDevice *device = mouse_devices[i];
+
+        mouse_device_print_stats (device);
+
+        if (mouse_device_measure_latency)
+            mouse_device_print_latency (device);
+    }
+
+    event_loop_free (event_loop);
+    free_devices ();
+
+    arena_print_stats ();
+    arena_free ();
+}
+
+const PlatformInterface *
+platform_get_interface (void)
+{
+    static const PlatformInterface minimal_platform = {
+        .set_option = platform_minimal_set_option,
+        .init = platform_minimal_init,
+        .run = platform_minimal_run,
+        .cleanup = platform_minimal_cleanup
+    };
+    return &minimal_platform;
+}
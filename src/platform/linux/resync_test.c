@@ -0,0 +1,254 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+/* Checks that a button released while the daemon's input node overflows
+ * comes out released anyway. The daemon is stopped with SIGSTOP while a
+ * mouse it filters releases its button and floods motion, so the kernel
+ * drops events and sends SYN_DROPPED. Needs root for uinput; skipped
+ * without it. Any real mice are grabbed by the daemon while it runs.
+ *
+ * Usage: mousedamper-resync-test DAEMON [OPTION...]
+ */
+
+#include <glib.h>
+#include <libevdev/libevdev.h>
+#include <libevdev/libevdev-uinput.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#define TEST_MOUSE_NAME "Mousedamper resync test mouse"
+#define EXIT_SKIP 77
+#define STEP_TIMEOUT_USEC (10 * G_USEC_PER_SEC)
+#define POLL_INTERVAL_USEC 1000
+/* Far more than any evdev client buffer holds */
+#define FLOOD_FRAMES 4096
+
+static struct libevdev_uinput *
+create_mouse (void)
+{
+    struct libevdev *dev = libevdev_new ();
+    struct libevdev_uinput *uidev = NULL;
+    int rc;
+
+    libevdev_set_name (dev, TEST_MOUSE_NAME);
+    libevdev_enable_event_code (dev, EV_KEY, BTN_LEFT, NULL);
+    libevdev_enable_event_code (dev, EV_KEY, BTN_RIGHT, NULL);
+    libevdev_enable_event_code (dev, EV_REL, REL_X, NULL);
+    libevdev_enable_event_code (dev, EV_REL, REL_Y, NULL);
+
+    rc = libevdev_uinput_create_from_device (dev, LIBEVDEV_UINPUT_OPEN_MANAGED, &uidev);
+    if (rc < 0)
+        g_printerr ("Failed to create uinput device: %s\n", strerror (-rc));
+
+    libevdev_free (dev);
+
+    return uidev;
+}
+
+static void
+send_event (struct libevdev_uinput *mouse, guint type, guint code, gint value)
+{
+    libevdev_uinput_write_event (mouse, type, code, value);
+    libevdev_uinput_write_event (mouse, EV_SYN, SYN_REPORT, 0);
+}
+
+/* The daemon's clone carries the name of the device it was made from */
+static gint
+open_clone (const gchar *mouse_devnode)
+{
+    GDir *dir = g_dir_open ("/sys/class/input", 0, NULL);
+    const gchar *entry;
+    gint fd = -1;
+
+    while (dir && fd < 0 && (entry = g_dir_read_name (dir))) {
+        gchar *path, *name_path, *contents = NULL;
+
+        if (!g_str_has_prefix (entry, "event"))
+            continue;
+
+        path = g_build_filename ("/dev/input", entry, NULL);
+        name_path = g_build_filename ("/sys/class/input", entry, "device", "name", NULL);
+
+        if (g_strcmp0 (path, mouse_devnode) != 0 &&
+            g_file_get_contents (name_path, &contents, NULL, NULL) &&
+            g_strcmp0 (g_strstrip (contents), TEST_MOUSE_NAME) == 0)
+            fd = open (path, O_RDONLY | O_NONBLOCK);
+
+        g_free (contents);
+        g_free (name_path);
+        g_free (path);
+    }
+
+    if (dir)
+        g_dir_close (dir);
+
+    return fd;
+}
+
+/* Waits for the clone to show up and pass motion, so the daemon has the
+ * mouse grabbed and is reading it */
+static gint
+wait_for_clone (struct libevdev_uinput *mouse)
+{
+    const gchar *mouse_devnode = libevdev_uinput_get_devnode (mouse);
+    gint64 start = g_get_monotonic_time ();
+    gint fd = -1;
+
+    do {
+        struct input_event ev;
+
+        send_event (mouse, EV_REL, REL_X, 1);
+
+        if (fd < 0)
+            fd = open_clone (mouse_devnode);
+
+        while (fd >= 0 && read (fd, &ev, sizeof (ev)) == sizeof (ev)) {
+            if (ev.type == EV_REL)
+                return fd;
+        }
+
+        g_usleep (POLL_INTERVAL_USEC);
+    } while (g_get_monotonic_time () - start < STEP_TIMEOUT_USEC);
+
+    if (fd >= 0)
+        close (fd);
+
+    return -1;
+}
+
+static gboolean
+left_down (gint fd)
+{
+    unsigned long keys[KEY_CNT / (sizeof (unsigned long) * 8) + 1] = { 0 };
+
+    if (ioctl (fd, EVIOCGKEY (sizeof (keys)), keys) < 0)
+        return FALSE;
+
+    return (keys[BTN_LEFT / (sizeof (unsigned long) * 8)] >> (BTN_LEFT % (sizeof (unsigned long) * 8))) & 1;
+}
+
+/* Until the clone's left button is down, or up */
+static gboolean
+wait_for_left (gint clone_fd, struct libevdev_uinput *mouse, gboolean down)
+{
+    gint64 start = g_get_monotonic_time ();
+
+    do {
+        if (left_down (clone_fd) == down)
+            return TRUE;
+
+        /* Keeps busy-polling backends that sleep when idle going */
+        send_event (mouse, EV_REL, REL_Y, 1);
+        g_usleep (POLL_INTERVAL_USEC);
+    } while (g_get_monotonic_time () - start < STEP_TIMEOUT_USEC);
+
+    return FALSE;
+}
+
+int
+main (int argc, char **argv)
+{
+    struct libevdev_uinput *mouse;
+    GPtrArray *daemon_argv;
+    GError *error = NULL;
+    gint clone_fd;
+    gint status = EXIT_FAILURE;
+    GPid pid;
+
+    if (argc < 2) {
+        g_printerr ("Usage: %s DAEMON [OPTION...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (geteuid () != 0) {
+        g_print ("Skipping: root is needed to create input devices\n");
+        return EXIT_SKIP;
+    }
+
+    mouse = create_mouse ();
+    if (mouse == NULL)
+        return EXIT_SKIP;
+
+    /* Let udev settle the new node before the daemon looks for mice */
+    g_usleep (G_USEC_PER_SEC / 2);
+
+    daemon_argv = g_ptr_array_new ();
+    g_ptr_array_add (daemon_argv, argv[1]);
+    g_ptr_array_add (daemon_argv, "quiet");
+    g_ptr_array_add (daemon_argv, "250");
+    g_ptr_array_add (daemon_argv, "10");
+    g_ptr_array_add (daemon_argv, "1.0");
+    for (gint i = 2; i < argc; i++)
+        g_ptr_array_add (daemon_argv, argv[i]);
+    g_ptr_array_add (daemon_argv, NULL);
+
+    if (!g_spawn_async (NULL, (gchar **) daemon_argv->pdata, NULL,
+                        G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_STDOUT_TO_DEV_NULL,
+                        NULL, NULL, &pid, &error)) {
+        g_printerr ("Could not start %s: %s\n", argv[1], error->message);
+        g_error_free (error);
+        g_ptr_array_unref (daemon_argv);
+        libevdev_uinput_destroy (mouse);
+        return EXIT_FAILURE;
+    }
+
+    clone_fd = wait_for_clone (mouse);
+    if (clone_fd < 0) {
+        g_printerr ("The daemon never passed motion through\n");
+        goto out;
+    }
+
+    send_event (mouse, EV_KEY, BTN_LEFT, 1);
+    if (!wait_for_left (clone_fd, mouse, TRUE)) {
+        g_printerr ("The press never reached the clone\n");
+        goto out;
+    }
+
+    /* The release is lost with everything else queued before the overflow */
+    kill (pid, SIGSTOP);
+    send_event (mouse, EV_KEY, BTN_LEFT, 0);
+    for (gint i = 0; i < FLOOD_FRAMES; i++)
+        send_event (mouse, EV_REL, REL_X, (i & 1) ? 1 : -1);
+    kill (pid, SIGCONT);
+
+    if (wait_for_left (clone_fd, mouse, FALSE)) {
+        g_print ("ok: the left button was released after dropped events\n");
+        status = EXIT_SUCCESS;
+    } else {
+        g_printerr ("FAIL: the left button is stuck down after dropped events\n");
+    }
+
+out:
+    kill (pid, SIGCONT);
+    kill (pid, SIGTERM);
+    waitpid (pid, NULL, 0);
+    g_spawn_close_pid (pid);
+
+    if (clone_fd >= 0)
+        close (clone_fd);
+    g_ptr_array_unref (daemon_argv);
+    libevdev_uinput_destroy (mouse);
+
+    return status;
+}
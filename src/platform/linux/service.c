@@ -0,0 +1,268 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+#include "service.h"
+#include <errno.h>
+#include <grp.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBSYSTEMD
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+#include <systemd/sd-daemon.h>
+#endif
+
+gboolean service_fd_store = FALSE;
+
+#ifdef HAVE_LIBSYSTEMD
+
+/* Store names pair the fds of a device up and carry the node names the
+ * daemon would otherwise lose: "in-eventN" for the grabbed node and
+ * "out-eventN-eventM" for its clone at eventM. Colons aren't allowed. */
+#define INPUT_PREFIX "in-"
+#define OUTPUT_PREFIX "out-"
+
+static gchar *
+input_name (const gchar *input_devnode)
+{
+    gchar *node = g_path_get_basename (input_devnode);
+    gchar *name = g_strconcat (INPUT_PREFIX, node, NULL);
+
+    g_free (node);
+    return name;
+}
+
+static gchar *
+output_name (const gchar *input_devnode, const gchar *output_devnode)
+{
+    gchar *input_node = g_path_get_basename (input_devnode);
+    gchar *output_node = g_path_get_basename (output_devnode);
+    gchar *name = g_strdup_printf (OUTPUT_PREFIX "%s-%s", input_node, output_node);
+
+    g_free (output_node);
+    g_free (input_node);
+    return name;
+}
+
+/* NOTIFY_SOCKET and LISTEN_* come from the environment, which a caller
+ * of the setuid binary controls; only a service manager running us as
+ * root is listened to */
+static gboolean
+started_by_caller (void)
+{
+    return getuid () != geteuid ();
+}
+
+static void
+store_fd (gint fd, const gchar *name)
+{
+    gchar *state = g_strdup_printf ("FDSTORE=1\nFDNAME=%s", name);
+    gint rc = sd_pid_notify_with_fds (0, 0, state, &fd, 1);
+
+    if (rc <= 0)
+        g_warning ("Could not keep %s in the service manager's fd store: %s",
+                   name, rc < 0 ? strerror (-rc) : "not running as a service");
+
+    g_free (state);
+}
+
+static void
+remove_fds (const gchar *name)
+{
+    gchar *state = g_strdup_printf ("FDSTOREREMOVE=1\nFDNAME=%s", name);
+
+    sd_notify (0, state);
+    g_free (state);
+}
+
+static void
+release_output (gint fd)
+{
+    ioctl (fd, UI_DEV_DESTROY, NULL);
+    close (fd);
+}
+
+void
+service_restore_devices (ServiceAttachFunc attach)
+{
+    gchar **names = NULL;
+    gint n_fds;
+    gboolean *used;
+
+    if (started_by_caller ())
+        return;
+
+    n_fds = sd_listen_fds_with_names (1, &names);
+    if (n_fds <= 0) {
+        g_strfreev (names);
+        return;
+    }
+
+    used = g_new0 (gboolean, n_fds);
+
+    for (gint i = 0; i < n_fds; i++) {
+        const gchar *node;
+        gchar *output_prefix;
+        MouseDevice *device = NULL;
+
+        if (!g_str_has_prefix (names[i], INPUT_PREFIX))
+            continue;
+
+        node = names[i] + strlen (INPUT_PREFIX);
+        output_prefix = g_strdup_printf (OUTPUT_PREFIX "%s-", node);
+
+        for (gint j = 0; j < n_fds; j++) {
+            gchar *input_devnode, *output_devnode;
+
+            if (used[j] || !g_str_has_prefix (names[j], output_prefix))
+                continue;
+
+            input_devnode = g_build_filename ("/dev/input", node, NULL);
+            output_devnode = g_build_filename ("/dev/input", names[j] + strlen (output_prefix), NULL);
+
+            used[i] = used[j] = TRUE;
+            device = mouse_device_adopt (SD_LISTEN_FDS_START + i, input_devnode,
+                                         SD_LISTEN_FDS_START + j, output_devnode);
+
+            /* Unplugged while we were down */
+            if (device == NULL) {
+                remove_fds (names[i]);
+                remove_fds (names[j]);
+            }
+
+            g_free (output_devnode);
+            g_free (input_devnode);
+            break;
+        }
+
+        if (device)
+            attach (device);
+
+        g_free (output_prefix);
+    }
+
+    /* Half of a pair is of no use; let the store drop it too */
+    for (gint i = 0; i < n_fds; i++) {
+        if (used[i])
+            continue;
+
+        if (g_str_has_prefix (names[i], OUTPUT_PREFIX))
+            release_output (SD_LISTEN_FDS_START + i);
+        else
+            close (SD_LISTEN_FDS_START + i);
+
+        remove_fds (names[i]);
+    }
+
+    g_free (used);
+    g_strfreev (names);
+}
+
+void
+service_store_device (MouseDevice *device)
+{
+    gchar *name;
+
+    /* The aggregated output is shared and can't be adopted later */
+    if (!service_fd_store || !device->owns_output)
+        return;
+
+    name = input_name (device->input_devnode);
+    store_fd (device->fd, name);
+    g_free (name);
+
+    name = output_name (device->input_devnode, device->output_devnode);
+    store_fd (device->output_fd, name);
+    g_free (name);
+}
+
+void
+service_forget_device (MouseDevice *device)
+{
+    gchar *name;
+
+    if (!service_fd_store || !device->owns_output)
+        return;
+
+    name = input_name (device->input_devnode);
+    remove_fds (name);
+    g_free (name);
+
+    name = output_name (device->input_devnode, device->output_devnode);
+    remove_fds (name);
+    g_free (name);
+}
+
+void
+service_notify_ready (guint n_devices)
+{
+    gchar *state;
+
+    if (started_by_caller ())
+        return;
+
+    state = g_strdup_printf ("READY=1\nSTATUS=Filtering %u device(s)", n_devices);
+    sd_notify (0, state);
+    g_free (state);
+}
+
+void
+service_notify_stopping (void)
+{
+    if (!started_by_caller ())
+        sd_notify (0, "STOPPING=1");
+}
+
+#else
+
+void
+service_restore_devices (ServiceAttachFunc attach)
+{
+    if (service_fd_store)
+        g_warning ("mousedamper was built without systemd support, --fd-store has no effect");
+}
+
+void
+service_store_device (MouseDevice *device)
+{
+}
+
+void
+service_forget_device (MouseDevice *device)
+{
+}
+
+void
+service_notify_ready (guint n_devices)
+{
+}
+
+void
+service_notify_stopping (void)
+{
+}
+
+#endif
+
+gid_t
+service_group_id (void)
+{
+    struct group *group = getgrnam (SERVICE_GROUP);
+
+    return group ? group->gr_gid : (gid_t) -1;
+}
@@ -0,0 +1,47 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+#ifndef SERVICE_H
+#define SERVICE_H
+
+#include "mouse_device.h"
+
+/* Running as a systemd service (Type=notify, see mousedamper.service):
+ * readiness goes to the service manager, and with --fd-store every
+ * device's grabbed input fd and uinput fd are kept in its fd store. A
+ * restarted or crashed daemon gets them back, so the devices are never
+ * ungrabbed or recreated in between. Needs a build with libsystemd. */
+
+/* Besides root, members of this group may send the daemon settings and
+ * control requests; mousedamper.sysusers creates it */
+#define SERVICE_GROUP "mousedamper"
+
+typedef void (*ServiceAttachFunc) (MouseDevice *device);
+
+extern gboolean service_fd_store;
+
+/* Takes over the devices in the fd store; attach is called on each */
+void service_restore_devices (ServiceAttachFunc attach);
+/* Keeps a newly created device's fds in the store */
+void service_store_device (MouseDevice *device);
+/* Drops a device's fds from the store, once it is gone for good */
+void service_forget_device (MouseDevice *device);
+void service_notify_ready (guint n_devices);
+void service_notify_stopping (void);
+/* SERVICE_GROUP's id, or -1 without such a group */
+gid_t service_group_id (void);
+
+#endif
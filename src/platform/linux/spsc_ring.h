@@ -0,0 +1,112 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+/* Bounded lock-free single-producer/single-consumer ring of input events.
+ * Capacity is a power of two; head and tail count forever and are masked
+ * on access, so full and empty never need a spare slot to tell apart.
+ * The caller provides the slots, see arena.h. */
+
+#include <linux/input.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#define SPSC_RING_CACHELINE 64
+
+typedef struct {
+    _Alignas (SPSC_RING_CACHELINE) atomic_size_t head;
+    _Alignas (SPSC_RING_CACHELINE) atomic_size_t tail;
+    _Alignas (SPSC_RING_CACHELINE) size_t mask;
+    struct input_event *slots;
+} SpscRing;
+
+/* Also empties a ring being reused */
+static inline bool
+spsc_ring_init (SpscRing *ring, struct input_event *slots, size_t capacity)
+{
+    if (slots == NULL || capacity == 0 || (capacity & (capacity - 1)) != 0)
+        return false;
+
+    ring->slots = slots;
+    ring->mask = capacity - 1;
+    atomic_init (&ring->head, 0);
+    atomic_init (&ring->tail, 0);
+    return true;
+}
+
+static inline size_t
+spsc_ring_count (SpscRing *ring)
+{
+    return atomic_load_explicit (&ring->tail, memory_order_acquire) -
+           atomic_load_explicit (&ring->head, memory_order_acquire);
+}
+
+static inline size_t
+spsc_ring_free_space (SpscRing *ring)
+{
+    return ring->mask + 1 - spsc_ring_count (ring);
+}
+
+/* Producer: all n events or none, so a frame is never split by a full ring */
+static inline bool
+spsc_ring_push (SpscRing *ring, const struct input_event *events, size_t n)
+{
+    size_t tail = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit (&ring->head, memory_order_acquire);
+
+    if (ring->mask + 1 - (tail - head) < n)
+        return false;
+
+    for (size_t i = 0; i < n; i++)
+        ring->slots[(tail + i) & ring->mask] = events[i];
+
+    atomic_store_explicit (&ring->tail, tail + n, memory_order_release);
+    return true;
+}
+
+/* Consumer: pointer to up to max readable events that are contiguous in
+ * memory; release them with spsc_ring_consume () once done */
+static inline size_t
+spsc_ring_peek (SpscRing *ring, struct input_event **events, size_t max)
+{
+    size_t head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit (&ring->tail, memory_order_acquire);
+    size_t offset = head & ring->mask;
+    size_t n = tail - head;
+
+    if (n > ring->mask + 1 - offset)
+        n = ring->mask + 1 - offset;
+    if (n > max)
+        n = max;
+
+    *events = &ring->slots[offset];
+    return n;
+}
+
+static inline void
+spsc_ring_consume (SpscRing *ring, size_t n)
+{
+    size_t head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+
+    atomic_store_explicit (&ring->head, head + n, memory_order_release);
+}
+
+#endif
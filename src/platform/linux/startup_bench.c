@@ -0,0 +1,303 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+/* Measures how long the daemon takes from launch until the first event
+ * from a mouse comes out of its virtual device, and its resident memory
+ * at that point. Spare keyboard nodes stand
+ * in for a machine with many input devices. Needs root for uinput; any
+ * real mice are grabbed by the daemon while a run is in progress.
+ *
+ * Usage: mousedamper-startup-bench DAEMON [RUNS] [SPARE_NODES]
+ */
+
+#include <glib.h>
+#include <libevdev/libevdev.h>
+#include <libevdev/libevdev-uinput.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/wait.h>
+
+#define BENCH_MOUSE_NAME "Mousedamper startup benchmark mouse"
+#define BENCH_SPARE_NAME "Mousedamper startup benchmark keyboard"
+#define DEFAULT_RUNS 5
+#define DEFAULT_SPARE_NODES 30
+#define RUN_TIMEOUT_USEC (10 * G_USEC_PER_SEC)
+#define POLL_INTERVAL_USEC 500
+
+/* meson treats this exit status as a skipped benchmark */
+#define EXIT_SKIP 77
+
+static struct libevdev_uinput *
+create_node (gboolean mouse)
+{
+    struct libevdev *dev = libevdev_new ();
+    struct libevdev_uinput *uidev = NULL;
+    int rc;
+
+    if (mouse) {
+        libevdev_set_name (dev, BENCH_MOUSE_NAME);
+        libevdev_enable_event_code (dev, EV_KEY, BTN_LEFT, NULL);
+        libevdev_enable_event_code (dev, EV_KEY, BTN_RIGHT, NULL);
+        libevdev_enable_event_code (dev, EV_REL, REL_X, NULL);
+        libevdev_enable_event_code (dev, EV_REL, REL_Y, NULL);
+    } else {
+        libevdev_set_name (dev, BENCH_SPARE_NAME);
+        libevdev_enable_event_code (dev, EV_KEY, KEY_A, NULL);
+    }
+
+    rc = libevdev_uinput_create_from_device (dev, LIBEVDEV_UINPUT_OPEN_MANAGED, &uidev);
+    if (rc < 0)
+        g_printerr ("Failed to create uinput device: %s\n", strerror (-rc));
+
+    libevdev_free (dev);
+
+    return uidev;
+}
+
+/* The daemon's clone carries the name of the device it was made from */
+static gboolean
+is_clone (const gchar *name, const gchar *mouse_devnode)
+{
+    gchar *path = g_build_filename ("/dev/input", name, NULL);
+    gchar *name_path = g_build_filename ("/sys/class/input", name, "device", "name", NULL);
+    gchar *contents = NULL;
+    gboolean result = FALSE;
+
+    if (g_strcmp0 (path, mouse_devnode) != 0 &&
+        g_file_get_contents (name_path, &contents, NULL, NULL))
+        result = g_strcmp0 (g_strstrip (contents), BENCH_MOUSE_NAME) == 0;
+
+    g_free (contents);
+    g_free (name_path);
+    g_free (path);
+
+    return result;
+}
+
+static gint
+open_clone (gint inotify_fd, const gchar *mouse_devnode)
+{
+    gchar buffer[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+    gssize len;
+    gint fd = -1;
+
+    while (fd < 0 && (len = read (inotify_fd, buffer, sizeof (buffer))) > 0) {
+        const struct inotify_event *event;
+
+        for (gchar *ptr = buffer; ptr < buffer + len; ptr += sizeof (struct inotify_event) + event->len) {
+            event = (const struct inotify_event *) ptr;
+
+            if (fd < 0 && event->len > 0 && g_str_has_prefix (event->name, "event") &&
+                is_clone (event->name, mouse_devnode)) {
+                gchar *path = g_build_filename ("/dev/input", event->name, NULL);
+
+                fd = open (path, O_RDONLY | O_NONBLOCK);
+                g_free (path);
+            }
+        }
+    }
+
+    return fd;
+}
+
+/* Resident memory of a process in KiB, or -1 */
+static gint64
+read_rss_kib (GPid pid)
+{
+    gchar *path = g_strdup_printf ("/proc/%d/status", (gint) pid);
+    gchar *contents = NULL;
+    gint64 result = -1;
+
+    if (g_file_get_contents (path, &contents, NULL, NULL)) {
+        const gchar *line = strstr (contents, "\nVmRSS:");
+
+        if (line)
+            result = g_ascii_strtoll (line + strlen ("\nVmRSS:"), NULL, 10);
+    }
+
+    g_free (contents);
+    g_free (path);
+
+    return result;
+}
+
+/* Returns the time from launch to the first filtered event, or -1, and
+ * the daemon's resident memory then in rss_kib */
+static gint64
+run_once (const gchar *daemon, struct libevdev_uinput *mouse, gint64 *rss_kib)
+{
+    const gchar *mouse_devnode = libevdev_uinput_get_devnode (mouse);
+    gchar *argv[] = { (gchar *) daemon, "quiet", "250", "10", "1.0", NULL };
+    GError *error = NULL;
+    gint inotify_fd;
+    gint clone_fd = -1;
+    gint64 start, now;
+    gint64 result = -1;
+    GPid pid;
+
+    inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0 || inotify_add_watch (inotify_fd, "/dev/input", IN_CREATE | IN_ATTRIB) < 0) {
+        g_printerr ("Could not watch /dev/input: %s\n", strerror (errno));
+        if (inotify_fd >= 0)
+            close (inotify_fd);
+        return -1;
+    }
+
+    start = g_get_monotonic_time ();
+
+    if (!g_spawn_async (NULL, argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_STDOUT_TO_DEV_NULL,
+                        NULL, NULL, &pid, &error)) {
+        g_printerr ("Could not start %s: %s\n", daemon, error->message);
+        g_error_free (error);
+        close (inotify_fd);
+        return -1;
+    }
+
+    do {
+        struct input_event ev;
+
+        /* Keep moving, the daemon only forwards what arrives after its grab */
+        libevdev_uinput_write_event (mouse, EV_REL, REL_X, 1);
+        libevdev_uinput_write_event (mouse, EV_SYN, SYN_REPORT, 0);
+
+        if (clone_fd < 0)
+            clone_fd = open_clone (inotify_fd, mouse_devnode);
+
+        while (clone_fd >= 0 && read (clone_fd, &ev, sizeof (ev)) == sizeof (ev)) {
+            if (ev.type == EV_REL) {
+                result = g_get_monotonic_time () - start;
+                *rss_kib = read_rss_kib (pid);
+                break;
+            }
+        }
+
+        if (result >= 0)
+            break;
+
+        g_usleep (POLL_INTERVAL_USEC);
+        now = g_get_monotonic_time ();
+    } while (now - start < RUN_TIMEOUT_USEC);
+
+    kill (pid, SIGTERM);
+    waitpid (pid, NULL, 0);
+    g_spawn_close_pid (pid);
+
+    if (clone_fd >= 0)
+        close (clone_fd);
+    close (inotify_fd);
+
+    return result;
+}
+
+static gint
+compare_times (gconstpointer a, gconstpointer b)
+{
+    gint64 time_a = *(const gint64 *) a;
+    gint64 time_b = *(const gint64 *) b;
+
+    return (time_a > time_b) - (time_a < time_b);
+}
+
+int
+main (int argc, char **argv)
+{
+    struct libevdev_uinput *mouse;
+    GPtrArray *spares;
+    GArray *times;
+    GArray *rss;
+    gint runs = DEFAULT_RUNS;
+    gint n_spares = DEFAULT_SPARE_NODES;
+    gint status = EXIT_SUCCESS;
+
+    if (argc < 2) {
+        g_printerr ("Usage: %s DAEMON [RUNS] [SPARE_NODES]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (argc > 2)
+        runs = MAX (1, atoi (argv[2]));
+    if (argc > 3)
+        n_spares = MAX (0, atoi (argv[3]));
+
+    if (geteuid () != 0) {
+        g_print ("Skipping: root is needed to create input devices\n");
+        return EXIT_SKIP;
+    }
+
+    mouse = create_node (TRUE);
+    if (mouse == NULL)
+        return EXIT_SKIP;
+
+    spares = g_ptr_array_new_with_free_func ((GDestroyNotify) libevdev_uinput_destroy);
+    for (gint i = 0; i < n_spares; i++) {
+        struct libevdev_uinput *spare = create_node (FALSE);
+
+        if (spare)
+            g_ptr_array_add (spares, spare);
+    }
+
+    /* Let udev settle the new nodes so the first run isn't penalized */
+    g_usleep (G_USEC_PER_SEC / 2);
+
+    times = g_array_new (FALSE, FALSE, sizeof (gint64));
+    rss = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+    for (gint i = 0; i < runs; i++) {
+        gint64 rss_kib = -1;
+        gint64 elapsed = run_once (argv[1], mouse, &rss_kib);
+
+        if (elapsed < 0) {
+            g_printerr ("Run %d: no filtered event within %d s\n", i + 1,
+                        (gint) (RUN_TIMEOUT_USEC / G_USEC_PER_SEC));
+            status = EXIT_FAILURE;
+            break;
+        }
+
+        g_print ("Run %d: first filtered event after %.1f ms, %" G_GINT64_FORMAT " KiB resident\n",
+                 i + 1, elapsed / 1000.0, rss_kib);
+        g_array_append_val (times, elapsed);
+        if (rss_kib >= 0)
+            g_array_append_val (rss, rss_kib);
+    }
+
+    if (times->len > 0) {
+        g_array_sort (times, compare_times);
+        g_print ("Time to first filtered event with %u other input nodes: median %.1f ms, best %.1f ms\n",
+                 spares->len,
+                 g_array_index (times, gint64, times->len / 2) / 1000.0,
+                 g_array_index (times, gint64, 0) / 1000.0);
+    }
+
+    if (rss->len > 0) {
+        g_array_sort (rss, compare_times);
+        g_print ("Resident memory of %s at first filtered event: median %" G_GINT64_FORMAT " KiB\n",
+                 argv[1], g_array_index (rss, gint64, rss->len / 2));
+    }
+
+    g_array_unref (rss);
+    g_array_unref (times);
+    g_ptr_array_unref (spares);
+    libevdev_uinput_destroy (mouse);
+
+    return status;
+}
@@ -0,0 +1,169 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+#include "telemetry.h"
+#include <glib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static TelemetryPage *page = NULL;
+
+/* Only ever a new file, never one found at the path */
+static gint
+create_file (const gchar *path)
+{
+    gint flags = O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC;
+    gint fd = open (path, flags, 0644);
+
+    /* Left behind by a daemon that crashed with the same pid */
+    if (fd < 0 && errno == EEXIST && unlink (path) == 0)
+        fd = open (path, flags, 0644);
+
+    return fd;
+}
+
+/* Written to a new file and renamed over the path, so readers still
+ * mapping a previous daemon's page never see it shrink under them */
+static TelemetryPage *
+create_page (void)
+{
+    gchar *temp_path = g_strdup_printf ("%s.%d", TELEMETRY_PATH, getpid ());
+    TelemetryPage *mapped = MAP_FAILED;
+    gint fd = -1;
+
+    if (mkdir (TELEMETRY_DIR, 0755) < 0 && errno != EEXIST)
+        goto out;
+
+    fd = create_file (temp_path);
+    if (fd < 0)
+        goto out;
+
+    /* Readers may run as any user */
+    if (fchmod (fd, 0644) < 0 || ftruncate (fd, sizeof (TelemetryPage)) < 0)
+        goto out;
+
+    mapped = mmap (NULL, sizeof (TelemetryPage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED)
+        goto out;
+
+    /* Faults the pages in now rather than on the first frame */
+    memset (mapped, 0, sizeof (TelemetryPage));
+
+    if (rename (temp_path, TELEMETRY_PATH) < 0) {
+        munmap (mapped, sizeof (TelemetryPage));
+        mapped = MAP_FAILED;
+    }
+
+out:
+    if (mapped == MAP_FAILED) {
+        g_warning ("Could not create the telemetry page at %s: %s", TELEMETRY_PATH, strerror (errno));
+        if (fd >= 0)
+            unlink (temp_path);
+    }
+
+    if (fd >= 0)
+        close (fd);
+
+    g_free (temp_path);
+    return mapped == MAP_FAILED ? NULL : mapped;
+}
+
+bool
+telemetry_start (void)
+{
+    TelemetryHeader *header;
+
+    page = create_page ();
+    if (page == NULL)
+        return false;
+
+    header = &page->header;
+    header->version = TELEMETRY_VERSION;
+    header->header_size = sizeof (TelemetryHeader);
+    header->device_size = sizeof (TelemetryDevice);
+    header->max_devices = TELEMETRY_MAX_DEVICES;
+    header->pid = getpid ();
+    atomic_store_explicit (&header->running, 1, memory_order_relaxed);
+
+    /* Last, so a reader that sees it sees the rest of the header */
+    atomic_thread_fence (memory_order_release);
+    header->magic = TELEMETRY_MAGIC;
+
+    g_print ("Publishing telemetry to %s\n", TELEMETRY_PATH);
+    return true;
+}
+
+void
+telemetry_stop (void)
+{
+    if (page == NULL)
+        return;
+
+    telemetry_set_running (false);
+    unlink (TELEMETRY_PATH);
+
+    munmap (page, sizeof (TelemetryPage));
+    page = NULL;
+}
+
+void
+telemetry_set_running (bool running)
+{
+    if (page)
+        atomic_store_explicit (&page->header.running, running, memory_order_release);
+}
+
+TelemetryDevice *
+telemetry_claim (const char *devnode, const char *name)
+{
+    if (page == NULL)
+        return NULL;
+
+    for (int i = 0; i < TELEMETRY_MAX_DEVICES; i++) {
+        TelemetryDevice *slot = &page->devices[i];
+
+        if (slot->in_use)
+            continue;
+
+        telemetry_begin_write (slot);
+        memset ((char *) slot + sizeof (slot->seq), 0, sizeof (TelemetryDevice) - sizeof (slot->seq));
+        g_strlcpy (slot->devnode, devnode, sizeof (slot->devnode));
+        g_strlcpy (slot->name, name ? name : "", sizeof (slot->name));
+        slot->enabled = 1;
+        slot->in_use = 1;
+        telemetry_end_write (slot);
+        return slot;
+    }
+
+    g_warning ("No telemetry slot left for %s", devnode);
+    return NULL;
+}
+
+void
+telemetry_release (TelemetryDevice *slot)
+{
+    if (slot == NULL)
+        return;
+
+    telemetry_begin_write (slot);
+    slot->in_use = 0;
+    telemetry_end_write (slot);
+}
@@ -0,0 +1,116 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include "../../common/damper_core.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Telemetry page: a file mapped by the daemon, holding the live state of
+ * each device for any number of readers to map and sample without asking
+ * the daemon. Each device slot is updated by the thread dispatching it,
+ * without syscalls or locks, and guarded by its own seqlock: seq is odd
+ * while the slot is being written, so readers copy the slot between two
+ * loads of seq and retry unless both saw the same even value.
+ *
+ * The file is replaced, never truncated, on restart; a reader holding
+ * an old mapping sees running drop to 0 and should map the path again. */
+
+/* Fixed, as the daemon may run setuid root */
+#define TELEMETRY_DIR "/run/mousedamper"
+#define TELEMETRY_PATH TELEMETRY_DIR "/telemetry"
+#define TELEMETRY_MAGIC 0x4d44544d
+/* Bump whenever the layout below changes */
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_MAX_DEVICES 32
+#define TELEMETRY_NAME_MAX 64
+/* Most often a slot is published, in event time; freezes starting or
+ * ending are published right away */
+#define TELEMETRY_INTERVAL_USEC 50000
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t device_size;
+    uint32_t max_devices;
+    uint32_t pid;
+    _Atomic uint32_t running;
+    uint32_t padding;
+} TelemetryHeader;
+
+typedef struct {
+    uint64_t frames;
+    int64_t p50_usec;
+    int64_t p99_usec;
+    int64_t max_usec;
+} TelemetryLatency;
+
+typedef struct {
+    _Atomic uint32_t seq;
+    uint32_t in_use;
+    char devnode[TELEMETRY_NAME_MAX];
+    char name[TELEMETRY_NAME_MAX];
+    /* CLOCK_MONOTONIC timestamp of the frame published last */
+    int64_t updated_usec;
+    uint32_t enabled;
+    uint32_t frozen;
+    int32_t x_freeze_delta;
+    int32_t y_freeze_delta;
+    uint64_t events;
+    uint64_t bypassed_frames;
+    uint64_t suppressed_frames;
+    uint64_t drops;
+    DamperCounters counters;
+    /* Pass-through and post-freeze frames, see MouseDeviceFrameKind */
+    TelemetryLatency latency[2];
+} TelemetryDevice;
+
+typedef struct {
+    TelemetryHeader header;
+    TelemetryDevice devices[TELEMETRY_MAX_DEVICES];
+} TelemetryPage;
+
+/* A slot has one writer at a time */
+static inline void
+telemetry_begin_write (TelemetryDevice *slot)
+{
+    atomic_store_explicit (&slot->seq, atomic_load_explicit (&slot->seq, memory_order_relaxed) + 1,
+                           memory_order_relaxed);
+    atomic_thread_fence (memory_order_release);
+}
+
+static inline void
+telemetry_end_write (TelemetryDevice *slot)
+{
+    atomic_store_explicit (&slot->seq, atomic_load_explicit (&slot->seq, memory_order_relaxed) + 1,
+                           memory_order_release);
+}
+
+bool telemetry_start (void);
+/* Marks the page stopped and removes the file; no device may be
+ * dispatched any more */
+void telemetry_stop (void);
+/* Around a live upgrade, which replaces the file with the new image's */
+void telemetry_set_running (bool running);
+/* NULL while telemetry is off, or with every slot taken */
+TelemetryDevice *telemetry_claim (const char *devnode, const char *name);
+void telemetry_release (TelemetryDevice *slot);
+
+#endif
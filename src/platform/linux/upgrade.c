@@ -0,0 +1,400 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+#define _GNU_SOURCE
+
+#include "upgrade.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/input.h>
+#include <linux/major.h>
+#include <linux/uinput.h>
+
+#define UPGRADE_MAGIC 0x4d445550
+/* Bump whenever UpgradeDevice changes. Its first two fields must stay
+ * put: an image that can't read a snapshot still has to close its fds. */
+#define UPGRADE_VERSION 2
+#define UPGRADE_DEVNODE_MAX 64
+#define UPGRADE_MAX_DEVICE_SIZE 4096
+/* /dev/uinput is a misc device */
+#define UINPUT_MINOR 223
+
+typedef struct {
+    guint32 magic;
+    guint32 version;
+    guint32 n_devices;
+    guint32 device_size;
+} UpgradeHeader;
+
+typedef struct {
+    gint32 input_fd;
+    gint32 output_fd;
+    gchar input_devnode[UPGRADE_DEVNODE_MAX];
+    gchar output_devnode[UPGRADE_DEVNODE_MAX];
+    gint64 button_freeze_time;
+    guint64 domain_word;
+    gint32 x_freeze_delta;
+    gint32 y_freeze_delta;
+    guint8 first_down;
+    guint8 second_down;
+    guint8 motion_frozen;
+    guint8 discarding;
+    guint32 padding;
+    guint64 bypassed_frames;
+    guint64 suppressed_frames;
+    guint64 drops;
+    /* Also changes size with DAMPER_END_COUNT */
+    DamperCounters counters;
+} UpgradeDevice;
+
+static gboolean
+write_all (gint fd, const void *data, gsize size)
+{
+    const gchar *ptr = data;
+
+    while (size > 0) {
+        gssize written = write (fd, ptr, size);
+
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return FALSE;
+
+        ptr += written;
+        size -= written;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+read_all (gint fd, void *data, gsize size)
+{
+    gchar *ptr = data;
+
+    while (size > 0) {
+        gssize len = read (fd, ptr, size);
+
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            return FALSE;
+
+        ptr += len;
+        size -= len;
+    }
+
+    return TRUE;
+}
+
+static void
+set_cloexec (gint fd, gboolean cloexec)
+{
+    gint flags = fcntl (fd, F_GETFD);
+
+    if (flags >= 0)
+        fcntl (fd, F_SETFD, cloexec ? flags | FD_CLOEXEC : flags & ~FD_CLOEXEC);
+}
+
+static void
+save_device (MouseDevice *device, UpgradeDevice *record)
+{
+    const DamperState *state = &device->state;
+
+    memset (record, 0, sizeof (*record));
+    record->input_fd = device->fd;
+    record->output_fd = device->output_fd;
+    g_strlcpy (record->input_devnode, device->input_devnode, sizeof (record->input_devnode));
+    g_strlcpy (record->output_devnode, device->output_devnode, sizeof (record->output_devnode));
+    record->button_freeze_time = state->button_freeze_time;
+    record->domain_word = state->domain_seen;
+    record->x_freeze_delta = state->x_freeze_delta;
+    record->y_freeze_delta = state->y_freeze_delta;
+    record->first_down = state->first_down;
+    record->second_down = state->second_down;
+    record->motion_frozen = state->motion_frozen;
+    record->discarding = device->discarding;
+    record->bypassed_frames = device->bypassed_frames;
+    record->suppressed_frames = device->suppressed_frames;
+    record->drops = device->drops;
+    record->counters = state->counters;
+}
+
+/* Left without close-on-exec, positioned at the start */
+static gint
+save_snapshot (GPtrArray *devices)
+{
+    UpgradeHeader header = { UPGRADE_MAGIC, UPGRADE_VERSION, devices->len, sizeof (UpgradeDevice) };
+    gint fd = memfd_create ("mousedamper-upgrade", 0);
+
+    if (fd < 0)
+        return -1;
+
+    if (!write_all (fd, &header, sizeof (header)))
+        goto fail;
+
+    for (guint i = 0; i < devices->len; i++) {
+        UpgradeDevice record;
+
+        save_device (g_ptr_array_index (devices, i), &record);
+        if (!write_all (fd, &record, sizeof (record)))
+            goto fail;
+    }
+
+    if (lseek (fd, 0, SEEK_SET) < 0)
+        goto fail;
+
+    return fd;
+
+fail:
+    close (fd);
+    return -1;
+}
+
+/* The arguments we were started with, pointing at the snapshot. argv[0]
+ * is the caller's to choose, so it is never what gets executed. */
+static gchar **
+build_argv (gint snapshot_fd)
+{
+    GPtrArray *argv;
+    gchar *contents;
+    gsize len;
+
+    if (!g_file_get_contents ("/proc/self/cmdline", &contents, &len, NULL))
+        return NULL;
+
+    argv = g_ptr_array_new ();
+    g_ptr_array_add (argv, g_strdup (DAEMON_EXEC));
+
+    for (gchar *arg = contents + strlen (contents) + 1; arg < contents + len; arg += strlen (arg) + 1) {
+        if (!g_str_has_prefix (arg, "--resume="))
+            g_ptr_array_add (argv, g_strdup (arg));
+    }
+
+    g_ptr_array_add (argv, g_strdup_printf ("--resume=%d", snapshot_fd));
+    g_ptr_array_add (argv, NULL);
+    g_free (contents);
+
+    return (gchar **) g_ptr_array_free (argv, FALSE);
+}
+
+/* The exec may run on the input thread; its scheduling settings would
+ * otherwise carry over to the new image's main thread */
+static void
+reset_thread_settings (void)
+{
+    struct sched_param param = { 0 };
+    cpu_set_t cpus;
+
+    pthread_setschedparam (pthread_self (), SCHED_OTHER, &param);
+
+    CPU_ZERO (&cpus);
+    for (gint cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        CPU_SET (cpu, &cpus);
+    sched_setaffinity (0, sizeof (cpus), &cpus);
+}
+
+void
+upgrade_exec (GPtrArray *devices)
+{
+    sigset_t mask, old_mask;
+    gchar **argv;
+    gint snapshot_fd;
+
+    /* Anything of a frame read so far goes out before the handover */
+    for (guint i = 0; i < devices->len; i++)
+        mouse_device_write_frame (g_ptr_array_index (devices, i));
+
+    snapshot_fd = save_snapshot (devices);
+    if (snapshot_fd < 0) {
+        g_warning ("Failed to save device state for the upgrade: %s", strerror (errno));
+        return;
+    }
+
+    argv = build_argv (snapshot_fd);
+    if (argv == NULL) {
+        g_warning ("Could not read the daemon's arguments for the upgrade");
+        close (snapshot_fd);
+        return;
+    }
+
+    /* libevdev opens uinput close-on-exec; input nodes are opened without */
+    for (guint i = 0; i < devices->len; i++)
+        set_cloexec (((MouseDevice *) g_ptr_array_index (devices, i))->output_fd, FALSE);
+
+    /* Signal masks survive exec: only keep blocking the signals the new
+     * image reads from signalfds again, upgrade and latency requests */
+    sigemptyset (&mask);
+    sigaddset (&mask, SIGUSR1);
+    sigaddset (&mask, SIGUSR2);
+    pthread_sigmask (SIG_SETMASK, &mask, &old_mask);
+    reset_thread_settings ();
+
+    g_print ("Upgrading: handing %u device(s) over to %s\n", devices->len, DAEMON_EXEC);
+    fflush (stdout);
+
+    execv (DAEMON_EXEC, argv);
+
+    g_warning ("Failed to execute %s: %s", DAEMON_EXEC, strerror (errno));
+    pthread_sigmask (SIG_SETMASK, &old_mask, NULL);
+
+    for (guint i = 0; i < devices->len; i++)
+        set_cloexec (((MouseDevice *) g_ptr_array_index (devices, i))->output_fd, TRUE);
+
+    g_strfreev (argv);
+    close (snapshot_fd);
+}
+
+/* The fds named in a snapshot are only used if they really are an
+ * input node and a uinput device */
+static gboolean
+is_input_fd (gint fd, struct stat *st)
+{
+    int version;
+
+    return fd >= 0 && fstat (fd, st) == 0 && S_ISCHR (st->st_mode) &&
+           major (st->st_rdev) == INPUT_MAJOR && ioctl (fd, EVIOCGVERSION, &version) == 0;
+}
+
+static gboolean
+is_uinput_fd (gint fd)
+{
+    struct stat st;
+
+    return fd >= 0 && fstat (fd, &st) == 0 && S_ISCHR (st.st_mode) &&
+           major (st.st_rdev) == MISC_MAJOR && minor (st.st_rdev) == UINPUT_MINOR;
+}
+
+static gboolean
+is_input_devnode (const gchar *devnode)
+{
+    return memchr (devnode, '\0', UPGRADE_DEVNODE_MAX) != NULL &&
+           g_str_has_prefix (devnode, "/dev/input/") && strstr (devnode, "..") == NULL;
+}
+
+static void
+release_fds (const UpgradeDevice *record)
+{
+    struct stat st;
+
+    if (is_input_fd (record->input_fd, &st))
+        close (record->input_fd);
+
+    if (is_uinput_fd (record->output_fd)) {
+        ioctl (record->output_fd, UI_DEV_DESTROY, NULL);
+        close (record->output_fd);
+    }
+}
+
+static gboolean
+validate_device (const UpgradeDevice *record)
+{
+    struct stat fd_st, node_st;
+
+    if (!is_input_devnode (record->input_devnode) || !is_input_devnode (record->output_devnode))
+        return FALSE;
+
+    /* The node must be the one the fd was opened from */
+    return is_input_fd (record->input_fd, &fd_st) &&
+           stat (record->input_devnode, &node_st) == 0 && node_st.st_rdev == fd_st.st_rdev &&
+           is_uinput_fd (record->output_fd);
+}
+
+static void
+resume_device (const UpgradeDevice *record, UpgradeAttachFunc attach)
+{
+    MouseDevice *device;
+    DamperState saved = { 0 };
+
+    if (!validate_device (record)) {
+        g_warning ("Ignoring a device in the saved state that isn't a grabbed input node");
+        release_fds (record);
+        return;
+    }
+
+    set_cloexec (record->output_fd, TRUE);
+
+    device = mouse_device_adopt (record->input_fd, record->input_devnode,
+                                 record->output_fd, record->output_devnode);
+    if (device == NULL)
+        return;
+
+    attach (device);
+
+    saved.button_freeze_time = record->button_freeze_time;
+    saved.first_down = record->first_down;
+    saved.second_down = record->second_down;
+    saved.motion_frozen = record->motion_frozen;
+    saved.x_freeze_delta = record->x_freeze_delta;
+    saved.y_freeze_delta = record->y_freeze_delta;
+    saved.domain_seen = record->domain_word;
+    saved.counters = record->counters;
+    damper_state_restore (&device->state, &saved);
+
+    device->discarding = record->discarding;
+    device->bypassed_frames = record->bypassed_frames;
+    device->suppressed_frames = record->suppressed_frames;
+    device->drops = record->drops;
+    device->reported_drops = record->drops;
+}
+
+gboolean
+upgrade_resume (gint fd, UpgradeAttachFunc attach)
+{
+    UpgradeHeader header;
+    gboolean compatible;
+    gchar *buffer;
+
+    if (!read_all (fd, &header, sizeof (header)) || header.magic != UPGRADE_MAGIC ||
+        header.device_size < 2 * sizeof (gint32) || header.device_size > UPGRADE_MAX_DEVICE_SIZE) {
+        g_warning ("No device state to resume from fd %d", fd);
+        close (fd);
+        return FALSE;
+    }
+
+    compatible = header.version == UPGRADE_VERSION && header.device_size == sizeof (UpgradeDevice);
+    if (!compatible)
+        g_warning ("Device state was saved by an incompatible version, recreating the devices");
+
+    buffer = g_malloc0 (MAX (header.device_size, sizeof (UpgradeDevice)));
+
+    for (guint i = 0; i < header.n_devices; i++) {
+        const UpgradeDevice *record = (const UpgradeDevice *) buffer;
+
+        if (!read_all (fd, buffer, header.device_size))
+            break;
+
+        if (compatible)
+            resume_device (record, attach);
+        else
+            release_fds (record);
+    }
+
+    g_free (buffer);
+    close (fd);
+
+    return compatible;
+}
@@ -0,0 +1,38 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include "mouse_device.h"
+
+/* Live upgrade: the daemon re-executes the installed binary and hands
+ * every device's grabbed input fd, uinput fd and filter state to the new
+ * image through a memfd, named by --resume=FD. Grabs and virtual
+ * devices stay in place throughout, and events arriving meanwhile wait
+ * in the kernel's evdev buffers. */
+
+typedef void (*UpgradeAttachFunc) (MouseDevice *device);
+
+/* Must be called between dispatches, with no other thread handling the
+ * devices. Returns only if the exec failed, leaving every device as it
+ * was. */
+void upgrade_exec (GPtrArray *devices);
+/* Takes over the devices saved at fd. attach is called on each before its
+ * filter state is restored, so it can join its freeze domain first. */
+gboolean upgrade_resume (gint fd, UpgradeAttachFunc attach);
+
+#endif
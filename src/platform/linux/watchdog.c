@@ -0,0 +1,259 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+#include "watchdog.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+
+#define USEC_IN_MSEC 1000
+
+typedef struct {
+    MouseDevice *device;
+    /* device->events_read at the last check */
+    guint64 events_read;
+    /* When input was first seen waiting with no progress, or 0 */
+    gint64 pending_since;
+    /* When the grab was released, or 0 while it is held */
+    gint64 open_since;
+    guint incidents;
+    gint64 open_usec;
+    gint64 longest_usec;
+} WatchedDevice;
+
+gint watchdog_budget_msec = 0;
+
+static GThread *thread = NULL;
+static GMutex lock;
+static GPtrArray *watched = NULL;
+static gint stop_fd = -1;
+
+static gint64
+now_usec (void)
+{
+    struct timespec now;
+
+    /* The clock of the devices' event timestamps */
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (gint64) now.tv_sec * G_USEC_PER_SEC + now.tv_nsec / 1000;
+}
+
+static void
+fail_open (WatchedDevice *w)
+{
+    MouseDevice *device = w->device;
+    gint64 start;
+
+    /* The ioctl behind LIBEVDEV_UNGRAB; the libevdev handle belongs to
+     * the stalled thread */
+    if (ioctl (device->fd, EVIOCGRAB, 0) < 0) {
+        g_warning ("Could not release the grab of %s: %s", device->input_devnode, strerror (errno));
+        return;
+    }
+
+    start = now_usec ();
+    w->open_since = start;
+    w->pending_since = 0;
+    w->incidents++;
+
+    atomic_store_explicit (&device->fail_open_end, 0, memory_order_relaxed);
+    atomic_store_explicit (&device->fail_open_start, start, memory_order_release);
+
+    g_warning ("Input from %s stalled for over %dms, releasing its grab",
+               device->input_devnode, watchdog_budget_msec);
+}
+
+static gboolean
+regrab (WatchedDevice *w)
+{
+    MouseDevice *device = w->device;
+    gint64 end = now_usec ();
+    gint64 duration = end - w->open_since;
+
+    if (ioctl (device->fd, EVIOCGRAB, 1) < 0) {
+        g_warning ("Could not grab %s again: %s", device->input_devnode, strerror (errno));
+        return FALSE;
+    }
+
+    atomic_store_explicit (&device->fail_open_end, end, memory_order_release);
+
+    w->open_since = 0;
+    w->open_usec += duration;
+    if (duration > w->longest_usec)
+        w->longest_usec = duration;
+
+    g_message ("Grab of %s restored after %" G_GINT64_FORMAT "ms unfiltered",
+               device->input_devnode, duration / USEC_IN_MSEC);
+    return TRUE;
+}
+
+static void
+check_device (WatchedDevice *w, gint64 now)
+{
+    struct pollfd pfd = { w->device->fd, POLLIN, 0 };
+    guint64 events_read = atomic_load_explicit (&w->device->events_read, memory_order_relaxed);
+    gboolean pending = poll (&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+    gboolean progress = events_read != w->events_read;
+
+    w->events_read = events_read;
+
+    /* Back once it has caught up with what arrived meanwhile */
+    if (w->open_since) {
+        if (progress && !pending)
+            regrab (w);
+        return;
+    }
+
+    if (!pending || progress) {
+        w->pending_since = pending ? now : 0;
+        return;
+    }
+
+    if (w->pending_since == 0)
+        w->pending_since = now;
+    else if (now - w->pending_since >= (gint64) watchdog_budget_msec * USEC_IN_MSEC)
+        fail_open (w);
+}
+
+static gpointer
+watchdog_thread (gpointer data)
+{
+    /* A few checks per budget bounds how late a stall is noticed */
+    gint interval = MAX (watchdog_budget_msec / 4, 1);
+    struct pollfd pfd = { stop_fd, POLLIN, 0 };
+    sigset_t mask;
+
+    sigfillset (&mask);
+    pthread_sigmask (SIG_BLOCK, &mask, NULL);
+
+    while (poll (&pfd, 1, interval) == 0 || (pfd.revents & POLLIN) == 0) {
+        gint64 now = now_usec ();
+
+        g_mutex_lock (&lock);
+        for (guint i = 0; i < watched->len; i++)
+            check_device (g_ptr_array_index (watched, i), now);
+        g_mutex_unlock (&lock);
+    }
+
+    return NULL;
+}
+
+gboolean
+watchdog_start (void)
+{
+    if (watchdog_budget_msec <= 0 || thread)
+        return thread != NULL;
+
+    stop_fd = eventfd (0, EFD_CLOEXEC);
+    if (stop_fd < 0) {
+        g_warning ("Could not start the watchdog: %s", strerror (errno));
+        return FALSE;
+    }
+
+    watched = g_ptr_array_new_with_free_func (g_free);
+    thread = g_thread_try_new ("mousedamper-watchdog", watchdog_thread, NULL, NULL);
+    if (thread == NULL) {
+        g_warning ("Could not start the watchdog thread");
+        g_clear_pointer (&watched, g_ptr_array_unref);
+        close (stop_fd);
+        stop_fd = -1;
+        return FALSE;
+    }
+
+    g_print ("Watchdog releases grabs after %dms without progress\n", watchdog_budget_msec);
+    return TRUE;
+}
+
+static void
+print_incidents (WatchedDevice *w)
+{
+    if (w->incidents == 0)
+        return;
+
+    g_print ("Watchdog for %s: %u fail-open incident(s), %" G_GINT64_FORMAT "ms unfiltered, longest %"
+             G_GINT64_FORMAT "ms\n",
+             w->device->input_devnode, w->incidents,
+             w->open_usec / USEC_IN_MSEC, w->longest_usec / USEC_IN_MSEC);
+}
+
+void
+watchdog_stop (void)
+{
+    guint64 value = 1;
+
+    if (thread == NULL)
+        return;
+
+    if (write (stop_fd, &value, sizeof (value)) < 0)
+        g_warning ("Could not stop the watchdog: %s", strerror (errno));
+
+    g_thread_join (thread);
+    thread = NULL;
+    close (stop_fd);
+    stop_fd = -1;
+
+    for (guint i = 0; i < watched->len; i++) {
+        WatchedDevice *w = g_ptr_array_index (watched, i);
+
+        if (w->open_since)
+            regrab (w);
+        print_incidents (w);
+    }
+
+    g_clear_pointer (&watched, g_ptr_array_unref);
+}
+
+void
+watchdog_add_device (MouseDevice *device)
+{
+    WatchedDevice *w;
+
+    if (thread == NULL)
+        return;
+
+    w = g_new0 (WatchedDevice, 1);
+    w->device = device;
+    w->events_read = atomic_load_explicit (&device->events_read, memory_order_relaxed);
+
+    g_mutex_lock (&lock);
+    g_ptr_array_add (watched, w);
+    g_mutex_unlock (&lock);
+}
+
+void
+watchdog_remove_device (MouseDevice *device)
+{
+    if (thread == NULL)
+        return;
+
+    g_mutex_lock (&lock);
+    for (guint i = 0; i < watched->len; i++) {
+        WatchedDevice *w = g_ptr_array_index (watched, i);
+
+        if (w->device == device) {
+            print_incidents (w);
+            g_ptr_array_remove_index_fast (watched, i);
+            break;
+        }
+    }
+    g_mutex_unlock (&lock);
+}
@@ -0,0 +1,40 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include "mouse_device.h"
+
+/* Fail-open watchdog: a grabbed mouse is dead while the daemon is stalled,
+ * whether blocked writing to uinput, stopped in a debugger or waiting on
+ * page faults. A thread checks every device's pending input against the
+ * events it has read; past the budget it releases the grab, so the mouse
+ * works unfiltered, and grabs it again once the daemon has caught up.
+ * mouse_device.c drops what clients got directly in the meantime. */
+
+#define WATCHDOG_DEFAULT_BUDGET_MSEC 50
+
+extern gint watchdog_budget_msec;
+
+gboolean watchdog_start (void);
+/* Regrabs any device left open and prints the incidents */
+void watchdog_stop (void);
+/* No-ops while the watchdog isn't running */
+void watchdog_add_device (MouseDevice *device);
+void watchdog_remove_device (MouseDevice *device);
+
+#endif
@@ -0,0 +1,624 @@
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020 Michael Webster <miketwebster@gmail.com>
+ */
+
+
+/* Worker pool backend: devices are spread over several threads, each with
+ * its own edge-triggered epoll set over the devices it owns. A device that
+ * stays hot is serviced in bounded turns, and workers with nothing to do
+ * steal queued devices from busy ones, so one bursting pointer cannot hold
+ * up the rest. The thread calling run () only waits for quit/signals and
+ * prints per-worker load. */
+
+#define _GNU_SOURCE
+
+#include "event_loop.h"
+#include "arena.h"
+#include "input_thread.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+
+#define MAX_EVENTS 32
+/* Events handled per turn before a hot device goes to the back of the queue */
+#define DISPATCH_BUDGET 64
+#define NSEC_IN_SEC 1000000000LL
+#define MSEC_IN_SEC 1000
+
+int event_loop_workers = 2;
+int event_loop_worker_stats_interval = 0;
+
+enum {
+    DISPATCH_IDLE,
+    DISPATCH_RUNNING,
+    DISPATCH_RERUN
+};
+
+typedef struct _WorkerPool WorkerPool;
+typedef struct _Worker Worker;
+typedef struct _PoolDevice PoolDevice;
+
+struct _PoolDevice {
+    MouseDevice *device;
+    Worker *owner;
+    atomic_int state;
+    atomic_bool queued;
+    atomic_bool removed;
+    /* Ready queue link, protected by the lock of the queue it is on */
+    PoolDevice *next;
+};
+
+static ArenaPool device_pool = ARENA_POOL_INIT (PoolDevice);
+
+static void
+pool_device_free (PoolDevice *pdev)
+{
+    arena_pool_free (&device_pool, pdev);
+}
+
+struct _Worker {
+    WorkerPool *pool;
+    int index;
+    pthread_t thread;
+    int epoll_fd;
+    guint n_devices;
+
+    pthread_mutex_t lock;
+    PoolDevice *ready_head;
+    PoolDevice *ready_tail;
+    /* Written under lock, read without it as a hint by stealers */
+    atomic_uint n_ready;
+
+    atomic_uint_fast64_t dispatches;
+    atomic_uint_fast64_t steals;
+    atomic_uint_fast64_t busy_nsec;
+    uint64_t reported_busy_nsec;
+};
+
+struct _WorkerPool {
+    EventLoop parent;
+    Worker *workers;
+    int n_workers;
+    GPtrArray *devices;
+    /* Written once on shutdown and never read, so every worker sees it */
+    int stop_fd;
+    /* Kicked when a worker has queued devices others could take */
+    int steal_fd;
+    int control_epoll_fd;
+    int quit_fd;
+    int signal_fd;
+    int64_t reported_at;
+};
+
+static int64_t
+now_nsec (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * NSEC_IN_SEC + ts.tv_nsec;
+}
+
+static bool
+watch_fd (int epoll_fd, int fd, uint32_t events, void *ptr)
+{
+    struct epoll_event event = { 0 };
+
+    event.events = events;
+    event.data.ptr = ptr;
+
+    if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        g_warning ("Failed to add fd %d to epoll set: %s", fd, strerror (errno));
+        return false;
+    }
+
+    return true;
+}
+
+static void
+push_ready (Worker *worker, PoolDevice *pdev)
+{
+    /* A device sits on at most one queue at a time */
+    if (atomic_exchange (&pdev->queued, true))
+        return;
+
+    pthread_mutex_lock (&worker->lock);
+    pdev->next = NULL;
+    if (worker->ready_tail)
+        worker->ready_tail->next = pdev;
+    else
+        worker->ready_head = pdev;
+    worker->ready_tail = pdev;
+    worker->n_ready++;
+    pthread_mutex_unlock (&worker->lock);
+}
+
+static PoolDevice *
+pop_ready (Worker *worker)
+{
+    PoolDevice *pdev;
+
+    pthread_mutex_lock (&worker->lock);
+    pdev = worker->ready_head;
+    if (pdev) {
+        worker->ready_head = pdev->next;
+        if (worker->ready_head == NULL)
+            worker->ready_tail = NULL;
+        worker->n_ready--;
+        atomic_store (&pdev->queued, false);
+    }
+    pthread_mutex_unlock (&worker->lock);
+
+    return pdev;
+}
+
+static void
+unqueue (Worker *worker, PoolDevice *pdev)
+{
+    PoolDevice **link;
+
+    pthread_mutex_lock (&worker->lock);
+    worker->ready_tail = NULL;
+    for (link = &worker->ready_head; *link; ) {
+        if (*link == pdev) {
+            *link = pdev->next;
+            worker->n_ready--;
+            atomic_store (&pdev->queued, false);
+        } else {
+            worker->ready_tail = *link;
+            link = &(*link)->next;
+        }
+    }
+    pthread_mutex_unlock (&worker->lock);
+}
+
+static void
+kick_stealers (WorkerPool *pool)
+{
+    uint64_t value = 1;
+
+    if (write (pool->steal_fd, &value, sizeof (value)) < 0 && errno != EAGAIN)
+        g_warning ("Failed to wake idle workers: %s", strerror (errno));
+}
+
+/* Runs a device on this worker unless another worker already is, in which
+ * case that worker is told to go round once more. */
+static void
+run_device (Worker *worker, PoolDevice *pdev)
+{
+    int expected = DISPATCH_IDLE;
+    int64_t start;
+
+    if (atomic_load (&pdev->removed))
+        return;
+
+    if (!atomic_compare_exchange_strong (&pdev->state, &expected, DISPATCH_RUNNING)) {
+        expected = DISPATCH_RUNNING;
+        atomic_compare_exchange_strong (&pdev->state, &expected, DISPATCH_RERUN);
+        return;
+    }
+
+    /* pool_remove_device () sets removed and then waits for IDLE, so one
+     * of the two of us sees the other */
+    if (atomic_load (&pdev->removed)) {
+        atomic_store (&pdev->state, DISPATCH_IDLE);
+        return;
+    }
+
+    start = now_nsec ();
+
+    while (true) {
+        gboolean more = mouse_device_dispatch_budget (pdev->device, DISPATCH_BUDGET);
+
+        atomic_fetch_add (&worker->dispatches, 1);
+
+        if (more) {
+            atomic_store (&pdev->state, DISPATCH_IDLE);
+            push_ready (worker, pdev);
+            break;
+        }
+
+        expected = DISPATCH_RUNNING;
+        if (atomic_compare_exchange_strong (&pdev->state, &expected, DISPATCH_IDLE))
+            break;
+
+        atomic_store (&pdev->state, DISPATCH_RUNNING);
+    }
+
+    atomic_fetch_add (&worker->busy_nsec, now_nsec () - start);
+}
+
+static bool
+try_steal (Worker *worker)
+{
+    WorkerPool *pool = worker->pool;
+
+    for (int i = 1; i < pool->n_workers; i++) {
+        Worker *victim = &pool->workers[(worker->index + i) % pool->n_workers];
+        PoolDevice *pdev;
+
+        if (victim->n_ready == 0)
+            continue;
+
+        pdev = pop_ready (victim);
+        if (pdev) {
+            atomic_fetch_add (&worker->steals, 1);
+            run_device (worker, pdev);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void *
+worker_func (void *data)
+{
+    Worker *worker = data;
+    WorkerPool *pool = worker->pool;
+    struct epoll_event events[MAX_EVENTS];
+
+    input_thread_setup_current (worker->index);
+
+    while (true) {
+        PoolDevice *pdev;
+        int n;
+
+        while ((pdev = pop_ready (worker)) != NULL) {
+            if (worker->n_ready > 0)
+                kick_stealers (pool);
+            run_device (worker, pdev);
+        }
+
+        if (try_steal (worker))
+            continue;
+
+        n = epoll_wait (worker->epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            g_warning ("Worker %d: epoll_wait failed: %s", worker->index, strerror (errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+
+            if (ptr == &pool->stop_fd)
+                return NULL;
+
+            if (ptr == &pool->steal_fd) {
+                uint64_t value;
+
+                /* Whoever reads it first goes stealing; the rest carry on */
+                if (read (pool->steal_fd, &value, sizeof (value)) < 0 && errno != EAGAIN)
+                    g_warning ("Worker %d: failed to read steal eventfd: %s", worker->index, strerror (errno));
+                continue;
+            }
+
+            pdev = ptr;
+            if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                /* Edge-triggered, so this is reported once; the device may
+                 * already be freed, hotplug removes it from the pool */
+                if (!atomic_load (&pdev->removed))
+                    g_warning ("Device disconnected or error occurred");
+                continue;
+            }
+
+            push_ready (worker, pdev);
+        }
+    }
+
+    return NULL;
+}
+
+static void
+print_load (WorkerPool *pool)
+{
+    int64_t now = now_nsec ();
+    int64_t elapsed = now - pool->reported_at;
+
+    for (int i = 0; i < pool->n_workers; i++) {
+        Worker *worker = &pool->workers[i];
+        uint64_t busy = atomic_load (&worker->busy_nsec);
+
+        g_print ("Worker %d: %u device(s), %lu dispatches, %lu stolen, %.1f%% busy\n",
+                 i,
+                 worker->n_devices,
+                 (unsigned long) atomic_load (&worker->dispatches),
+                 (unsigned long) atomic_load (&worker->steals),
+                 elapsed > 0 ? 100.0 * (busy - worker->reported_busy_nsec) / elapsed : 0.0);
+
+        worker->reported_busy_nsec = busy;
+    }
+
+    pool->reported_at = now;
+}
+
+static void
+close_fd (int fd)
+{
+    if (fd >= 0)
+        close (fd);
+}
+
+static void
+pool_free (EventLoop *base)
+{
+    WorkerPool *pool = (WorkerPool *) base;
+
+    for (int i = 0; i < pool->n_workers; i++) {
+        close_fd (pool->workers[i].epoll_fd);
+        pthread_mutex_destroy (&pool->workers[i].lock);
+    }
+
+    close_fd (pool->stop_fd);
+    close_fd (pool->steal_fd);
+    close_fd (pool->control_epoll_fd);
+    close_fd (pool->quit_fd);
+    close_fd (pool->signal_fd);
+
+    if (pool->devices)
+        g_ptr_array_unref (pool->devices);
+
+    g_free (pool->workers);
+    g_free (pool);
+}
+
+static EventLoop *
+pool_new (bool handle_signals)
+{
+    WorkerPool *pool = g_new0 (WorkerPool, 1);
+
+    pool->n_workers = event_loop_workers;
+    pool->workers = g_new0 (Worker, pool->n_workers);
+    pool->devices = g_ptr_array_new_with_free_func ((GDestroyNotify) pool_device_free);
+    pool->signal_fd = -1;
+
+    pool->stop_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+    pool->steal_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+    pool->quit_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+    pool->control_epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+
+    for (int i = 0; i < pool->n_workers; i++) {
+        Worker *worker = &pool->workers[i];
+
+        worker->pool = pool;
+        worker->index = i;
+        pthread_mutex_init (&worker->lock, NULL);
+        worker->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+
+        if (worker->epoll_fd < 0 ||
+            !watch_fd (worker->epoll_fd, pool->stop_fd, EPOLLIN, &pool->stop_fd) ||
+            !watch_fd (worker->epoll_fd, pool->steal_fd, EPOLLIN | EPOLLEXCLUSIVE, &pool->steal_fd)) {
+            g_warning ("Failed to set up worker %d", i);
+            pool_free (&pool->parent);
+            return NULL;
+        }
+    }
+
+    if (pool->stop_fd < 0 || pool->steal_fd < 0 || pool->quit_fd < 0 || pool->control_epoll_fd < 0 ||
+        !watch_fd (pool->control_epoll_fd, pool->quit_fd, EPOLLIN, &pool->quit_fd)) {
+        g_warning ("Failed to set up the worker pool: %s", strerror (errno));
+        pool_free (&pool->parent);
+        return NULL;
+    }
+
+    if (handle_signals) {
+        sigset_t mask;
+
+        sigemptyset (&mask);
+        sigaddset (&mask, SIGINT);
+        sigaddset (&mask, SIGTERM);
+        sigprocmask (SIG_BLOCK, &mask, NULL);
+
+        pool->signal_fd = signalfd (-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+        if (pool->signal_fd < 0 ||
+            !watch_fd (pool->control_epoll_fd, pool->signal_fd, EPOLLIN, &pool->signal_fd)) {
+            g_warning ("Failed to create signalfd: %s", strerror (errno));
+            pool_free (&pool->parent);
+            return NULL;
+        }
+    }
+
+    return &pool->parent;
+}
+
+static bool
+pool_add_device (EventLoop *base, MouseDevice *device)
+{
+    WorkerPool *pool = (WorkerPool *) base;
+    PoolDevice *pdev = arena_pool_alloc (&device_pool);
+    Worker *owner = &pool->workers[0];
+
+    if (pdev == NULL)
+        return false;
+
+    for (int i = 1; i < pool->n_workers; i++) {
+        if (pool->workers[i].n_devices < owner->n_devices)
+            owner = &pool->workers[i];
+    }
+
+    pdev->device = device;
+    pdev->owner = owner;
+    atomic_init (&pdev->state, DISPATCH_IDLE);
+    atomic_init (&pdev->queued, false);
+    atomic_init (&pdev->removed, false);
+
+    if (!watch_fd (owner->epoll_fd, device->fd, EPOLLIN | EPOLLET, pdev)) {
+        pool_device_free (pdev);
+        return false;
+    }
+
+    owner->n_devices++;
+    g_ptr_array_add (pool->devices, pdev);
+
+    /* Edge-triggered: pick up anything that arrived before we watched.
+     * When added while running, the owner may be asleep; wake a worker. */
+    push_ready (owner, pdev);
+    kick_stealers (pool);
+
+    return true;
+}
+
+static void
+pool_remove_device (EventLoop *base, MouseDevice *device)
+{
+    WorkerPool *pool = (WorkerPool *) base;
+
+    for (guint i = 0; i < pool->devices->len; i++) {
+        PoolDevice *pdev = g_ptr_array_index (pool->devices, i);
+
+        if (pdev->device != device || atomic_load (&pdev->removed))
+            continue;
+
+        atomic_store (&pdev->removed, true);
+        epoll_ctl (pdev->owner->epoll_fd, EPOLL_CTL_DEL, device->fd, NULL);
+        pdev->owner->n_devices--;
+
+        for (int w = 0; w < pool->n_workers; w++)
+            unqueue (&pool->workers[w], pdev);
+
+        /* Let a dispatch already in progress finish. The entry itself is
+         * kept until the pool goes away, a worker may still hold it. */
+        while (atomic_load (&pdev->state) != DISPATCH_IDLE)
+            sched_yield ();
+
+        return;
+    }
+}
+
+static bool
+pool_add_watch (EventLoop *base, EventLoopWatch *watch)
+{
+    WorkerPool *pool = (WorkerPool *) base;
+
+    return watch_fd (pool->control_epoll_fd, watch->fd, EPOLLIN, watch);
+}
+
+static void
+pool_remove_watch (EventLoop *base, EventLoopWatch *watch)
+{
+    WorkerPool *pool = (WorkerPool *) base;
+
+    epoll_ctl (pool->control_epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+}
+
+static void
+pool_run (EventLoop *base)
+{
+    WorkerPool *pool = (WorkerPool *) base;
+    int timeout = event_loop_worker_stats_interval > 0 ? event_loop_worker_stats_interval * MSEC_IN_SEC : -1;
+    bool running = true;
+    uint64_t value = 1;
+
+    if (input_thread_config.enabled)
+        input_thread_acquire_resources ();
+
+    pool->reported_at = now_nsec ();
+
+    for (int i = 0; i < pool->n_workers; i++) {
+        pthread_attr_t attr;
+        int rc;
+
+        pthread_attr_init (&attr);
+        pthread_attr_setstacksize (&attr, INPUT_THREAD_STACK_SIZE_BYTES);
+        rc = pthread_create (&pool->workers[i].thread, &attr, worker_func, &pool->workers[i]);
+        pthread_attr_destroy (&attr);
+
+        if (rc != 0) {
+            g_warning ("Failed to start worker %d: %s", i, strerror (rc));
+            pool->n_workers = i;
+            running = false;
+            break;
+        }
+    }
+
+    while (running) {
+        struct epoll_event events[2 + EVENT_LOOP_MAX_WATCHES];
+        int n = epoll_wait (pool->control_epoll_fd, events, G_N_ELEMENTS (events), timeout);
+
+        if (n < 0 && errno != EINTR) {
+            g_warning ("epoll_wait failed: %s", strerror (errno));
+            break;
+        }
+
+        if (n == 0) {
+            print_load (pool);
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            EventLoopWatch *watch = events[i].data.ptr;
+
+            if (event_loop_is_watch (base, watch)) {
+                if (watch->fd >= 0)
+                    watch->callback (watch->data);
+                continue;
+            }
+
+            if (events[i].data.ptr == &pool->signal_fd) {
+                struct signalfd_siginfo info;
+
+                if (read (pool->signal_fd, &info, sizeof (info)) == sizeof (info))
+                    g_print ("Received signal, shutting down...\n");
+            }
+            running = false;
+        }
+    }
+
+    if (write (pool->stop_fd, &value, sizeof (value)) < 0)
+        g_warning ("Failed to stop workers: %s", strerror (errno));
+
+    for (int i = 0; i < pool->n_workers; i++)
+        pthread_join (pool->workers[i].thread, NULL);
+
+    print_load (pool);
+
+    if (input_thread_config.enabled)
+        input_thread_release_resources ();
+}
+
+static void
+pool_quit (EventLoop *base)
+{
+    WorkerPool *pool = (WorkerPool *) base;
+    uint64_t value = 1;
+
+    if (write (pool->quit_fd, &value, sizeof (value)) < 0)
+        g_warning ("Failed to wake worker pool: %s", strerror (errno));
+}
+
+const EventLoopBackend event_loop_backend_workers = {
+    .name = "workers",
+    .new = pool_new,
+    .add_device = pool_add_device,
+    .remove_device = pool_remove_device,
+    .add_watch = pool_add_watch,
+    .remove_watch = pool_remove_watch,
+    .run = pool_run,
+    .quit = pool_quit,
+    .free = pool_free
+};
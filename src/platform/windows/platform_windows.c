@@ -71,6 +71,7 @@ low_level_mouse_proc (int nCode, WPARAM wParam, LPARAM lParam)
     bool handled = false;
 
     event.timestamp_usec = get_timestamp_usec ();
+    damper_state_sync_params (&damper_state);
 
     switch (wParam) {
         case WM_LBUTTONDOWN:
@@ -125,6 +126,13 @@ console_ctrl_handler (DWORD ctrl_type)
     return FALSE;
 }
 
+static bool
+platform_windows_set_option (const char *name, const char *value)
+{
+    /* No platform-specific options on Windows */
+    return false;
+}
+
 static bool
 platform_windows_init (int64_t double_click_time_usec, int threshold_px, bool verbose)
 {
@@ -186,6 +194,7 @@ const PlatformInterface *
 platform_get_interface (void)
 {
     static const PlatformInterface windows_platform = {
+        .set_option = platform_windows_set_option,
         .init = platform_windows_init,
         .run = platform_windows_run,
         .cleanup = platform_windows_cleanup